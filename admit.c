@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "stats.h"
+#include "admit.h"
+
+struct bucket
+{
+  uint32_t key[4];  /* IPv6 address or IPv4 one in the first word */
+  uint64_t stamp;   /* usec tokens were counted at, 0 if slot is unused */
+  double tokens;
+};
+
+static double admit_rate, admit_burst;
+static __thread struct bucket * buckets;
+
+void admit_init(double rate, double burst)
+{
+  admit_rate = rate;
+  admit_burst = burst;
+}
+
+/* charges bucket of sender for operations, returns 0 if it has to be dropped */
+int admit_message(const struct sockaddr * src, int ops)
+{
+  uint32_t key[4] = { 0, 0, 0, 0 };
+
+  if (src->sa_family == AF_INET)
+    key[0] = ((const struct sockaddr_in *)src)->sin_addr.s_addr;
+  else if (src->sa_family == AF_INET6)
+    memcpy(key, &((const struct sockaddr_in6 *)src)->sin6_addr, sizeof(key));
+  else
+    return 1;
+  if (!buckets && !(buckets = (struct bucket *)calloc(ADMIT_SLOTS,
+          sizeof(struct bucket))))
+    return 1;
+
+  uint32_t h = (key[0] ^ key[1] ^ key[2] ^ key[3]) * 0x9e3779b1U;
+  struct bucket * set = &buckets[(h >> 20 & (ADMIT_SLOTS - 1)) &
+      ~(ADMIT_WAYS - 1)];
+  struct bucket * b = set;
+  uint64_t now = stats_usec();
+  int i;
+  for (i = 0; i < ADMIT_WAYS; ++i)
+  {
+    if (set[i].stamp && !memcmp(set[i].key, key, sizeof(key)))
+    {
+      b = &set[i];
+      break;
+    }
+    if (set[i].stamp < b->stamp)
+      b = &set[i];
+  }
+  if (!b->stamp)
+    b->tokens = admit_burst;
+  else if ((b->tokens += (now - b->stamp) * admit_rate / 1e6) > admit_burst)
+    b->tokens = admit_burst;
+  memcpy(b->key, key, sizeof(key));
+  b->stamp = now;
+
+  if (b->tokens < (ops < admit_burst ? ops : admit_burst))
+  {
+    STATS_INC(stats.admit_limited);
+    STATS_ADD(stats.admit_limited_ops, ops);
+    return 0;
+  }
+  b->tokens -= ops;
+  return 1;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#define ADMIT_SLOTS 4096 /* sources tracked by every receiving thread */
+#define ADMIT_WAYS 4     /* slots sender may be kept in */
+
+/*
+ * Per-source admission control: every sender address has token bucket
+ * refilled at rate operations per second up to burst, message is admitted
+ * only if there are tokens for all of its operations. Buckets are kept by
+ * thread receiving messages in set-associative table, sender not found in
+ * its set takes over the least recently charged bucket with the tokens it
+ * would have by now, so only unused slot grants full burst. Senders of
+ * unknown address (unix sockets) are not limited.
+ */
+void admit_init(double rate, double burst);
+int admit_message(const struct sockaddr * src, int ops);
+
+#endif
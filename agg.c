@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ipfwtabled.h"
+#include "backend.h"
+#include "memtbl.h"
+#include "lpm.h"
+#include "stats.h"
+#include "log.h"
+#include "agg.h"
+
+#define AGG_MASK(len) ((len) ? 0xffffffffU << (32 - (len)) : 0)
+#define AGG_SCAN 256 /* entries visited at once while collecting range */
+
+static const struct backend * inner;
+static const int8_t * agg_len; /* per table, -1 if it is not aggregated */
+static uint32_t agg_tables;
+
+/* members and prefixes installed into kernel, both ordered and hashed */
+static struct memtbl * mbr_index, * krn_index;
+static struct lpm * mbr_lpm, * krn_lpm;
+
+/* operations for kernel produced by batch, owner is index of member op */
+static __thread struct tbl_op * kops;
+static __thread int * kown, * kerrs;
+static __thread size_t kcnt, ksize;
+
+/* scratch for prefixes of range */
+static __thread struct tbl_op * rng;
+static __thread size_t rng_cnt, rng_size;
+
+static int kemit(int table, int cmd, uint32_t key, uint8_t len, int owner)
+{
+  if (kcnt == ksize)
+  {
+    size_t size = ksize ? 2 * ksize : MESSAGE_V2_MAXRECS;
+    struct tbl_op * ops = (struct tbl_op *)realloc(kops, size * sizeof(*ops));
+    if (ops)
+      kops = ops;
+    int * own = (int *)realloc(kown, size * sizeof(int));
+    if (own)
+      kown = own;
+    int * errs = (int *)realloc(kerrs, size * sizeof(int));
+    if (errs)
+      kerrs = errs;
+    if (!ops || !own || !errs)
+      return -1;
+    ksize = size;
+  }
+  struct tbl_op * op = &kops[kcnt];
+  op->table = table;
+  op->cmd = cmd;
+  op->mask = len;
+  op->addr = htonl(key);
+  op->arg = 0;
+  kown[kcnt++] = owner;
+  return 0;
+}
+
+/* prefix installed into kernel which covers the given one */
+static int covered(int table, uint32_t key, uint8_t len, uint32_t * ckey,
+    uint8_t * clen)
+{
+  uint8_t mask;
+  time_t unused;
+
+  if (lpm_lookup(krn_lpm, table, htonl(key), &mask, &unused) < 0 ||
+      mask > len)
+    return 0;
+  if (ckey)
+  {
+    *ckey = key & AGG_MASK(mask);
+    *clen = mask;
+  }
+  return 1;
+}
+
+static void install(int table, uint32_t key, uint8_t len, int owner)
+{
+  if (kemit(table, CMD_ADD, key, len, owner) < 0 ||
+      lpm_add(krn_lpm, table, htonl(key), len) < 0)
+    return;
+  memtbl_add(krn_index, table, htonl(key), len, 0);
+  STATS_INC(stats.agg_kernel);
+}
+
+static void uninstall(int table, uint32_t key, uint8_t len, int owner)
+{
+  if (kemit(table, CMD_DEL, key, len, owner) < 0 ||
+      lpm_del(krn_lpm, table, htonl(key), len) < 0)
+    return;
+  memtbl_del(krn_index, table, htonl(key), len, NULL);
+  STATS_ADD(stats.agg_kernel, -1);
+}
+
+struct range
+{
+  uint32_t key;
+  uint8_t len;
+  int past;         /* walk went past the range */
+};
+
+static void range_entry(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg)
+{
+  struct range * r = (struct range *)arg;
+
+  if (r->past || mask < r->len || (ntohl(addr) & AGG_MASK(r->len)) != r->key)
+  {
+    r->past = 1;
+    return;
+  }
+  if (rng_cnt == rng_size)
+  {
+    size_t size = rng_size ? 2 * rng_size : AGG_SCAN;
+    struct tbl_op * ops = (struct tbl_op *)realloc(rng, size * sizeof(*ops));
+    if (!ops)
+    {
+      r->past = 1;
+      return;
+    }
+    rng = ops;
+    rng_size = size;
+  }
+  struct tbl_op * op = &rng[rng_cnt++];
+  op->table = table;
+  op->mask = mask;
+  op->addr = addr;
+}
+
+/* collects entries of index covered by prefix (itself included) into rng */
+static void collect(struct memtbl * mt, int table, uint32_t key, uint8_t len)
+{
+  struct range r = { key, len, 0 };
+  uint64_t pos = MEMTBL_POS(key, len);
+
+  rng_cnt = 0;
+  while (!r.past && memtbl_scan(mt, table, &pos, range_entry, &r, AGG_SCAN) ==
+      AGG_SCAN)
+    ;
+}
+
+/*
+ * Aggregates prefixes of rng in walk order in place: drops covered ones and
+ * replaces sibling pairs by their parent as long as it is not shorter than
+ * minlen. Returns amount of prefixes left.
+ */
+static size_t merge(uint8_t minlen)
+{
+  size_t i, top = 0;
+
+  for (i = 0; i < rng_cnt; ++i)
+  {
+    if (top && rng[top - 1].mask <= rng[i].mask && !((rng[i].addr ^
+            rng[top - 1].addr) & htonl(AGG_MASK(rng[top - 1].mask))))
+      continue;
+    rng[top++] = rng[i];
+    while (top > 1 && rng[top - 1].mask == rng[top - 2].mask &&
+        rng[top - 1].mask > minlen && (ntohl(rng[top - 1].addr) ^
+          ntohl(rng[top - 2].addr)) == 1U << (32 - rng[top - 1].mask))
+    {
+      --top;
+      --rng[top - 1].mask;
+    }
+  }
+  return top;
+}
+
+static int agg_member_add(int table, uint32_t key, uint8_t len, int owner)
+{
+  uint32_t top = key;
+  uint8_t tlen = len;
+  size_t i;
+
+  if (lpm_add(mbr_lpm, table, htonl(key), len) < 0)
+    return errno == EEXIST ? 0 : errno; /* re-added, same as backends do */
+  if (memtbl_add(mbr_index, table, htonl(key), len, 0) < 0)
+  {
+    int err = errno;
+    lpm_del(mbr_lpm, table, htonl(key), len);
+    return err;
+  }
+  STATS_INC(stats.agg_entries);
+  if (covered(table, key, len, NULL, NULL))
+    return 0;
+
+  /* climb while sibling is covered as a whole */
+  while (tlen > agg_len[table] && covered(table,
+        top ^ (1U << (32 - tlen)), tlen, NULL, NULL))
+  {
+    --tlen;
+    top &= AGG_MASK(tlen);
+  }
+  collect(krn_index, table, top, tlen);
+  install(table, top, tlen, owner);
+  for (i = 0; i < rng_cnt; ++i) /* superseded, removed once it is in place */
+    uninstall(table, ntohl(rng[i].addr), rng[i].mask, owner);
+  return 0;
+}
+
+static int agg_member_del(int table, uint32_t key, uint8_t len, int owner)
+{
+  uint32_t ckey;
+  uint8_t clen;
+  size_t i, cnt;
+
+  if (lpm_del(mbr_lpm, table, htonl(key), len) < 0)
+    return errno;
+  memtbl_del(mbr_index, table, htonl(key), len, NULL);
+  STATS_ADD(stats.agg_entries, -1);
+  if (!covered(table, key, len, &ckey, &clen))
+    return 0;
+
+  /* split prefix which covered member into what is left of it */
+  collect(mbr_index, table, ckey, clen);
+  cnt = merge(agg_len[table]);
+  if (cnt == 1 && rng[0].mask == clen)
+    return 0;
+  for (i = 0; i < cnt; ++i)
+    install(table, ntohl(rng[i].addr), rng[i].mask, owner);
+  uninstall(table, ckey, clen, owner);
+  return 0;
+}
+
+static void agg_table_flush(int table, int owner)
+{
+  STATS_ADD(stats.agg_entries, -(uint64_t)memtbl_count(mbr_index, table));
+  STATS_ADD(stats.agg_kernel, -(uint64_t)memtbl_count(krn_index, table));
+  memtbl_flush(mbr_index, table);
+  memtbl_flush(krn_index, table);
+  lpm_flush(mbr_lpm, table);
+  lpm_flush(krn_lpm, table);
+  kemit(table, CMD_FLUSH, 0, 0, owner);
+}
+
+static int agg_batch(const struct tbl_op * ops, int cnt, int * errs)
+{
+  int i, failed = 0, lerrs[MESSAGE_V2_MAXRECS];
+  size_t k;
+
+  if (cnt > MESSAGE_V2_MAXRECS)
+  {
+    failed = agg_batch(ops + MESSAGE_V2_MAXRECS, cnt - MESSAGE_V2_MAXRECS,
+        errs ? errs + MESSAGE_V2_MAXRECS : NULL);
+    cnt = MESSAGE_V2_MAXRECS;
+  }
+
+  kcnt = 0;
+  for (i = 0; i < cnt; ++i)
+  {
+    const struct tbl_op * op = &ops[i];
+    uint32_t key = ntohl(op->addr) & AGG_MASK(op->mask);
+
+    lerrs[i] = 0;
+    if (op->table >= agg_tables || agg_len[op->table] < 0)
+    {
+      if (kemit(op->table, op->cmd, ntohl(op->addr), op->mask, i) < 0)
+        lerrs[i] = errno;
+      else
+        kops[kcnt - 1].arg = op->arg;
+      continue;
+    }
+    switch (op->cmd)
+    {
+      case CMD_ADD:
+        lerrs[i] = agg_member_add(op->table, key, op->mask, i);
+        break;
+      case CMD_DEL:
+        lerrs[i] = agg_member_del(op->table, key, op->mask, i);
+        break;
+      case CMD_FLUSH:
+        agg_table_flush(op->table, i);
+        break;
+    }
+  }
+
+  if (kcnt && inner->batch(kops, kcnt, kerrs))
+    for (k = 0; k < kcnt; ++k)
+    {
+      int o = kown[k];
+      if (!kerrs[k])
+        continue;
+      if (agg_len[ops[o].table] < 0)
+        lerrs[o] = kerrs[k];
+      else if (!(kops[k].cmd == CMD_ADD && kerrs[k] == EEXIST) &&
+          !(kops[k].cmd == CMD_DEL && kerrs[k] == ESRCH))
+        /*
+         * member change stands and is reported as applied, only kernel
+         * table is out of sync with it until prefix is updated again
+         */
+        STATS_INC(stats.agg_failed);
+    }
+
+  for (i = 0; i < cnt; ++i)
+  {
+    if (lerrs[i])
+      ++failed;
+    if (errs)
+      errs[i] = lerrs[i];
+  }
+  return failed;
+}
+
+static int agg_one(int table, int cmd, in_addr_t addr, uint8_t mask)
+{
+  struct tbl_op op = { table, cmd, mask, addr, 0 };
+  int err;
+
+  agg_batch(&op, 1, &err);
+  errno = err;
+  return err ? -1 : 0;
+}
+
+static int agg_add(int table, in_addr_t addr, uint8_t mask)
+{
+  return agg_one(table, CMD_ADD, addr, mask);
+}
+
+static int agg_del(int table, in_addr_t addr, uint8_t mask)
+{
+  return agg_one(table, CMD_DEL, addr, mask);
+}
+
+static int agg_flush(int table)
+{
+  return agg_one(table, CMD_FLUSH, 0, 0);
+}
+
+struct list_arg
+{
+  backend_list_cb cb;
+  void * arg;
+};
+
+static void list_member(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg)
+{
+  struct list_arg * la = (struct list_arg *)arg;
+  la->cb(table, addr, mask, la->arg);
+}
+
+static int agg_list(int table, backend_list_cb cb, void * arg)
+{
+  struct list_arg la = { cb, arg };
+
+  if (agg_len[table] < 0)
+    return inner->list(table, cb, arg);
+  return memtbl_walk(mbr_index, table, list_member, &la);
+}
+
+static int agg_size(int table)
+{
+  if (agg_len[table] < 0)
+    return inner->size(table);
+  return (int)memtbl_count(mbr_index, table);
+}
+
+static int agg_init(uint32_t * tables_max)
+{
+  return inner->init(tables_max);
+}
+
+static const struct backend agg_backend =
+{
+  "agg",
+  agg_init,
+  agg_add,
+  agg_del,
+  agg_flush,
+  agg_batch,
+  agg_list,
+  agg_size
+};
+
+/* entries found in kernel table are taken for members as they are */
+static void seed_entry(int table, in_addr_t addr, uint8_t mask, void * arg)
+{
+  if (lpm_add(mbr_lpm, table, addr, mask) < 0)
+    return;
+  memtbl_add(mbr_index, table, addr, mask, 0);
+  lpm_add(krn_lpm, table, addr, mask);
+  memtbl_add(krn_index, table, addr, mask, 0);
+  STATS_INC(stats.agg_entries);
+  STATS_INC(stats.agg_kernel);
+}
+
+/*
+ * Wraps initialized backend aggregating tables with len of 0..32, returns
+ * NULL if state can't be allocated.
+ */
+const struct backend * agg_wrap(const struct backend * be, uint32_t tables,
+    const int8_t * len)
+{
+  uint32_t i;
+
+  inner = be;
+  agg_len = len;
+  agg_tables = tables;
+  mbr_index = memtbl_new(tables);
+  krn_index = memtbl_new(tables);
+  mbr_lpm = lpm_new(tables);
+  krn_lpm = lpm_new(tables);
+  if (!mbr_index || !krn_index || !mbr_lpm || !krn_lpm)
+    return NULL;
+  for (i = 0; i < tables; ++i)
+    if (len[i] >= 0)
+      STATS_INC(stats.agg_tables);
+  for (i = 0; i < tables; ++i)
+    if (len[i] >= 0 && be->list(i, seed_entry, NULL) < 0)
+      logmsg(LOG_WARNING, "Failed to list table %u: %s", i, strerror(errno));
+  return &agg_backend;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AGG_H
+#define AGG_H
+
+#define AGG_DEFAULT_LEN 24 /* shortest prefix entries are aggregated into */
+
+/*
+ * CIDR aggregation of tables. Backend is wrapped so that entries (members)
+ * of aggregated tables are kept by the daemon while kernel table holds the
+ * least set of prefixes covering them: two sibling prefixes present are
+ * replaced by the one covering both unless it is shorter than aggregation
+ * length of table. Deleting member splits prefix covering it back into the
+ * remaining ones. Members are what is reported by list() and size() of
+ * wrapper thus expiry and queries work with members as usual.
+ */
+const struct backend * agg_wrap(const struct backend * be, uint32_t tables,
+    const int8_t * len);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "backend.h"
+#include "ipfw.h"
+#include "memtbl.h"
+
+static const struct backend * backends[] =
+{
+#ifdef HAVE_IPFW
+  &ipfw_backend,
+#endif
+  &mem_backend,
+  NULL
+};
+
+/* currently selected backend, first available one by default */
+const struct backend * backend = NULL;
+
+const struct backend * backend_find(const char * name)
+{
+  int i;
+  if (!name)
+    return backends[0];
+  for (i = 0; backends[i]; ++i)
+    if (!strcmp(backends[i]->name, name))
+      return backends[i];
+  return NULL;
+}
+
+void backend_names(char * buf, size_t buflen)
+{
+  int i;
+  buf[0] = '\0';
+  for (i = 0; backends[i]; ++i)
+  {
+    if (i)
+      strncat(buf, "|", buflen - strlen(buf) - 1);
+    strncat(buf, backends[i]->name, buflen - strlen(buf) - 1);
+  }
+}
+
+/*
+ * Generic batch implementation on top of single-entry operations for
+ * backends which have no cheaper way to apply several operations at once.
+ */
+int backend_batch(const struct backend * be,
+    const struct tbl_op * ops, int cnt, int * errs)
+{
+  int i, failed = 0;
+  for (i = 0; i < cnt; ++i)
+  {
+    int rc;
+    switch (ops[i].cmd)
+    {
+      case CMD_ADD:
+        rc = be->add(ops[i].table, ops[i].addr, ops[i].mask);
+        break;
+      case CMD_DEL:
+        rc = be->del(ops[i].table, ops[i].addr, ops[i].mask);
+        break;
+      case CMD_FLUSH:
+        rc = be->flush(ops[i].table);
+        break;
+      case CMD_REFRESH:
+        rc = 0; /* handled by expiry, nothing to do with table */
+        break;
+      default:
+        errno = EINVAL;
+        rc = -1;
+        break;
+    }
+    if (rc < 0)
+      ++failed;
+    if (errs)
+      errs[i] = (rc < 0) ? errno : 0;
+  }
+  return failed;
+}
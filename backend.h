@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#if defined(__FreeBSD__)
+#define HAVE_IPFW
+#endif
+
+typedef void (*backend_list_cb)(int table, in_addr_t addr, uint8_t mask,
+    void * arg);
+
+/*
+ * Table backend. Every operation returns 0 on success or -1 with errno set
+ * (following the kernel: EEXIST, ESRCH etc.). batch() stores per-operation
+ * errno values into errs (if not NULL) and returns amount of failed ones.
+ * size() returns amount of entries in table.
+ */
+struct backend
+{
+  const char * name;
+  int (*init)(uint32_t * tables_max);
+  int (*add)(int table, in_addr_t addr, uint8_t mask);
+  int (*del)(int table, in_addr_t addr, uint8_t mask);
+  int (*flush)(int table);
+  int (*batch)(const struct tbl_op * ops, int cnt, int * errs);
+  int (*list)(int table, backend_list_cb cb, void * arg);
+  int (*size)(int table);
+};
+
+extern const struct backend * backend;
+
+const struct backend * backend_find(const char * name);
+void backend_names(char * buf, size_t buflen);
+int backend_batch(const struct backend * be,
+    const struct tbl_op * ops, int cnt, int * errs);
+
+#endif
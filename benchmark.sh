@@ -0,0 +1,83 @@
+#!/bin/sh
+
+#  Copyright (c) 2012,
+#  Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+#  All rights reserved.
+#  
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of the InvisiLabs nor the
+#        names of its contributors may be used to endorse or promote products
+#        derived from this software without specific prior written permission.
+#  
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+#  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+#  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+#  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+#  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Benchmark scenarios run by loadgen against daemon with in-memory backend.
+# Extra options of daemon (e.g. '-w 4') may be passed as arguments.
+
+PORT=${BENCH_PORT:-12399}
+ADDR=127.0.0.1:$PORT
+DIR=`mktemp -d /tmp/ipfwtabled-bench.XXXXXX`
+STATS=$DIR/stats
+UNIX=$DIR/sock
+PID=
+
+stop_daemon()
+{
+  [ -n "$PID" ] && kill $PID && wait $PID 2>/dev/null
+  PID=
+}
+
+# start_daemon <-t|-u> [options]
+start_daemon()
+{
+  stop_daemon
+  ./ipfwtabled -B mem -b $ADDR -b $UNIX -S $STATS "$@" &
+  PID=$!
+  while [ ! -S $STATS ]; do sleep 0.1; done
+  sleep 0.2
+}
+
+scenario()
+{
+  echo
+  echo "== $1"
+  shift
+  ./loadgen "$@"
+}
+
+trap 'stop_daemon; rm -rf $DIR' EXIT INT TERM
+
+start_daemon -u "$@"
+scenario "steady feed: UDP, 200k ops/s for 5 s" \
+  -b $ADDR -c 2 -r 200000 -d 5 -n 1000000000 -S $STATS
+scenario "burst: UDP, 2M ops at full speed from 4 senders" \
+  -b $ADDR -c 4 -n 2000000 -S $STATS
+rm -f $STATS
+
+start_daemon -t "$@"
+scenario "acknowledged: TCP, 4 connections, 4 messages in flight" \
+  -b $ADDR -t -c 4 -w 4 -n 1000000
+scenario "acknowledged: unix stream, single connection" \
+  -b $UNIX -t -n 500000
+# entries are added reliably to expire all at once
+./loadgen -b $ADDR -t -c 2 -n 1000000 -k 4000000 -m 1:0 -l 2 >/dev/null
+sleep 1
+scenario "expiry storm: TCP latency while 1M entries expire" \
+  -b $ADDR -t -c 2 -d 3 -n 1000000000 -B 16
+scenario "connection storm: TCP, new connection for every message" \
+  -b $ADDR -t -C -c 16 -B 1 -n 100000
@@ -33,41 +33,59 @@ use IO::Socket::INET;
 use IO::Socket::UNIX;
 
 use constant VERSION    => 1;
+use constant VERSION2   => 2;
 use constant CMD_ADD    => 1;
 use constant CMD_DEL    => 2;
 use constant CMD_FLUSH  => 3;
+use constant CMD_REFRESH => 4;
+use constant CMD_LOOKUP => 5;
+use constant CMD_LIST   => 6;
+use constant CMD_REPLACE => 7;
+use constant MSGF_ACK   => 0x01;
+use constant MSGF_MORE  => 0x20;
+use constant MAXRECS    => 1024;
 
 my $usage = <<EOF;
-client.pl <type> <addr> <table> <command> [<subject>]
+client.pl <type> <addr> <table> <command> [<subject> ...]
   <type> = { 'stream' | 'dgram' }
   <addr> = { /path/to/domain.sock | {<hostname>|<ipaddr>}[:<port>] }
   <table> = { 0..IPFW_TABLES_MAX }
-  <command> = { 'add' | 'del' | 'flush' }
-  <subject> = { <ip>[:<port>] }
+  <command> = { 'add' | 'del' | 'flush' | 'refresh' | 'lookup' | 'list' |
+                'replace' }
+  <subject> = { <ip>[/<masklen>][+<ttl>] }
+  several subjects or ones with TTL are sent as single protocol version 2
+  message which is acknowledged by daemon when sent over stream, 'lookup'
+  and 'list' are answered over stream only, 'replace' makes table hold
+  exactly the subjects given (read from standard input, one per line, if
+  there are none) and is served over stream only as well
 EOF
 
-my ($type, $addr, $table, $cmd, $subject) = @ARGV;
+my ($type, $addr, $table, $cmd, @subjects) = @ARGV;
 
 my ($host, $port) = split(/:/, $addr);
 $port = 12345 unless $port;
 unless (defined($host) && defined($port) && defined($table) &&
-        $cmd =~ /^(add|del|flush)$/ &&
+        $cmd =~ /^(add|del|flush|refresh|lookup|list|replace)$/ &&
         $type =~ /^(stream|dgram)$/) {
 
         print STDERR $usage;
         print "LOL\n";
         exit 1;
 }
-my @ip = (0, 0, 0, 0);
-my $mask = 32;
-if ($subject) {
-  if ($subject !~ /^(\d+)\.(\d+)\.(\d+)\.(\d+)(?:\/)?(\d+)?$/) {
+if ($cmd eq 'replace' && !@subjects) {
+  while (my $line = <STDIN>) {
+    $line =~ s/#.*//;
+    push @subjects, $1 if $line =~ /^\s*(\S+)\s*$/;
+  }
+}
+my @entries;
+foreach my $subject (@subjects ? @subjects : ('0.0.0.0/32')) {
+  if ($subject !~ /^(\d+)\.(\d+)\.(\d+)\.(\d+)(?:\/(\d+))?(?:\+(\d+))?$/) {
     print STDERR $usage;
         print "LOL2\n";
     exit 1;
   }
-  @ip = ($1, $2, $3, $4);
-  $mask = $5 if $5;
+  push @entries, [ [$1, $2, $3, $4], $5 ? $5 : 32, $6 ? $6 : 0 ];
 }
 
 my $sock;
@@ -97,18 +115,103 @@ if ($host =~ /^\//) {
     PeerAddr => $host) or die "Can't create socket: $@\n";
 }
 
-my $msg = pack("C", VERSION);
-$msg .= pack("C", $table);
+my $cmdcode;
 if ($cmd eq 'add') {
-  $msg .= pack("C", CMD_ADD);
+  $cmdcode = CMD_ADD;
 } elsif ($cmd eq 'del') {
-  $msg .= pack("C", CMD_DEL);
+  $cmdcode = CMD_DEL;
 } elsif ($cmd eq 'flush') {
-  $msg .= pack("C", CMD_FLUSH);
+  $cmdcode = CMD_FLUSH;
+} elsif ($cmd eq 'refresh') {
+  $cmdcode = CMD_REFRESH;
+} elsif ($cmd eq 'lookup') {
+  $cmdcode = CMD_LOOKUP;
+} elsif ($cmd eq 'list') {
+  $cmdcode = CMD_LIST;
+} elsif ($cmd eq 'replace') {
+  $cmdcode = CMD_REPLACE;
+}
+my $query = ($cmdcode == CMD_LOOKUP || $cmdcode == CMD_LIST);
+
+if ($cmdcode == CMD_REPLACE) {
+  # series of messages with MORE flag on all but the last one
+  for (my $i = 0; $i < @entries; $i += MAXRECS) {
+    my @chunk = @entries[$i .. ($i + MAXRECS > @entries ? $#entries :
+      $i + MAXRECS - 1)];
+    my $more = ($i + MAXRECS < @entries) ? MSGF_MORE : 0;
+    my $msg = pack("CCnN", VERSION2, $more, scalar(@chunk), $$);
+    foreach my $entry (@chunk) {
+      my ($ip, $mask, $ttl) = @$entry;
+      $msg .= pack("nCCC4N", $table, $cmdcode, $mask, @$ip, $ttl);
+    }
+    $sock->send($msg) or die "send: $!";
+  }
+  # single record: table, status, amount added, amount deleted
+  my ($version, $flags, $count, $seq) = unpack("CCnN", readn($sock, 8));
+  my ($tbl, $status, $mask, $added, $deleted) =
+    unpack("nCCNN", readn($sock, 12));
+  print "replace failed with status $status\n" if $status;
+  print "$added added, $deleted deleted\n";
+  $sock->close();
+  exit($status ? 1 : 0);
+}
+
+my $msg;
+my $ack = 0;
+if (@entries == 1 && !$entries[0][2] && !$query) {
+  my ($ip, $mask) = @{$entries[0]};
+  $msg = pack("C", VERSION);
+  $msg .= pack("C", $table);
+  $msg .= pack("C", $cmdcode);
+  $msg .= pack("C", $mask);
+  $msg .= pack("C4", @$ip);
+} else {
+  $ack = MSGF_ACK if (!$query && ($type eq 'tcp' || $type == SOCK_STREAM));
+  # header: version, flags, count, sequence number
+  $msg = pack("CCnN", VERSION2, $ack, scalar(@entries), $$);
+  foreach my $entry (@entries) {
+    my ($ip, $mask, $ttl) = @$entry;
+    # record: table, command, mask, address, TTL
+    $msg .= pack("nCCC4N", $table, $cmdcode, $mask, @$ip, $ttl);
+  }
 }
-$msg .= pack("C", $mask);
-$msg .= pack("C4", @ip);
 
 $sock->send($msg) or die "send: $!";
 
+if ($ack) {
+  my $reply;
+  defined($sock->recv($reply, 8 + @entries + 3)) or die "recv: $!";
+  my ($version, $flags, $count, $seq) = unpack("CCnN", $reply);
+  my @status = unpack("C$count", substr($reply, 8));
+  for (my $i = 0; $i < $count; ++$i) {
+    print "$subjects[$i]: failed with status $status[$i]\n" if $status[$i];
+  }
+}
+
+# query replies: header and records until the one without MORE flag
+while ($query) {
+  my ($version, $flags, $count, $seq) = unpack("CCnN", readn($sock, 8));
+  for (my $i = 0; $i < $count; ++$i) {
+    my ($tbl, $status, $mask, @rest) = unpack("nCCC4N", readn($sock, 12));
+    my $ttl = pop @rest;
+    if ($status) {
+      print "$subjects[$i]: failed with status $status\n";
+    } else {
+      print join('.', @rest) . "/$mask" . ($ttl ? " expires in $ttl s" : "") . "\n";
+    }
+  }
+  last unless $flags & MSGF_MORE;
+}
+
 $sock->close();
+
+sub readn {
+  my ($sock, $len) = @_;
+  my $buf = '';
+  while (length($buf) < $len) {
+    defined($sock->recv(my $chunk, $len - length($buf))) or die "recv: $!";
+    die "connection closed\n" unless length($chunk);
+    $buf .= $chunk;
+  }
+  return $buf;
+}
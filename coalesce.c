@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "backend.h"
+#include "evloop.h"
+#include "memtbl.h"
+#include "stats.h"
+#include "coalesce.h"
+
+/* arg of pending operation, entry was first seen after FLUSH of its table */
+#define CO_AFTER_FLUSH 1
+
+static void on_window(struct evloop * loop, struct ev_timer * t)
+{
+  coalesce_flush((struct coalesce *)t->arg);
+}
+
+int coalesce_init(struct coalesce * c, struct evloop * loop, uint32_t tables,
+    uint64_t window)
+{
+  memset(c, 0, sizeof(*c));
+  c->loop = loop;
+  c->timer.cb = on_window;
+  c->timer.arg = c;
+  c->window = window;
+  c->tables = tables;
+  c->index = memtbl_new(tables);
+  c->ops = (struct tbl_op *)malloc(COALESCE_MAX * sizeof(struct tbl_op));
+  c->flushes = (int *)malloc(tables * sizeof(int));
+  c->flushed = (uint8_t *)calloc(tables, 1);
+  return (c->index && c->ops && c->flushes && c->flushed) ? 0 : -1;
+}
+
+static void co_drop(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg)
+{
+  ((struct coalesce *)arg)->ops[value].cmd = 0;
+  STATS_INC(stats.coalesce_dropped);
+}
+
+static void co_issue(const struct tbl_op * ops, int cnt)
+{
+  int i, errs[MESSAGE_V2_MAXRECS];
+
+  if (!cnt)
+    return;
+  STATS_ADD(stats.coalesce_issued, cnt);
+  uint64_t start = stats_usec();
+  int failed = backend->batch(ops, cnt, errs);
+  stats_lat(STATS_LAT_BATCH, start);
+  if (!failed)
+    return;
+  for (i = 0; i < cnt; ++i)
+    if (errs[i])
+    { /* status was reported when operation was queued */
+      STATS_INC(stats.coalesce_failed);
+      STATS_INC(stats.table_failed[ops[i].table]);
+    }
+}
+
+/* queues operation on table, REFRESH is not for backend and never gets here */
+void coalesce_op(struct coalesce * c, const struct tbl_op * op)
+{
+  uintptr_t pos;
+
+  STATS_INC(stats.coalesce_queued);
+  if (c->cnt == COALESCE_MAX) /* no room to hold more back */
+    coalesce_flush(c);
+  if (!c->cnt && !c->flushes_cnt)
+    evloop_timer_start(c->loop, &c->timer, c->window);
+
+  if (op->cmd == CMD_FLUSH)
+  {
+    memtbl_walk(c->index, op->table, co_drop, c);
+    memtbl_flush(c->index, op->table);
+    if (c->flushed[op->table])
+      STATS_INC(stats.coalesce_merged);
+    else
+    {
+      c->flushed[op->table] = 1;
+      c->flushes[c->flushes_cnt++] = op->table;
+    }
+    return;
+  }
+
+  if (!memtbl_find(c->index, op->table, op->addr, op->mask, &pos))
+  { /* the last of ADD and DEL is what table ends up with */
+    c->ops[pos].cmd = op->cmd;
+    STATS_INC(stats.coalesce_merged);
+    return;
+  }
+
+  if (memtbl_add(c->index, op->table, op->addr, op->mask, c->cnt) < 0)
+  { /* can't track entry, issue everything up to it */
+    coalesce_flush(c);
+    co_issue(op, 1);
+    return;
+  }
+  c->ops[c->cnt] = *op;
+  c->ops[c->cnt].arg = c->flushed[op->table] ? CO_AFTER_FLUSH : 0;
+  ++c->cnt;
+}
+
+/* issues net result of pending operations to backend */
+void coalesce_flush(struct coalesce * c)
+{
+  struct tbl_op batch[MESSAGE_V2_MAXRECS];
+  int i, n = 0;
+
+  evloop_timer_stop(c->loop, &c->timer);
+  for (i = 0; i < c->flushes_cnt; ++i)
+  {
+    struct tbl_op * op = &batch[n++];
+    memset(op, 0, sizeof(*op));
+    op->cmd = CMD_FLUSH;
+    op->table = c->flushes[i];
+    c->flushed[op->table] = 0;
+    if (n == MESSAGE_V2_MAXRECS)
+    {
+      co_issue(batch, n);
+      n = 0;
+    }
+  }
+  c->flushes_cnt = 0;
+
+  for (i = 0; i < c->cnt; ++i)
+  {
+    struct tbl_op * op = &c->ops[i];
+    if (!op->cmd) /* dropped by FLUSH along with its index entry */
+      continue;
+    memtbl_del(c->index, op->table, op->addr, op->mask, NULL);
+    if (op->cmd == CMD_DEL && op->arg == CO_AFTER_FLUSH)
+    { /* table was flushed, entry is gone already */
+      STATS_INC(stats.coalesce_dropped);
+      continue;
+    }
+    batch[n] = *op;
+    batch[n++].arg = 0;
+    if (n == MESSAGE_V2_MAXRECS)
+    {
+      co_issue(batch, n);
+      n = 0;
+    }
+  }
+  co_issue(batch, n);
+  c->cnt = 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#define COALESCE_MAX 16384 /* pending operations forcing early flush */
+
+/*
+ * Write-combining window in front of table backend. Operations are held
+ * for up to window msec and collapsed per entry: only the last of ADD and
+ * DEL is issued, FLUSH drops everything pending for its table and DEL of
+ * entry which was not added since such FLUSH is not issued at all.
+ */
+struct coalesce
+{
+  struct evloop * loop;
+  struct ev_timer timer;
+  uint64_t window;       /* msec */
+  struct memtbl * index; /* position of pending operation by entry */
+  struct tbl_op * ops;   /* in order entries were first seen */
+  int cnt;
+  int * flushes;         /* tables to be flushed before pending operations */
+  int flushes_cnt;
+  uint8_t * flushed;     /* per table, 1 if flush is pending */
+  uint32_t tables;
+};
+
+int coalesce_init(struct coalesce * c, struct evloop * loop, uint32_t tables,
+    uint64_t window);
+void coalesce_op(struct coalesce * c, const struct tbl_op * op);
+void coalesce_flush(struct coalesce * c);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define HAVE_EPOLL
+#elif defined(__FreeBSD__) || defined(__APPLE__) || \
+  defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define HAVE_KQUEUE
+#else
+#error "Neither epoll nor kqueue is available"
+#endif
+
+#include "evloop.h"
+
+#define EV_MAXEVENTS 64
+
+/* coarse clocks are good enough and much cheaper where they exist */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define EV_CLOCK_MONO CLOCK_MONOTONIC_COARSE
+#define EV_CLOCK_REAL CLOCK_REALTIME_COARSE
+#elif defined(CLOCK_MONOTONIC_FAST)
+#define EV_CLOCK_MONO CLOCK_MONOTONIC_FAST
+#define EV_CLOCK_REAL CLOCK_REALTIME_FAST
+#else
+#define EV_CLOCK_MONO CLOCK_MONOTONIC
+#define EV_CLOCK_REAL CLOCK_REALTIME
+#endif
+
+struct evloop
+{
+  int fd;           /* epoll or kqueue descriptor */
+  volatile sig_atomic_t stop; /* may be set by signal handler */
+  unsigned round;   /* timers dispatch round */
+  uint64_t now;     /* cached monotonic time in msec */
+  time_t time;      /* cached wall clock time */
+  TAILQ_HEAD(, ev_timer) timers;
+};
+
+struct evloop * evloop_new(void)
+{
+  struct evloop * loop = (struct evloop *)calloc(1, sizeof(struct evloop));
+  if (!loop)
+    return NULL;
+#ifdef HAVE_EPOLL
+  loop->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+  loop->fd = kqueue();
+#endif
+  if (loop->fd < 0)
+  {
+    free(loop);
+    return NULL;
+  }
+  TAILQ_INIT(&loop->timers);
+  evloop_update(loop);
+  return loop;
+}
+
+void evloop_free(struct evloop * loop)
+{
+  close(loop->fd);
+  free(loop);
+}
+
+void evloop_update(struct evloop * loop)
+{
+  struct timespec ts;
+  clock_gettime(EV_CLOCK_MONO, &ts);
+  loop->now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  clock_gettime(EV_CLOCK_REAL, &ts);
+  loop->time = ts.tv_sec;
+}
+
+uint64_t evloop_now(struct evloop * loop)
+{
+  return loop->now;
+}
+
+time_t evloop_time(struct evloop * loop)
+{
+  return loop->time;
+}
+
+#ifdef HAVE_EPOLL
+
+static int ev_ctl(struct evloop * loop, int op, struct ev_io * io, int events)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((events & EV_READ) ? EPOLLIN : 0) |
+    ((events & EV_WRITE) ? EPOLLOUT : 0);
+  ev.data.ptr = io;
+  if (epoll_ctl(loop->fd, op, io->fd, &ev) < 0)
+    return -1;
+  io->events = events;
+  return 0;
+}
+
+int evloop_add(struct evloop * loop, struct ev_io * io, int events)
+{
+  return ev_ctl(loop, EPOLL_CTL_ADD, io, events);
+}
+
+int evloop_mod(struct evloop * loop, struct ev_io * io, int events)
+{
+  if (io->events == events)
+    return 0;
+  return ev_ctl(loop, EPOLL_CTL_MOD, io, events);
+}
+
+int evloop_del(struct evloop * loop, struct ev_io * io)
+{
+  return ev_ctl(loop, EPOLL_CTL_DEL, io, 0);
+}
+
+static int ev_wait(struct evloop * loop, int timeout)
+{
+  struct epoll_event evs[EV_MAXEVENTS];
+  int i, cnt = epoll_wait(loop->fd, evs, EV_MAXEVENTS, timeout);
+  if (cnt < 0)
+    return -1;
+  evloop_update(loop);
+  for (i = 0; i < cnt; ++i)
+  {
+    struct ev_io * io = (struct ev_io *)evs[i].data.ptr;
+    int events = 0;
+    if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+      events |= EV_READ;
+    if (evs[i].events & EPOLLOUT)
+      events |= EV_WRITE;
+    io->cb(loop, io, events);
+  }
+  return cnt;
+}
+
+#else /* HAVE_KQUEUE */
+
+static int ev_filter(struct evloop * loop, struct ev_io * io,
+    int filter, int add)
+{
+  struct kevent kev;
+  EV_SET(&kev, io->fd, filter, add ? EV_ADD : EV_DELETE, 0, 0, io);
+  return kevent(loop->fd, &kev, 1, NULL, 0, NULL);
+}
+
+int evloop_mod(struct evloop * loop, struct ev_io * io, int events)
+{
+  int changed = io->events ^ events;
+  if ((changed & EV_READ) &&
+      ev_filter(loop, io, EVFILT_READ, events & EV_READ) < 0)
+    return -1;
+  if ((changed & EV_WRITE) &&
+      ev_filter(loop, io, EVFILT_WRITE, events & EV_WRITE) < 0)
+    return -1;
+  io->events = events;
+  return 0;
+}
+
+int evloop_add(struct evloop * loop, struct ev_io * io, int events)
+{
+  io->events = 0;
+  return evloop_mod(loop, io, events);
+}
+
+int evloop_del(struct evloop * loop, struct ev_io * io)
+{
+  return evloop_mod(loop, io, 0);
+}
+
+static int ev_wait(struct evloop * loop, int timeout)
+{
+  struct kevent evs[EV_MAXEVENTS];
+  struct timespec ts, * tsp = NULL;
+  if (timeout >= 0)
+  {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    tsp = &ts;
+  }
+  int i, cnt = kevent(loop->fd, NULL, 0, evs, EV_MAXEVENTS, tsp);
+  if (cnt < 0)
+    return -1;
+  evloop_update(loop);
+  for (i = 0; i < cnt; ++i)
+  {
+    struct ev_io * io = (struct ev_io *)evs[i].udata;
+    io->cb(loop, io, evs[i].filter == EVFILT_WRITE ? EV_WRITE : EV_READ);
+  }
+  return cnt;
+}
+
+#endif
+
+void evloop_timer_start(struct evloop * loop, struct ev_timer * t,
+    uint64_t delay)
+{
+  if (t->armed)
+    TAILQ_REMOVE(&loop->timers, t, link);
+  t->when = loop->now + delay;
+  t->armed = 1;
+  t->round = loop->round;
+  TAILQ_INSERT_TAIL(&loop->timers, t, link);
+}
+
+void evloop_timer_stop(struct evloop * loop, struct ev_timer * t)
+{
+  if (!t->armed)
+    return;
+  TAILQ_REMOVE(&loop->timers, t, link);
+  t->armed = 0;
+}
+
+/* there are only few timers so linear scan is fine */
+static int ev_timeout(struct evloop * loop)
+{
+  struct ev_timer * t;
+  int64_t timeout = -1;
+  TAILQ_FOREACH(t, &loop->timers, link)
+  {
+    int64_t left = t->when > loop->now ? (int64_t)(t->when - loop->now) : 0;
+    if (timeout < 0 || left < timeout)
+      timeout = left;
+  }
+  return timeout > INT32_MAX ? INT32_MAX : (int)timeout;
+}
+
+static void ev_timers(struct evloop * loop)
+{
+  struct ev_timer * t;
+  ++loop->round;
+  do
+  { /*
+     * callbacks may re-arm or stop timers, so restart scan after each of
+     * them; re-armed timers are not fired until next round
+     */
+    TAILQ_FOREACH(t, &loop->timers, link)
+      if (t->when <= loop->now && t->round != loop->round)
+        break;
+    if (t)
+    {
+      evloop_timer_stop(loop, t);
+      t->cb(loop, t);
+    }
+  } while (t);
+}
+
+/*
+ * Runs loop until evloop_break() is called or wait fails, wait interrupted
+ * by signal is resumed unless handler broke the loop. Callback must not
+ * free watchers of descriptors other than its own as they may be pending
+ * within the same wakeup.
+ */
+int evloop_run(struct evloop * loop)
+{
+  loop->stop = 0;
+  while (!loop->stop)
+  {
+    if (ev_wait(loop, ev_timeout(loop)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    ev_timers(loop);
+  }
+  return 0;
+}
+
+/*
+ * Drives loop by virtual clock instead of running it: moves clock to given
+ * wall clock time firing timers which become due on the way, each one at
+ * its own deadline. Clock is set back only before timers are armed.
+ */
+void evloop_advance(struct evloop * loop, uint64_t usec)
+{
+  uint64_t target = usec / 1000;
+
+  for ( ; ; )
+  {
+    struct ev_timer * t, * next = NULL;
+    TAILQ_FOREACH(t, &loop->timers, link)
+      if (t->when <= target && (!next || t->when < next->when))
+        next = t;
+    if (!next)
+      break;
+    if (next->when > loop->now)
+    {
+      loop->now = next->when;
+      loop->time = loop->now / 1000;
+    }
+    ev_timers(loop);
+  }
+  loop->now = target;
+  loop->time = target / 1000;
+}
+
+/* safe to call from signal handler */
+void evloop_break(struct evloop * loop)
+{
+  loop->stop = 1;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#define EV_READ  0x01
+#define EV_WRITE 0x02
+
+struct evloop;
+struct ev_io;
+struct ev_timer;
+
+typedef void (*ev_io_cb)(struct evloop * loop, struct ev_io * io, int events);
+typedef void (*ev_timer_cb)(struct evloop * loop, struct ev_timer * t);
+
+/* descriptor watcher, embedded into whatever owns the descriptor */
+struct ev_io
+{
+  int fd;
+  int events;       /* currently watched events */
+  ev_io_cb cb;
+  void * arg;
+};
+
+/* one-shot timer, callback may re-arm it */
+struct ev_timer
+{
+  uint64_t when;    /* deadline in msec of loop clock */
+  int armed;
+  unsigned round;   /* dispatch round timer was armed in */
+  ev_timer_cb cb;
+  void * arg;
+  TAILQ_ENTRY(ev_timer) link;
+};
+
+struct evloop * evloop_new(void);
+void evloop_free(struct evloop * loop);
+
+int evloop_add(struct evloop * loop, struct ev_io * io, int events);
+int evloop_mod(struct evloop * loop, struct ev_io * io, int events);
+int evloop_del(struct evloop * loop, struct ev_io * io);
+
+void evloop_timer_start(struct evloop * loop, struct ev_timer * t,
+    uint64_t delay);
+void evloop_timer_stop(struct evloop * loop, struct ev_timer * t);
+
+int evloop_run(struct evloop * loop);
+void evloop_break(struct evloop * loop);
+
+uint64_t evloop_now(struct evloop * loop);
+time_t evloop_time(struct evloop * loop);
+void evloop_update(struct evloop * loop);
+void evloop_advance(struct evloop * loop, uint64_t usec);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Benchmark of expiry wheel: fills it with given amount of entries spread
+ * over expiry horizon, extends deadline of some of them and expires all of
+ * them second by second reporting memory usage and throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "expool.h"
+#include "expiry.h"
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long maxrss_kb(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+static void count_expired(struct exp_rec * r, void * arg)
+{
+  ++*(size_t *)arg;
+}
+
+int main(int argc, char * argv[])
+{
+  size_t entries = 10000000, i;
+  time_t horizon = 3600;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:h")) != -1)
+    switch (opt)
+    {
+      case 'n':
+        entries = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        horizon = strtol(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "Usage: expbench [-n <entries>] [-s <horizon sec>]\n");
+        return EXIT_FAILURE;
+    }
+  if (!entries || horizon <= 0)
+    return EXIT_FAILURE;
+
+  struct expiry w;
+  time_t t0 = 1000000;
+  long rss0 = maxrss_kb();
+  uint32_t * idx = (uint32_t *)malloc(entries * sizeof(uint32_t));
+  if (!idx)
+    return EXIT_FAILURE;
+  expiry_init(&w, t0);
+  srandom(1);
+
+  double t = now_sec();
+  for (i = 0; i < entries; ++i)
+    if ((idx[i] = expiry_add(&w, t0 + 1 + random() % horizon,
+            i & 0x7f, (in_addr_t)i, 32)) == EXPOOL_NIL)
+    {
+      perror("expiry_add");
+      return EXIT_FAILURE;
+    }
+  t = now_sec() - t;
+  printf("insert:  %zu entries in %.3f s, %.0f/s\n", entries, t, entries / t);
+  printf("memory:  %zu bytes per record, pool %zu KB, max RSS growth %ld KB "
+      "(index array %zu KB included)\n", sizeof(struct exp_rec),
+      expool_mem(&w.pool) / 1024, maxrss_kb() - rss0,
+      entries * sizeof(uint32_t) / 1024);
+
+  size_t refreshed = entries / 10;
+  t = now_sec();
+  for (i = 0; i < refreshed; ++i)
+    idx[i] = expiry_reset(&w, idx[i], t0 + horizon + 1 + random() % horizon);
+  t = now_sec() - t;
+  printf("refresh: %zu entries in %.3f s, %.0f/s\n", refreshed, t,
+      refreshed / t);
+
+  size_t expired = 0;
+  time_t now;
+  t = now_sec();
+  for (now = t0; expiry_next(&w); ++now)
+    expiry_run(&w, now, count_expired, &expired, 0);
+  t = now_sec() - t;
+  printf("expire:  %zu entries over %ld s of wheel time in %.3f s, %.0f/s\n",
+      expired, (long)(now - t0), t, expired / t);
+
+  if (expired != entries || w.pool.used)
+  {
+    fprintf(stderr, "expiry mismatch: %zu of %zu expired, %u left in pool\n",
+        expired, entries, w.pool.used);
+    return EXIT_FAILURE;
+  }
+  expiry_destroy(&w);
+  free(idx);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "expool.h"
+#include "expiry.h"
+
+#define EXP_MASK (EXP_SLOTS - 1)
+#define EXP_SHIFT(level) ((level) * EXP_BITS)
+#define EXP_INDEX(t, level) (((t) >> EXP_SHIFT(level)) & EXP_MASK)
+
+void expiry_init(struct expiry * w, time_t now)
+{
+  memset(w, 0, sizeof(*w));
+  expool_init(&w->pool);
+  w->epoch = now;
+}
+
+void expiry_destroy(struct expiry * w)
+{
+  expool_destroy(&w->pool);
+  memset(w, 0, sizeof(*w));
+}
+
+static uint32_t exp_rel(struct expiry * w, time_t t)
+{
+  if (t <= w->epoch)
+    return 0;
+  if (t - w->epoch > UINT32_MAX)
+    return UINT32_MAX;
+  return (uint32_t)(t - w->epoch);
+}
+
+static void exp_insert(struct expiry * w, uint32_t idx)
+{
+  struct exp_rec * r = EXPIRY_REC(w, idx);
+  time_t t = r->expire < w->base ? w->base : r->expire;
+  time_t delta = t - w->base;
+  int level, slot;
+
+  for (level = 0; level < EXP_LEVELS - 1; ++level)
+    if (delta < ((time_t)1 << EXP_SHIFT(level + 1)))
+      break;
+
+  if (delta >= ((time_t)1 << EXP_SHIFT(EXP_LEVELS)))
+    slot = (EXP_INDEX(w->base, level) - 1) & EXP_MASK; /* furthest slot */
+  else
+    slot = EXP_INDEX(t, level);
+
+  r->next = w->slots[level][slot];
+  w->slots[level][slot] = idx;
+  w->occupied[level] |= (uint64_t)1 << slot;
+  ++w->linked;
+}
+
+/* returns index of new record or EXPOOL_NIL with errno set */
+uint32_t expiry_add(struct expiry * w, time_t expire,
+    int table, in_addr_t addr, uint8_t mask)
+{
+  uint32_t idx = expool_alloc(&w->pool);
+  if (idx == EXPOOL_NIL)
+    return EXPOOL_NIL;
+
+  struct exp_rec * r = EXPIRY_REC(w, idx);
+  r->expire = exp_rel(w, expire);
+  r->addr = addr;
+  r->table = table;
+  r->mask = mask;
+  exp_insert(w, idx);
+  ++w->count;
+  return idx;
+}
+
+/*
+ * Sets new deadline of live record. Moving it later is done in place, the
+ * record is re-linked once its current slot is due. Otherwise it is replaced
+ * with new one, index of which is returned (EXPOOL_NIL with errno set if it
+ * can not be allocated, old record is kept then).
+ */
+uint32_t expiry_reset(struct expiry * w, uint32_t idx, time_t expire)
+{
+  struct exp_rec * r = EXPIRY_REC(w, idx);
+  uint32_t rel = exp_rel(w, expire);
+
+  if (rel >= r->expire)
+  {
+    r->expire = rel;
+    return idx;
+  }
+
+  uint32_t nidx = expiry_add(w, expire, r->table, r->addr, r->mask);
+  if (nidx != EXPOOL_NIL)
+    expiry_cancel(w, idx);
+  return nidx;
+}
+
+void expiry_cancel(struct expiry * w, uint32_t idx)
+{
+  EXPIRY_REC(w, idx)->flags |= EXPF_DEAD;
+  --w->count;
+}
+
+/* unlinks whole slot returning its former head */
+static uint32_t exp_detach(struct expiry * w, int level, int slot)
+{
+  uint32_t head = w->slots[level][slot];
+  w->slots[level][slot] = EXPOOL_NIL;
+  w->occupied[level] &= ~((uint64_t)1 << slot);
+  return head;
+}
+
+/* links list of records starting at idx back into slot of level 0 */
+static void exp_attach(struct expiry * w, int slot, uint32_t idx)
+{
+  uint32_t tail = idx;
+
+  while (EXPIRY_REC(w, tail)->next != EXPOOL_NIL)
+    tail = EXPIRY_REC(w, tail)->next;
+  EXPIRY_REC(w, tail)->next = w->slots[0][slot];
+  w->slots[0][slot] = idx;
+  w->occupied[0] |= (uint64_t)1 << slot;
+}
+
+/* moves records of upper level slot which became current one level down */
+static void exp_cascade(struct expiry * w, int level)
+{
+  uint32_t idx = exp_detach(w, level, EXP_INDEX(w->base, level));
+
+  while (idx != EXPOOL_NIL)
+  {
+    struct exp_rec * r = EXPIRY_REC(w, idx);
+    uint32_t next = r->next;
+    --w->linked;
+    if (r->flags & EXPF_DEAD)
+      expool_free(&w->pool, idx);
+    else
+      exp_insert(w, idx);
+    idx = next;
+  }
+}
+
+/*
+ * Returns the earliest time wheel has to be run at (either records expire
+ * or upper level slot has to be cascaded), 0 if wheel is empty.
+ */
+time_t expiry_next(struct expiry * w)
+{
+  if (!w->linked)
+    return 0;
+
+  time_t next = -1;
+  uint64_t occ = w->occupied[0];
+  if (occ)
+  { /* rotate bitmap so that bit 0 stands for current second */
+    int shift = EXP_INDEX(w->base, 0);
+    if (shift)
+      occ = (occ >> shift) | (occ << (EXP_SLOTS - shift));
+    next = w->base + __builtin_ctzll(occ);
+  }
+
+  int level;
+  for (level = 1; level < EXP_LEVELS; ++level)
+    if (w->occupied[level])
+    {
+      time_t boundary = (w->base + EXP_MASK) & ~(time_t)EXP_MASK;
+      if (next < 0 || boundary < next)
+        next = boundary;
+      break;
+    }
+  return w->epoch + next;
+}
+
+/*
+ * Expires records due by now passing each of them to cb, returns their
+ * amount. If max is not 0 no more than max records are expired, the rest
+ * stays due and is picked up by the next run.
+ */
+size_t expiry_run(struct expiry * w, time_t now, expiry_cb cb, void * arg,
+    size_t max)
+{
+  size_t expired = 0;
+  time_t rnow = now - w->epoch;
+
+  for ( ; ; )
+  {
+    time_t next = expiry_next(w);
+    if (!next || next - w->epoch > rnow)
+    { /* nothing to be done in between */
+      if (w->base <= rnow)
+        w->base = rnow + 1;
+      break;
+    }
+    w->base = next - w->epoch;
+
+    int level;
+    for (level = 1; level < EXP_LEVELS; ++level)
+    {
+      if (EXP_INDEX(w->base, level - 1))
+        break;
+      exp_cascade(w, level);
+    }
+
+    uint32_t idx = exp_detach(w, 0, EXP_INDEX(w->base, 0));
+    while (idx != EXPOOL_NIL)
+    {
+      if (max && expired == max)
+      { /* put the rest back, second is not over yet */
+        exp_attach(w, EXP_INDEX(w->base, 0), idx);
+        return expired;
+      }
+      struct exp_rec * r = EXPIRY_REC(w, idx);
+      uint32_t next = r->next;
+      --w->linked;
+      if (r->flags & EXPF_DEAD)
+        expool_free(&w->pool, idx);
+      else if (r->expire > w->base)
+        exp_insert(w, idx); /* deadline was moved later */
+      else
+      {
+        --w->count;
+        ++expired;
+        cb(r, arg);
+        expool_free(&w->pool, idx);
+      }
+      idx = next;
+    }
+    ++w->base;
+  }
+  return expired;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#define EXP_LEVELS 4
+#define EXP_BITS   6
+#define EXP_SLOTS  (1 << EXP_BITS)
+
+/*
+ * Hierarchical timing wheel with one second resolution. Slots of level L
+ * span EXP_SLOTS^L seconds each so that the wheel covers about 194 days,
+ * entries expiring later wait in the furthest slot. Records live in pool
+ * and slots are singly linked lists of record indices: cancelled records
+ * are only marked and reclaimed when their slot is visited, deadline moved
+ * later is picked up the same way, so insert, cancel and refresh are O(1).
+ */
+struct expiry
+{
+  struct expool pool;
+  time_t epoch;     /* deadlines of records are relative to it */
+  time_t base;      /* next second to be processed, relative */
+  size_t count;     /* live records */
+  size_t linked;    /* records in slots, cancelled ones included */
+  uint64_t occupied[EXP_LEVELS];
+  uint32_t slots[EXP_LEVELS][EXP_SLOTS];
+};
+
+#define EXPIRY_REC(w, idx) EXPOOL_REC(&(w)->pool, idx)
+
+typedef void (*expiry_cb)(struct exp_rec * r, void * arg);
+
+void expiry_init(struct expiry * w, time_t now);
+void expiry_destroy(struct expiry * w);
+uint32_t expiry_add(struct expiry * w, time_t expire,
+    int table, in_addr_t addr, uint8_t mask);
+uint32_t expiry_reset(struct expiry * w, uint32_t idx, time_t expire);
+void expiry_cancel(struct expiry * w, uint32_t idx);
+time_t expiry_next(struct expiry * w);
+size_t expiry_run(struct expiry * w, time_t now, expiry_cb cb, void * arg,
+    size_t max);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "expool.h"
+
+void expool_init(struct expool * p)
+{
+  memset(p, 0, sizeof(*p));
+  p->top = 1; /* reserve NIL */
+}
+
+void expool_destroy(struct expool * p)
+{
+  uint32_t i;
+  for (i = 0; i < p->nchunks; ++i)
+    free(p->chunks[i]);
+  free(p->chunks);
+  expool_init(p);
+}
+
+/* returns index of zeroed record or EXPOOL_NIL with errno set */
+uint32_t expool_alloc(struct expool * p)
+{
+  uint32_t idx;
+
+  if (p->free != EXPOOL_NIL)
+  {
+    idx = p->free;
+    p->free = EXPOOL_REC(p, idx)->next;
+  } else
+  {
+    if (p->top == UINT32_MAX)
+    {
+      errno = ENOMEM;
+      return EXPOOL_NIL;
+    }
+    if ((p->top >> EXPOOL_CHUNK_BITS) >= p->nchunks)
+    {
+      struct exp_rec ** chunks = (struct exp_rec **)realloc(p->chunks,
+          (p->nchunks + 1) * sizeof(struct exp_rec *));
+      if (!chunks)
+        return EXPOOL_NIL;
+      p->chunks = chunks;
+      if (!(chunks[p->nchunks] = (struct exp_rec *)malloc(
+              EXPOOL_CHUNK * sizeof(struct exp_rec))))
+        return EXPOOL_NIL;
+      ++p->nchunks;
+    }
+    idx = p->top++;
+  }
+  memset(EXPOOL_REC(p, idx), 0, sizeof(struct exp_rec));
+  ++p->used;
+  return idx;
+}
+
+void expool_free(struct expool * p, uint32_t idx)
+{
+  EXPOOL_REC(p, idx)->next = p->free;
+  p->free = idx;
+  --p->used;
+}
+
+/* bytes allocated by pool */
+size_t expool_mem(const struct expool * p)
+{
+  return (size_t)p->nchunks * (EXPOOL_CHUNK * sizeof(struct exp_rec) +
+      sizeof(struct exp_rec *));
+}
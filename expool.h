@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef EXPOOL_H
+#define EXPOOL_H
+
+#define EXPOOL_NIL 0  /* index 0 is never handed out and terminates lists */
+#define EXPOOL_CHUNK_BITS 16
+#define EXPOOL_CHUNK (1 << EXPOOL_CHUNK_BITS)
+
+/*
+ * Expiry record, addressed by 32-bit index of pool rather than by pointer.
+ * Deadline is relative to epoch of the wheel owning the pool.
+ */
+struct exp_rec
+{
+  uint32_t next;
+  uint32_t expire;
+  in_addr_t addr;
+  uint16_t table;
+  uint8_t mask;
+  uint8_t flags;    /* EXPF_* */
+};
+
+#define EXPF_DEAD 0x01  /* cancelled, reclaimed once its slot is visited */
+
+/*
+ * Records are carved out of chunks of EXPOOL_CHUNK ones which are never
+ * returned to the system, freed records are reused in LIFO order.
+ */
+struct expool
+{
+  struct exp_rec ** chunks;
+  uint32_t nchunks;
+  uint32_t top;       /* records ever handed out, including NIL */
+  uint32_t free;      /* head of free list */
+  uint32_t used;
+};
+
+#define EXPOOL_REC(p, idx) \
+  (&(p)->chunks[(idx) >> EXPOOL_CHUNK_BITS][(idx) & (EXPOOL_CHUNK - 1)])
+
+void expool_init(struct expool * p);
+void expool_destroy(struct expool * p);
+uint32_t expool_alloc(struct expool * p);
+void expool_free(struct expool * p, uint32_t idx);
+size_t expool_mem(const struct expool * p);
+
+#endif
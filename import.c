@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "stats.h"
+#include "log.h"
+#include "import.h"
+
+#define IMPORT_MASK(len) ((len) ? 0xffffffffU << (32 - (len)) : 0)
+
+/* part of file parsed by single thread into sorted unique keys */
+struct chunk
+{
+  const char * start;
+  const char * end;
+  uint64_t * keys;   /* address in host byte order << 8 | mask length */
+  size_t cnt;
+  size_t pos;        /* of the next key to merge */
+  size_t dups;
+  size_t invalid;
+  pthread_t tid;
+};
+
+/* parses a.b.c.d[/len] at p, returns position past it or NULL if invalid */
+static const char * parse_cidr(const char * p, const char * end,
+    uint32_t * addr, uint8_t * mask)
+{
+  uint32_t a = 0, v;
+  int i, d;
+
+  for (i = 0; i < 4; ++i)
+  {
+    if (i && (p == end || *p++ != '.'))
+      return NULL;
+    for (v = 0, d = 0; p < end && d < 3 && *p >= '0' && *p <= '9'; ++d)
+      v = v * 10 + *p++ - '0';
+    if (!d || v > 255)
+      return NULL;
+    a = a << 8 | v;
+  }
+  *mask = 32;
+  if (p < end && *p == '/')
+  { /* /0 can not be told from /32 by protocol */
+    for (++p, v = 0, d = 0; p < end && d < 2 && *p >= '0' && *p <= '9'; ++d)
+      v = v * 10 + *p++ - '0';
+    if (!d || !v || v > 32)
+      return NULL;
+    *mask = v;
+  }
+  *addr = a & IMPORT_MASK(*mask);
+  return p;
+}
+
+static int cmp_key(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void * parse_chunk(void * arg)
+{
+  struct chunk * c = (struct chunk *)arg;
+  const char * p = c->start, * end = c->end;
+  uint32_t addr;
+  uint8_t mask;
+
+  while (p < end)
+  {
+    const char * eol = memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+    while (p < eol && (*p == ' ' || *p == '\t'))
+      ++p;
+    if (p < eol && *p != '#' && *p != '\r')
+    {
+      if (!(p = parse_cidr(p, eol, &addr, &mask)))
+        ++c->invalid;
+      else
+      {
+        while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+          ++p;
+        if (p == eol || *p == '#')
+          c->keys[c->cnt++] = (uint64_t)addr << 8 | mask;
+        else
+          ++c->invalid;
+      }
+    }
+    p = eol + 1;
+  }
+
+  size_t i, n = 0;
+  qsort(c->keys, c->cnt, sizeof(uint64_t), cmp_key);
+  for (i = 0; i < c->cnt; ++i)
+    if (!n || c->keys[i] != c->keys[n - 1])
+      c->keys[n++] = c->keys[i];
+  c->dups = c->cnt - n;
+  c->cnt = n;
+  return NULL;
+}
+
+/* splits file into chunks at line boundaries, returns amount of them */
+static int split_file(const char * buf, size_t size, struct chunk * chunks)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t n = size / IMPORT_CHUNK_MIN + 1;
+  size_t i, off = 0;
+  int cnt = 0;
+
+  if (cpus > 0 && n > (size_t)cpus)
+    n = cpus;
+  if (n > IMPORT_THREADS_MAX)
+    n = IMPORT_THREADS_MAX;
+  for (i = 0; i < n && off < size; ++i)
+  {
+    size_t end = (i + 1 == n) ? size : size * (i + 1) / n;
+    const char * eol;
+    if (end < off)
+      end = off;
+    if (end < size && (eol = memchr(buf + end, '\n', size - end)))
+      end = eol - buf + 1;
+    else
+      end = size;
+    struct chunk * c = &chunks[cnt++];
+    memset(c, 0, sizeof(*c));
+    c->start = buf + off;
+    c->end = buf + end;
+    /* every line but the last one takes 8 bytes at least */
+    if (!(c->keys = (uint64_t *)malloc(((end - off) / 8 + 1) *
+            sizeof(uint64_t))))
+    {
+      while (cnt--)
+        free(chunks[cnt].keys);
+      return -1;
+    }
+    off = end;
+  }
+  return cnt;
+}
+
+/* parses chunks by threads, the first one by calling thread */
+static void parse_chunks(struct chunk * chunks, int cnt)
+{
+  sigset_t all, old;
+  int i;
+
+  sigfillset(&all); /* signals are left to main thread */
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (i = 1; i < cnt; ++i)
+    if (pthread_create(&chunks[i].tid, NULL, parse_chunk, &chunks[i]) != 0)
+      chunks[i].tid = pthread_self();
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  parse_chunk(&chunks[0]);
+  for (i = 1; i < cnt; ++i)
+  {
+    if (pthread_equal(chunks[i].tid, pthread_self()))
+      parse_chunk(&chunks[i]); /* thread failed to start */
+    else
+      pthread_join(chunks[i].tid, NULL);
+  }
+}
+
+ssize_t import_file(const char * path, int table, uint32_t ttl, import_cb cb,
+    void * arg)
+{
+  struct chunk chunks[IMPORT_THREADS_MAX];
+  struct tbl_op ops[MESSAGE_V2_MAXRECS];
+  struct stat st;
+  char * buf = NULL;
+  int i, cnt = 0, fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+  {
+    logmsg(LOG_ERR, "Failed to open '%s': %s", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size && (buf = (char *)mmap(NULL, st.st_size, PROT_READ,
+          MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+  {
+    logmsg(LOG_ERR, "Failed to map '%s': %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  uint64_t start = stats_usec();
+  if (buf)
+  {
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    if ((cnt = split_file(buf, st.st_size, chunks)) < 0)
+    {
+      logmsg(LOG_ERR, "Failed to import '%s': %s", path, strerror(errno));
+      munmap(buf, st.st_size);
+      return -1;
+    }
+    parse_chunks(chunks, cnt);
+  }
+
+  size_t total = 0, dups = 0, invalid = 0, entries = 0, failed = 0;
+  for (i = 0; i < cnt; ++i)
+  {
+    total += chunks[i].cnt;
+    dups += chunks[i].dups;
+    invalid += chunks[i].invalid;
+  }
+  logmsg(LOG_INFO, "Parsed %zu entries of '%s' by %i threads in %llu ms",
+      total, path, cnt, (unsigned long long)(stats_usec() - start) / 1000);
+
+  /* parts are merged dropping entries found in several of them */
+  uint64_t last = UINT64_MAX, progress = stats_usec();
+  int n = 0;
+  for ( ; ; )
+  {
+    struct chunk * min = NULL;
+    for (i = 0; i < cnt; ++i)
+      if (chunks[i].pos < chunks[i].cnt && (!min ||
+            chunks[i].keys[chunks[i].pos] < min->keys[min->pos]))
+        min = &chunks[i];
+    if (min)
+    {
+      uint64_t key = min->keys[min->pos++];
+      if (key == last)
+      {
+        ++dups;
+        continue;
+      }
+      struct tbl_op * op = &ops[n++];
+      op->table = table;
+      op->cmd = CMD_ADD;
+      op->mask = key & 0xff;
+      op->addr = htonl((uint32_t)(key >> 8));
+      op->arg = ttl;
+      last = key;
+    }
+    if (n && (n == MESSAGE_V2_MAXRECS || !min))
+    {
+      failed += cb(ops, n, arg);
+      entries += n;
+      n = 0;
+      if (stats_usec() - progress >= IMPORT_PROGRESS_MS * 1000ULL)
+      {
+        progress = stats_usec();
+        logmsg(LOG_INFO, "Imported %zu entries of '%s' so far (%llu/s)",
+            entries, path, (unsigned long long)(entries * 1000000ULL /
+              (progress - start)));
+      }
+    }
+    if (!min)
+      break;
+  }
+
+  uint64_t usec = stats_usec() - start;
+  logmsg(LOG_INFO, "Imported %zu entries of '%s' into table %i in %llu ms "
+      "(%llu/s): %zu duplicates, %zu invalid lines, %zu failed", entries,
+      path, table, (unsigned long long)usec / 1000,
+      (unsigned long long)(entries * 1000000ULL / (usec ? usec : 1)), dups,
+      invalid, failed);
+  STATS_ADD(stats.import_entries, entries);
+  STATS_ADD(stats.import_dups, dups);
+  STATS_ADD(stats.import_invalid, invalid);
+  STATS_ADD(stats.import_failed, failed);
+
+  for (i = 0; i < cnt; ++i)
+    free(chunks[i].keys);
+  if (buf)
+    munmap(buf, st.st_size);
+  return entries;
+}
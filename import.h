@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#define IMPORT_THREADS_MAX 16
+#define IMPORT_CHUNK_MIN (1 << 20) /* least bytes worth a parser thread */
+#define IMPORT_PROGRESS_MS 1000
+
+/* applies batch of imported operations, returns amount of failed ones */
+typedef int (*import_cb)(struct tbl_op * ops, int cnt, void * arg);
+
+/*
+ * Bulk import of entries into table from text file holding address or
+ * prefix (a.b.c.d[/len]) per line, '#' starts comment. File is mapped into
+ * memory and split at line boundaries between parser threads, each of them
+ * sorting and de-duplicating its part. Parts are merged into ADDs with given
+ * TTL passed to cb in batches of MESSAGE_V2_MAXRECS in order of addresses.
+ * Progress is logged every IMPORT_PROGRESS_MS. Returns amount of entries
+ * passed to cb or -1 if file could not be read.
+ */
+ssize_t import_file(const char * path, int table, uint32_t ttl, import_cb cb,
+    void * arg);
+
+#endif
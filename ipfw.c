@@ -27,18 +27,28 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
-#include <net/if.h>
-#include <netinet/ip_fw.h>
 #include <arpa/inet.h>
 #include <syslog.h>
 #include <errno.h>
 #include <err.h>
 #include <strings.h>
 #include <string.h>
+
+#include "ipfwtabled.h"
+#include "backend.h"
 #include "ipfw.h"
+#include "stats.h"
+#include "log.h"
+
+#ifdef HAVE_IPFW
+
+#include <sys/sysctl.h>
+#include <net/if.h>
+#include <netinet/ip_fw.h>
 
 int do_cmd(int optname, void *optval, uintptr_t optlen)
 {
@@ -48,14 +58,21 @@ int do_cmd(int optname, void *optval, uintptr_t optlen)
     s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
   if (s < 0)
   {
-    syslog(LOG_CRIT, "Failed to create socket to contact IPFW: %s", strerror(errno));
+    logmsg(LOG_CRIT, "Failed to create socket to contact IPFW: %s", strerror(errno));
     err(EXIT_FAILURE, "Failed to create socket to contact IPFW");
   }
 
   if (optname == NOOP)
     return 0;
 
-  return setsockopt(s, IPPROTO_IP, optname, optval, optlen);
+  int rc;
+  uint64_t start = stats_usec();
+  if (optname == IP_FW_TABLE_GETSIZE || optname == IP_FW_TABLE_LIST)
+    rc = getsockopt(s, IPPROTO_IP, optname, optval, (socklen_t *)optlen);
+  else
+    rc = setsockopt(s, IPPROTO_IP, optname, optval, optlen);
+  stats_lat(STATS_LAT_KERNEL, start);
+  return rc;
 }
 
 void ipfw_noop(void)
@@ -63,10 +80,32 @@ void ipfw_noop(void)
   do_cmd(NOOP, NULL, 0);
 }
 
-void ipfw_tbl_add(int table, in_addr_t addr, u_int8_t mask)
+int ipfw_init(uint32_t * tables_max)
 {
-  struct in_addr ia = { addr };
-  syslog(LOG_DEBUG, "Adding %s/%i to table (%i)", inet_ntoa(ia), mask, table);
+  size_t tables_max_len = sizeof(*tables_max);
+  if (sysctlbyname("net.inet.ip.fw.tables_max",
+        tables_max, &tables_max_len, NULL, 0) == -1)
+  {
+#ifdef IPFW_TABLES_MAX
+    warn("Failed to get maximum amount of IPFW tables via sysctl");
+    *tables_max = IPFW_TABLES_MAX;
+#else
+    errx(EXIT_FAILURE, "Failed to get maximum amount of IPFW tables");
+#endif
+  }
+
+  ipfw_noop(); /* fail early if we are not allowed to talk to IPFW */
+  return 0;
+}
+
+int ipfw_tbl_add(int table, in_addr_t addr, u_int8_t mask)
+{
+  if (log_enabled(LOG_DEBUG))
+  { /* inet_ntoa() is not safe with apply threads */
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    logmsg(LOG_DEBUG, "Adding %s/%i to table (%i)", ip, mask, table);
+  }
   ipfw_table_entry ent;
   int entlen = sizeof(ent);
   bzero(&ent, entlen);
@@ -79,17 +118,29 @@ void ipfw_tbl_add(int table, in_addr_t addr, u_int8_t mask)
     if (errno == EEXIST) /* attempt to delete first */
     {
       if (do_cmd(IP_FW_TABLE_DEL, &ent, entlen) < 0)
-        syslog(LOG_ERR, "Add to table failed: %s", strerror(errno));
+        logmsg(LOG_ERR, "Add to table failed: %s", strerror(errno));
       if (do_cmd(IP_FW_TABLE_ADD, &ent, entlen) < 0)
-        syslog(LOG_ERR, "Add to table failed: %s", strerror(errno));
-    } else syslog(LOG_ERR, "Add to table failed: %s", strerror(errno));
+      {
+        logmsg(LOG_ERR, "Add to table failed: %s", strerror(errno));
+        return -1;
+      }
+    } else
+    {
+      logmsg(LOG_ERR, "Add to table failed: %s", strerror(errno));
+      return -1;
+    }
   }
+  return 0;
 }
 
-void ipfw_tbl_del(int table, in_addr_t addr, u_int8_t mask)
+int ipfw_tbl_del(int table, in_addr_t addr, u_int8_t mask)
 {
-  struct in_addr ia = { addr };
-  syslog(LOG_DEBUG, "Deleting %s/%i from table (%i)", inet_ntoa(ia), mask, table);
+  if (log_enabled(LOG_DEBUG))
+  { /* inet_ntoa() is not safe with apply threads */
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    logmsg(LOG_DEBUG, "Deleting %s/%i from table (%i)", ip, mask, table);
+  }
   ipfw_table_entry ent;
   int entlen = sizeof(ent);
   bzero(&ent, entlen);
@@ -98,12 +149,79 @@ void ipfw_tbl_del(int table, in_addr_t addr, u_int8_t mask)
   ent.masklen = mask;
 
   if (do_cmd(IP_FW_TABLE_DEL, &ent, entlen) < 0)
-    syslog(LOG_ERR, "Delete from table failed: %s", strerror(errno));
+  {
+    logmsg(LOG_ERR, "Delete from table failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
 }
 
-void ipfw_tbl_flush(int table)
+int ipfw_tbl_flush(int table)
 {
-  syslog(LOG_DEBUG, "Flushing table %i", table);
+  logmsg(LOG_DEBUG, "Flushing table %i", table);
   if (do_cmd(IP_FW_TABLE_FLUSH, &table, sizeof(table)) < 0)
-    syslog(LOG_ERR, "Flush table failed: %s", strerror(errno));
+  {
+    logmsg(LOG_ERR, "Flush table failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int ipfw_tbl_batch(const struct tbl_op * ops, int cnt, int * errs)
+{
+  /* legacy setsockopt() interface has no multi-entry operations */
+  return backend_batch(&ipfw_backend, ops, cnt, errs);
+}
+
+int ipfw_tbl_size(int table)
+{
+  uint32_t cnt = table;
+  socklen_t len = sizeof(cnt);
+  if (do_cmd(IP_FW_TABLE_GETSIZE, &cnt, (uintptr_t)&len) < 0)
+  {
+    logmsg(LOG_ERR, "Get table size failed: %s", strerror(errno));
+    return -1;
+  }
+  return (int)cnt;
 }
+
+int ipfw_tbl_list(int table, backend_list_cb cb, void * arg)
+{
+  int size = ipfw_tbl_size(table);
+  if (size < 0)
+    return -1;
+
+  uint32_t cnt = size;
+  socklen_t len = sizeof(ipfw_table) + cnt * sizeof(ipfw_table_entry);
+  ipfw_table * tbl = (ipfw_table *)calloc(1, len);
+  if (!tbl)
+    return -1;
+  tbl->size = cnt;
+  tbl->tbl = table;
+  if (do_cmd(IP_FW_TABLE_LIST, tbl, (uintptr_t)&len) < 0)
+  {
+    logmsg(LOG_ERR, "List table failed: %s", strerror(errno));
+    free(tbl);
+    return -1;
+  }
+
+  uint32_t i;
+  for (i = 0; i < tbl->cnt; ++i)
+    cb(table, tbl->ent[i].addr, tbl->ent[i].masklen, arg);
+  free(tbl);
+  return 0;
+}
+
+const struct backend ipfw_backend =
+{
+  "ipfw",
+  ipfw_init,
+  ipfw_tbl_add,
+  ipfw_tbl_del,
+  ipfw_tbl_flush,
+  ipfw_tbl_batch,
+  ipfw_tbl_list,
+  ipfw_tbl_size
+};
+
+#endif /* HAVE_IPFW */
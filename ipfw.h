@@ -32,8 +32,14 @@
 #define NOOP -1
 
 void ipfw_noop();
-void ipfw_tbl_add(int table, in_addr_t addr, u_int8_t mask);
-void ipfw_tbl_del(int table, in_addr_t addr, u_int8_t mask);
-void ipfw_tbl_flush(int table);
+int ipfw_init(uint32_t * tables_max);
+int ipfw_tbl_add(int table, in_addr_t addr, u_int8_t mask);
+int ipfw_tbl_del(int table, in_addr_t addr, u_int8_t mask);
+int ipfw_tbl_flush(int table);
+int ipfw_tbl_batch(const struct tbl_op * ops, int cnt, int * errs);
+int ipfw_tbl_list(int table, backend_list_cb cb, void * arg);
+int ipfw_tbl_size(int table);
+
+extern const struct backend ipfw_backend;
 
 #endif
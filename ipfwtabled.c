@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <err.h>
 #include <errno.h>
 #include <unistd.h>
@@ -44,29 +45,54 @@
 #include <sys/un.h>
 #include <arpa/inet.h>
 
-#include <sys/select.h>
+#include <fcntl.h>
 
 #include <signal.h>
 
-#include <sys/sysctl.h>
-
 #include <pwd.h>
 
 #include <time.h>
 
 #include <sys/queue.h>
+#include <stddef.h>
 
 #include "ipfwtabled.h"
-#include "ipfw.h"
+#include "backend.h"
+#include "proto.h"
+#include "rx.h"
+#include "evloop.h"
+#include "session.h"
+#include "expool.h"
+#include "expiry.h"
+#include "memtbl.h"
+#include "journal.h"
+#include "stats.h"
+#include "worker.h"
+#include "coalesce.h"
+#include "log.h"
+#include "trace.h"
+#include "lane.h"
+#include "agg.h"
+#include "admit.h"
+#include "lpm.h"
+#include "repl.h"
+#include "shmring.h"
+#include "import.h"
 
 #define DEFAULT_SOCK_TYPE SOCK_DGRAM
-#define DEFAULT_BACKLOG 10
+#define DEFAULT_BACKLOG SOMAXCONN
+#define DEFAULT_PURGE_OPS 4096 /* entries expired per cleanup slice */
 
-#define MIN_CLEANUP_INTERVAL 5
-#define MAX_CLEANUP_DELAY 60
+#define PURGE_DELETE UINT32_MAX       /* entries of table are deleted */
+#define PURGE_FLUSH  (UINT32_MAX - 1) /* table is flushed instead */
 
-#define TAILQ_PRINT(head) \
-{ autoexpq_entry * ent; STAILQ_FOREACH(ent, &head, qconnector) { syslog(LOG_DEBUG, "QITEM %x\n", ent); } }
+/* file of entries loaded into table on startup (-I) */
+struct import_spec
+{
+  int table;
+  uint32_t ttl;
+  char * path;
+};
 
 struct configuration
 {
@@ -75,15 +101,123 @@ struct configuration
   int sock_type;
   int daemonize;
   time_t * tbl_exp_periods;
-} config = { NULL, 0, -1, 0, NULL };
+  char ** exp_specs;
+  int exp_specs_cnt;
+  char * backend;
+  int rx_budget;
+  char * journal_dir;
+  char * stats_path;
+  int workers;
+  int receivers;
+  int coalesce_ms;
+  int purge_ops;
+  int purge_ms;
+  char * trace_path;
+  char * replay_path;
+  double replay_speed;
+  double rate_limit;
+  double rate_burst;
+  int lane_max;
+  int * prio_tables;
+  int prio_tables_cnt;
+  char ** agg_specs;
+  int agg_specs_cnt;
+  char ** repl_peers;
+  int repl_peers_cnt;
+  char * shm_path;
+  struct import_spec * imports;
+  int imports_cnt;
+} config = { NULL, 0, -1, 0, NULL, NULL, 0, NULL, RX_DEFAULT_BUDGET, NULL,
+  NULL, 0, 0, 0, DEFAULT_PURGE_OPS, 0, NULL, NULL, 0, 0, 0, 0, NULL, 0, NULL,
+  0, NULL, 0, NULL, NULL, 0 };
 
 const size_t messagelen = sizeof(struct message);
 
+uint32_t tables_max;
+
+/*
+ * Tables are partitioned between apply threads by their index, each
+ * partition expires entries of its own tables on the loop of its thread.
+ * Without threads there is single partition served by the main loop.
+ */
+struct part
+{
+  struct evloop * loop;
+  struct expiry expiry;
+  struct ev_timer cleanup_timer;
+  time_t cleanup_at;  /* time cleanup timer is armed for */
+  time_t lag;         /* max lateness of expiry during cleanup */
+  struct coalesce coal; /* with -c only */
+  struct lane lane;   /* with -q or -p only */
+  struct tbl_op purge[MESSAGE_V2_MAXRECS]; /* expired, not deleted yet */
+  int purge_cnt;
+  uint32_t * due;     /* per table, entries in purge or PURGE_* */
+  time_t * checked;   /* per table, last time it was checked to be flushed */
+};
+
+struct part * parts;
+int nparts = 1;
+
+#define PART(table) (&parts[(table) % nparts])
+
+/* amount of entries pending expiry in all partitions */
+size_t expiry_pending(void)
+{
+  size_t cnt = 0;
+  int i;
+  for (i = 0; i < nparts; ++i) /* others may be updating theirs meanwhile */
+    cnt += __atomic_load_n(&parts[i].expiry.count, __ATOMIC_RELAXED);
+  return cnt;
+}
+
+/* amount of bulk operations queued in all partitions */
+size_t lane_pending(void)
+{
+  size_t cnt = 0;
+  int i;
+  for (i = 0; i < nparts && config.lane_max; ++i)
+    cnt += __atomic_load_n(&parts[i].lane.cnt, __ATOMIC_RELAXED);
+  return cnt;
+}
+
+/* per table, 1 if it is priority one (-p) */
+uint8_t * urgent_tables;
+
+/*
+ * Contents of tables as applied by the daemon to answer queries without
+ * calls into kernel: ordered for LIST and hashed for LOOKUP. Entries which
+ * are held back by coalescing are already there. The hash also points at
+ * expiry record of every entry with TTL to be refreshed or cancelled, an
+ * entry leaves it only after its expiry is cancelled.
+ */
+struct memtbl * live_index;
+struct lpm * live_lpm;
+
+/* set while message replicated by peer is applied, it is not sent on */
+int applying_replica;
+
+struct evloop * loop;
+struct ev_timer journal_timer;
+
+/* bound (server) socket */
+struct listener
+{
+  struct ev_io io;
+  uint32_t ovfl;  /* drops counter of datagram socket */
+};
+
+
 void usage(char * progname)
 {
   char * usage_info = 
     "Usage: ipfwtabled [-b <host>[:<port>][ -b <host>[:<port>] ...]]\n"
 "  [-d] [-t|-u] [-e [<tableidx>]:<timeinsec>[-e <tableidx>:<timeinsec> ...]]\n"
+"  [-l <ops>[:<burst>]] [-q <ops>] [-p <tableidx> [-p <tableidx> ...]]\n"
+"  [-a <tableidx>[:<masklen>] [-a <tableidx>[:<masklen>] ...]]\n"
+"  [-B <backend>] [-r <budget>] [-j <dir>] [-S <path>] [-w <threads>]\n"
+"  [-n <threads>] [-c <msec>] [-x <ops>[:<msec>]] [-T <file>]\n"
+"  [-P <file>[:<speed>]] [-R <host>[:<port>] [-R <host>[:<port>] ...]]\n"
+"  [-M <path>] [-I <tableidx>[+<ttl>]:<file> [-I ...]] [-v <level>]\n"
 "   -b <host>:<port> - bind address\n"
 "   -d               - daemonize\n"
 "   -t               - use TCP\n"
@@ -92,8 +226,31 @@ void usage(char * progname)
 "                      idx is index of ipfw table\n"
 "                      sec is amount of seconds before entry to be purged\n"
 "                      if idx is not specified value is set for all tables\n"
+"   -l <ops>[:<b>]   - limit operations per second from single sender\n"
+"   -q <ops>         - queue bulk operations behind urgent ones\n"
+"   -p <idx>         - apply all operations on table as urgent ones\n"
+"   -a <idx>[:<len>] - install prefixes aggregating entries of table\n"
+"                      not shorter than len\n"
+"   -B <backend>     - table backend to use (%s)\n"
+"                      defaults to the first one listed\n"
+"   -r <budget>      - max datagrams received from socket per wakeup\n"
+"   -j <dir>         - keep expiry state in dir to survive restarts\n"
+"   -S <path>        - serve statistics on unix socket at path\n"
+"   -w <threads>     - apply operations by threads partitioned by table\n"
+"   -n <threads>     - receive datagrams by threads (same as -w)\n"
+"   -c <msec>        - collapse operations on entry within window\n"
+"   -x <ops>[:<ms>]  - max entries expired (and msec spent) at once\n"
+"   -T <file>        - record received messages into trace file\n"
+"   -P <file>[:<x>]  - replay trace x times faster (as fast as possible)\n"
+"   -R <host>:<port> - replicate applied operations to peer daemon\n"
+"   -M <path>        - take operations from shared memory ring at path\n"
+"   -I <idx>[+<ttl>]:<file>\n"
+"                    - add entries listed in file to table on startup\n"
+"   -v <level>       - log messages up to syslog level (6 - info)\n"
 "   -h               - print this message\n";
-  fprintf(stderr, usage_info, progname);
+  char backends[64];
+  backend_names(backends, sizeof(backends));
+  fprintf(stderr, usage_info, backends);
 }
 
 int getsock(int domain, int type, int proto,
@@ -103,56 +260,1356 @@ int getsock(int domain, int type, int proto,
   int fd = socket(domain, type, proto);
   if (fd < 0)
   {
-    syslog(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+    logmsg(LOG_ERR, "Failed to create socket: %s", strerror(errno));
     return -1;
   }
   if (setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &messagelen, sizeof(size_t)))
-    syslog(LOG_WARNING, "Failed to set socket low watermark: %s", strerror(errno));
+    logmsg(LOG_WARNING, "Failed to set socket low watermark: %s", strerror(errno));
+  if (type == SOCK_DGRAM)
+    rx_setup(fd);
   if (domain == AF_INET)
   {
     int ruseaddr = 1;
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &ruseaddr, sizeof(ruseaddr)))
-      syslog(LOG_WARNING, "Failed to set address reuse on socket: %s", strerror(errno));
+      logmsg(LOG_WARNING, "Failed to set address reuse on socket: %s", strerror(errno));
+  }
+  if (config.receivers > 1 && domain != AF_UNIX)
+  { /* every receiver thread binds its own socket to the same address */
+    int rport = 1;
+#ifdef SO_REUSEPORT_LB
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, &rport, sizeof(rport)))
+#else
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &rport, sizeof(rport)))
+#endif
+      logmsg(LOG_WARNING, "Failed to set port reuse on socket: %s", strerror(errno));
   }
   if (bind(fd, addr, addrlen))
   {
     close(fd);
-    syslog(LOG_ERR, "Failed to bind to address '%s': %s", caddr, strerror(errno));
+    logmsg(LOG_ERR, "Failed to bind to address '%s': %s", caddr, strerror(errno));
     return -2;
   }
-  if (config.sock_type == SOCK_STREAM)
+  if (type == SOCK_STREAM)
   {
     if (listen(fd, DEFAULT_BACKLOG))
     {
       close(fd);
-      syslog(LOG_ERR, "Failed to listen for '%s': %s", caddr, strerror(errno));
+      logmsg(LOG_ERR, "Failed to listen for '%s': %s", caddr, strerror(errno));
       return -3;
     }
+    /* accept() is called until backlog is drained */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
   }
   return fd;
 }
 
+/*
+ * Binds another datagram socket to the address of fd for one more receiver
+ * thread, returns -1 for unix sockets which are served by single receiver.
+ */
+int dupsock(int fd)
+{
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+
+  if (getsockname(fd, (struct sockaddr *)&ss, &len) < 0 ||
+      ss.ss_family == AF_UNIX)
+    return -1;
+  return getsock(ss.ss_family, SOCK_DGRAM, 0, (struct sockaddr *)&ss, len,
+      "address of receiver");
+}
+
+/* arms cleanup timer of partition to the closest expiry wheel deadline */
+void schedule_cleanup(struct part * p)
+{
+  time_t next = expiry_next(&p->expiry);
+
+  if (!next)
+  {
+    evloop_timer_stop(p->loop, &p->cleanup_timer);
+    logmsg(LOG_DEBUG, "Expiration queue is empty!");
+    return;
+  }
+  if (p->cleanup_timer.armed && p->cleanup_at <= next)
+    return;
+
+  time_t closest_exp = next - evloop_time(p->loop);
+  if (closest_exp < 0)
+    closest_exp = 0;
+  p->cleanup_at = next;
+  evloop_timer_start(p->loop, &p->cleanup_timer, closest_exp * 1000);
+  logmsg(LOG_DEBUG, "Next table cleanup in %i seconds", (int)closest_exp);
+}
+
+void index_add(int table, in_addr_t addr, uint8_t mask)
+{
+  memtbl_add(live_index, table, addr, mask, 0);
+  lpm_add(live_lpm, table, addr, mask);
+}
+
+void index_del(int table, in_addr_t addr, uint8_t mask)
+{
+  memtbl_del(live_index, table, addr, mask, NULL);
+  lpm_del(live_lpm, table, addr, mask);
+}
+
+void index_flush(int table)
+{
+  memtbl_flush(live_index, table);
+  lpm_flush(live_lpm, table);
+}
+
+/* keeps index of tables in line with operation applied with given errno */
+void index_op(const struct tbl_op * op, int err)
+{
+  switch (op->cmd)
+  {
+    case CMD_ADD:
+      if (!err || err == EEXIST)
+        index_add(op->table, op->addr, op->mask);
+      break;
+    case CMD_DEL:
+      if (!err || err == ESRCH)
+        index_del(op->table, op->addr, op->mask);
+      break;
+    case CMD_FLUSH:
+      if (!err)
+        index_flush(op->table);
+      break;
+  }
+}
+
+void index_listed(int table, in_addr_t addr, uint8_t mask, void * arg)
+{
+  index_add(table, addr, mask);
+}
+
+void expire_entry(struct exp_rec * r, void * arg)
+{
+  struct part * p = (struct part *)arg;
+  time_t late = evloop_time(p->loop) - (p->expiry.epoch + r->expire);
+  if (late > p->lag)
+    p->lag = late;
+  time_t expire;
+  uint32_t idx;
+
+  /* entry re-timed or removed meanwhile is not the one this record is for */
+  if (lpm_find(live_lpm, r->table, r->addr, r->mask, &expire, &idx) < 0 ||
+      !expire || EXPIRY_REC(&p->expiry, idx) != r)
+    return;
+  STATS_INC(stats.expired);
+
+  index_del(r->table, r->addr, r->mask);
+  journal_log(JREC_DEL, r->table, r->addr, r->mask, 0);
+  struct tbl_op op = { r->table, CMD_DEL, r->mask, r->addr, 0 };
+  p->purge[p->purge_cnt++] = op;
+  if (config.repl_peers_cnt)
+    repl_op(&op);
+  ++p->due[r->table];
+}
+
+/* TTL requested by operation or the one of its table, 0 if none */
+time_t op_ttl(const struct tbl_op * op)
+{
+  if (op->arg)
+    return op->arg;
+  return config.tbl_exp_periods ? config.tbl_exp_periods[op->table] : 0;
+}
+
+struct untrack_arg
+{
+  struct part * p;
+  size_t cnt;
+};
+
+void untrack_entry(int table, in_addr_t addr, uint8_t mask, time_t expire,
+    uint32_t rec, void * arg)
+{
+  struct untrack_arg * ua = (struct untrack_arg *)arg;
+  if (!expire)
+    return;
+  expiry_cancel(&ua->p->expiry, rec);
+  ++ua->cnt;
+}
+
+/*
+ * Starts or moves expiry of entry which has to be in index of tables,
+ * returns 0 or errno.
+ */
+int set_expiry(struct part * p, int table, in_addr_t addr, uint8_t mask,
+    time_t expire)
+{
+  time_t cur;
+  uint32_t idx;
+
+  if (lpm_find(live_lpm, table, addr, mask, &cur, &idx) < 0)
+    return errno;
+  if (!cur)
+    idx = expiry_add(&p->expiry, expire, table, addr, mask);
+  else /* record is replaced if deadline moved closer */
+    idx = expiry_reset(&p->expiry, idx, expire);
+  if (idx == EXPOOL_NIL)
+    return errno;
+  lpm_set(live_lpm, table, addr, mask, expire, idx);
+  journal_log(JREC_SET, table, addr, mask, expire);
+  return 0;
+}
+
+/* entry does not expire anymore, returns 0 or ESRCH if it did not */
+int drop_expiry(struct part * p, int table, in_addr_t addr, uint8_t mask)
+{
+  time_t expire;
+  uint32_t idx;
+
+  if (lpm_find(live_lpm, table, addr, mask, &expire, &idx) < 0 || !expire)
+    return ESRCH;
+  expiry_cancel(&p->expiry, idx);
+  lpm_set(live_lpm, table, addr, mask, 0, 0);
+  journal_log(JREC_DEL, table, addr, mask, 0);
+  return 0;
+}
+
+/* cancels expiry of every entry of table, before it is flushed from index */
+void flush_expiry(struct part * p, int table)
+{
+  struct untrack_arg ua = { p, 0 };
+
+  lpm_walk(live_lpm, table, untrack_entry, &ua);
+  if (ua.cnt)
+    journal_log(JREC_FLUSH, table, 0, 0, 0);
+}
+
+/*
+ * Keeps expiry of entries in line with operation applied to table, returns
+ * 0 or errno for the operation (REFRESH of entry without TTL fails).
+ */
+int track_expiry(struct part * p, const struct tbl_op * op, time_t ct)
+{
+  time_t expire, ttl = op_ttl(op);
+
+  switch (op->cmd)
+  {
+    case CMD_FLUSH:
+      flush_expiry(p, op->table);
+      return 0;
+    case CMD_DEL:
+      drop_expiry(p, op->table, op->addr, op->mask);
+      return 0;
+    case CMD_REFRESH:
+      if (lpm_find(live_lpm, op->table, op->addr, op->mask, &expire,
+            NULL) < 0 || !expire)
+        return ESRCH;
+      break;
+    default:
+      if (!ttl)
+      { /* added again without TTL, entry is permanent from now on */
+        drop_expiry(p, op->table, op->addr, op->mask);
+        return 0;
+      }
+      break;
+  }
+
+  int err = set_expiry(p, op->table, op->addr, op->mask, ct + ttl);
+  if (!err && log_enabled(LOG_DEBUG))
+  {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &op->addr, ip, sizeof(ip));
+    logmsg(LOG_DEBUG, "Entry %s/%i of table %i expires at %i",
+        ip, op->mask, op->table, (int)(ct + ttl));
+  }
+  return err;
+}
+
+/* applies record of journal or snapshot on startup */
+void restore_entry(const struct jrec * r, void * arg)
+{
+  switch (r->type)
+  {
+    case JREC_SET:
+      if (r->table < tables_max && r->mask <= 32)
+        set_expiry(PART(r->table), r->table, r->addr, r->mask, r->expire);
+      break;
+    case JREC_DEL:
+      if (r->table < tables_max)
+        drop_expiry(PART(r->table), r->table, r->addr, r->mask);
+      break;
+    case JREC_FLUSH:
+      if (r->table < tables_max)
+        flush_expiry(PART(r->table), r->table);
+      break;
+  }
+}
+
+void snap_entry(int table, in_addr_t addr, uint8_t mask, time_t expire,
+    uint32_t rec, void * arg)
+{
+  if (expire)
+    journal_snap_entry(table, addr, mask, expire);
+}
+
+void dump_expiry(void * arg)
+{
+  int i;
+  for (i = 0; i < tables_max; ++i)
+    lpm_walk(live_lpm, i, snap_entry, NULL);
+}
+
+/* flushes journal and compacts it once it is mostly superseded records */
+void sync_journal(struct evloop * loop, struct ev_timer * t)
+{
+  journal_sync();
+  journal_reap();
+  if (journal_records() > JOURNAL_COMPACT_MIN &&
+      journal_records() > 2 * expiry_pending())
+    journal_compact(dump_expiry, NULL);
+  evloop_timer_start(loop, t, JOURNAL_SYNC_MS);
+}
+
+struct due_arg
+{
+  time_t now;
+  size_t due;
+};
+
+void count_due(int table, in_addr_t addr, uint8_t mask, time_t expire,
+    uint32_t rec, void * arg)
+{
+  struct due_arg * da = (struct due_arg *)arg;
+  if (expire && expire <= da->now)
+    ++da->due;
+}
+
+/*
+ * Flushes table instead of deleting due expired entries from it if all the
+ * other entries of table are due too and there is nothing else in it. The
+ * ones still in wheel are expired at once then. Returns 1 if table was
+ * flushed.
+ */
+int purge_table(struct part * p, int table, uint32_t due)
+{
+  size_t left = lpm_count(live_lpm, table);
+  time_t now = evloop_time(p->loop);
+
+  if (left)
+  { /* walking table is cheap but still not worth doing on every slice */
+    struct due_arg da = { now, 0 };
+    if (p->checked[table] == now)
+      return 0;
+    p->checked[table] = now;
+    lpm_walk(live_lpm, table, count_due, &da);
+    if (da.due != left)
+      return 0;
+  }
+  if (due + left < 2 || backend->size(table) != due + left ||
+      backend->flush(table) < 0)
+    return 0;
+
+  if (left)
+  {
+    flush_expiry(p, table);
+    STATS_ADD(stats.expired, left);
+  }
+  index_flush(table);
+  if (config.repl_peers_cnt)
+  {
+    struct tbl_op op = { table, CMD_FLUSH, 0, 0, 0 };
+    repl_op(&op);
+  }
+  STATS_INC(stats.expiry_flushes);
+  STATS_ADD(stats.expiry_flush_saved, due + left);
+  return 1;
+}
+
+/*
+ * Deletes entries expired by the last run of wheel from tables, flushing
+ * tables where possible instead.
+ */
+void purge_entries(struct part * p)
+{
+  int i, cnt = 0;
+
+  for (i = 0; i < p->purge_cnt; ++i)
+  {
+    struct tbl_op * op = &p->purge[i];
+    uint32_t due = p->due[op->table];
+    if (due == PURGE_FLUSH)
+      continue;
+    if (due != PURGE_DELETE)
+    { /* the first expired entry of table decides for all of them */
+      if (purge_table(p, op->table, due))
+      {
+        p->due[op->table] = PURGE_FLUSH;
+        continue;
+      }
+      p->due[op->table] = PURGE_DELETE;
+    }
+    p->purge[cnt++] = *op;
+  }
+  for (i = 0; i < p->purge_cnt; ++i)
+    p->due[p->purge[i].table] = 0;
+  p->purge_cnt = 0;
+
+  if (config.coalesce_ms)
+  {
+    for (i = 0; i < cnt; ++i)
+      coalesce_op(&p->coal, &p->purge[i]);
+  } else if (cnt)
+    backend->batch(p->purge, cnt, NULL);
+}
+
+void cleanup_tables(struct evloop * loop, struct ev_timer * t)
+{
+  struct part * p = (struct part *)((char *)t -
+      offsetof(struct part, cleanup_timer));
+
+  logmsg(LOG_DEBUG, "Performing tables cleanup");
+  /* expire in slices not to hold back requests for long */
+  uint64_t start = stats_usec();
+  size_t expired = 0;
+  p->lag = 0;
+  for ( ; ; )
+  {
+    size_t want = MESSAGE_V2_MAXRECS;
+    if (want > config.purge_ops - expired)
+      want = config.purge_ops - expired;
+    size_t cnt = expiry_run(&p->expiry, evloop_time(loop), expire_entry, p,
+        want);
+    purge_entries(p);
+    expired += cnt;
+    if (cnt < want) /* nothing is due anymore */
+      break;
+    if (expired >= config.purge_ops || (config.purge_ms &&
+          stats_usec() - start >= config.purge_ms * 1000ULL))
+    { /* the rest is left to the next loop iteration */
+      STATS_INC(stats.expiry_cut);
+      break;
+    }
+  }
+  STATS_SET(stats.expiry_lag, p->lag);
+  logmsg(LOG_DEBUG, "Tables cleanup finished (%zu expired, %zu left, "
+      "%zu KB of expiry records)", expired, p->expiry.count,
+      expool_mem(&p->expiry.pool) / 1024);
+
+  schedule_cleanup(p);
+}
+
+/* checks operation normalizing its mask, returns 1 if it is valid */
+int valid_op(struct tbl_op * op)
+{
+  if (op->table >= tables_max)
+  {
+    logmsg(LOG_ERR, "Table id %i exceeds maximum allowed value (%i)",
+           op->table, tables_max);
+    return 0;
+  }
+  if (op->mask <= 0)
+    op->mask = 32;
+  if (op->mask > 32)
+  {
+    logmsg(LOG_ERR, "Invalid mask length %i", op->mask);
+    return 0;
+  }
+  if (op->cmd == CMD_LOOKUP || op->cmd == CMD_LIST || op->cmd == CMD_REPLACE)
+  { /* handled as whole messages over stream only */
+    logmsg(LOG_NOTICE, "Query mixed with updates or sent over datagram");
+    return 0;
+  }
+  if (op->cmd != CMD_ADD && op->cmd != CMD_DEL && op->cmd != CMD_FLUSH &&
+      op->cmd != CMD_REFRESH)
+  {
+    logmsg(LOG_NOTICE, "Unknown command: %i", op->cmd);
+    return 0;
+  }
+  if (op->cmd == CMD_REFRESH && !op_ttl(op))
+  {
+    logmsg(LOG_NOTICE, "No TTL to refresh entry of table %i with", op->table);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Drops invalid operations compacting the rest in place (which does not
+ * happen for well-behaving clients), returns amount of operations left.
+ * Status of dropped operations is set and positions of the ones left are
+ * stored into idx if status is requested.
+ */
+int validate_ops(struct tbl_op * ops, int cnt, uint8_t * status, int * idx)
+{
+  int i, valid = 0;
+  for (i = 0; i < cnt; ++i)
+  {
+    struct tbl_op * op = &ops[i];
+    if (status)
+      status[i] = STATUS_INVALID;
+    if (!valid_op(op))
+    {
+      stats_op(op->table < tables_max ? op->table : -1, op->cmd,
+          STATUS_INVALID);
+      continue;
+    }
+    if (valid != i)
+      ops[valid] = *op;
+    if (status)
+      idx[valid] = i;
+    ++valid;
+  }
+  return valid;
+}
+
+/*
+ * Marks ADDs of entries which are in tables already, these only refresh
+ * expiry of entry and are not passed to backend. Entries are not relied on
+ * to stay there past the first DEL or FLUSH of batch. Returns amount of
+ * ADDs marked.
+ */
+int mark_dups(const struct tbl_op * ops, int cnt, uint8_t * dup)
+{
+  int i, dups = 0;
+  time_t expire;
+
+  memset(dup, 0, cnt);
+  for (i = 0; i < cnt; ++i)
+  {
+    if (ops[i].cmd == CMD_DEL || ops[i].cmd == CMD_FLUSH)
+      break;
+    if (ops[i].cmd == CMD_ADD && lpm_find(live_lpm, ops[i].table,
+          ops[i].addr, ops[i].mask, &expire, NULL) == 0)
+    {
+      dup[i] = 1;
+      ++dups;
+    }
+  }
+  if (dups)
+    STATS_ADD(stats.index_dup_adds, dups);
+  return dups;
+}
+
+/* passes operations not marked as duplicate to backend */
+void apply_fresh(const struct tbl_op * ops, int cnt, const uint8_t * dup,
+    int dups, int * errs)
+{
+  struct tbl_op kops[MESSAGE_V2_MAXRECS];
+  int i, k = 0, kerrs[MESSAGE_V2_MAXRECS];
+
+  if (!dups)
+  {
+    backend->batch(ops, cnt, errs);
+    return;
+  }
+  for (i = 0; i < cnt; ++i)
+    if (!dup[i])
+      kops[k++] = ops[i];
+  if (k)
+    backend->batch(kops, k, kerrs);
+  for (i = 0, k = 0; i < cnt; ++i)
+    errs[i] = dup[i] ? 0 : kerrs[k++];
+}
+
+/*
+ * Applies valid operations on tables of partition as single batch. If status
+ * is not NULL it receives STATUS_* of every operation at position from idx.
+ */
+void commit_batch(struct part * p, struct tbl_op * ops, int cnt,
+    uint8_t * status, int * idx)
+{
+  int i, errs[MESSAGE_V2_MAXRECS];
+  uint8_t dup[MESSAGE_V2_MAXRECS];
+  int dups = mark_dups(ops, cnt, dup);
+
+  if (config.coalesce_ms && !status)
+  { /* outcome is not reported, hold operations back to collapse them */
+    for (i = 0; i < cnt; ++i)
+    {
+      if (ops[i].cmd != CMD_REFRESH && !dup[i])
+        coalesce_op(&p->coal, &ops[i]);
+      errs[i] = 0;
+    }
+  } else
+  {
+    if (config.coalesce_ms) /* held back ones go first to keep order */
+      coalesce_flush(&p->coal);
+    uint64_t start = stats_usec();
+    apply_fresh(ops, cnt, dup, dups, errs);
+    stats_lat(STATS_LAT_BATCH, start);
+  }
+
+  /*
+   * Index and expiry are updated in request order for REFRESH to see
+   * preceding ADD, expiry of entries is cancelled before they leave index.
+   */
+  time_t ct = evloop_time(p->loop);
+  if (!p->expiry.count) /* catch up wheel time, nothing to expire anyway */
+    expiry_run(&p->expiry, ct, NULL, NULL, 0);
+  for (i = 0; i < cnt; ++i)
+  {
+    struct tbl_op * op = &ops[i];
+    if (op->cmd == CMD_DEL || op->cmd == CMD_FLUSH)
+    { /* entry failed to be deleted from table is not expired anyway */
+      if (!errs[i] || op->cmd == CMD_DEL)
+        track_expiry(p, op, ct);
+      index_op(op, errs[i]);
+    } else
+    {
+      index_op(op, errs[i]);
+      if (!errs[i])
+        errs[i] = track_expiry(p, op, ct);
+    }
+  }
+
+  for (i = 0; i < cnt; ++i)
+  {
+    uint8_t st = proto_status(errs[i]);
+    stats_op(ops[i].table, ops[i].cmd, st);
+    if (status)
+      status[idx[i]] = st;
+    if (config.repl_peers_cnt && !errs[i] && !dup[i] && !applying_replica)
+    { /* peers get TTL in effect here whatever theirs are */
+      struct tbl_op op = ops[i];
+      if (op.cmd == CMD_ADD || op.cmd == CMD_REFRESH)
+        op.arg = op_ttl(&op);
+      repl_op(&op);
+    }
+  }
+
+  schedule_cleanup(p);
+}
+
+/*
+ * Applies operations at once whatever is queued or held back, returns
+ * amount of failed ones. Used for entries imported on startup before apply
+ * threads are running and for REPLACE served by the main loop.
+ */
+int commit_now(struct tbl_op * ops, int cnt, void * arg)
+{
+  uint8_t status[MESSAGE_V2_MAXRECS];
+  int i, idx[MESSAGE_V2_MAXRECS], failed = 0;
+
+  for (i = 0; i < cnt; ++i)
+    idx[i] = i;
+  commit_batch(PART(ops[0].table), ops, cnt, status, idx);
+  for (i = 0; i < cnt; ++i)
+    if (status[i] != STATUS_OK)
+      ++failed;
+  return failed;
+}
+
+/* bulk operations leaving priority lanes queue */
+void apply_bulk(struct tbl_op * ops, int cnt, void * arg)
+{
+  commit_batch((struct part *)arg, ops, cnt, NULL, NULL);
+}
+
+/*
+ * Same as commit_batch() but unless status is requested bulk operations are
+ * queued behind urgent ones with priority lanes enabled.
+ */
+void apply_batch(struct part * p, struct tbl_op * ops, int cnt,
+    uint8_t * status, int * idx)
+{
+  if (config.lane_max && !status)
+  {
+    if (!(cnt = lane_split(&p->lane, ops, cnt)))
+      return;
+  } else if (config.lane_max) /* queued ones go first to keep order */
+    lane_flush(&p->lane);
+  commit_batch(p, ops, cnt, status, idx);
+}
+
+/*
+ * Applies all operations of the message as single batch. If status is not
+ * NULL it receives STATUS_* of every operation.
+ */
+void apply_ops(struct tbl_op * ops, int cnt, uint8_t * status)
+{
+  int idx[MESSAGE_V2_MAXRECS];
+
+  if ((cnt = validate_ops(ops, cnt, status, idx)))
+    apply_batch(&parts[0], ops, cnt, status, idx);
+}
+
+/* operations handed over by receivers to apply thread of partition */
+void apply_queued(int id, struct tbl_op * ops, int cnt)
+{
+  apply_batch(&parts[id], ops, cnt, NULL, NULL);
+}
+
+/* routes valid operations of the message to apply threads of their tables */
+void route_message(void * buf, size_t len, const struct sockaddr * src,
+    void * arg)
+{
+  struct tbl_op v1op, * ops;
+  trace_message(TRACE_DGRAM, buf, len, src);
+  int cnt = proto_decode(buf, len, &v1op, &ops);
+  if (cnt < 0)
+    logmsg(LOG_NOTICE, "Malformed message of %i bytes: %s",
+        (int)len, strerror(errno));
+  else if (config.rate_limit && !admit_message(src, cnt))
+    return;
+  else if ((cnt = validate_ops(ops, cnt, NULL, NULL)))
+    worker_submit((int)(intptr_t)arg, ops, cnt);
+}
+
+void process_message(void * buf, size_t len, const struct sockaddr * src,
+    void * arg)
+{
+  struct tbl_op v1op, * ops;
+  trace_message(TRACE_DGRAM, buf, len, src);
+  int cnt = proto_decode(buf, len, &v1op, &ops);
+  if (cnt < 0)
+    logmsg(LOG_NOTICE, "Malformed message of %i bytes: %s",
+        (int)len, strerror(errno));
+  else if (!config.rate_limit || admit_message(src, cnt))
+    apply_ops(ops, cnt, NULL);
+}
+
+void on_datagram(struct evloop * loop, struct ev_io * io, int events)
+{ /* drain as many datagrams as budget allows */
+  struct listener * l = (struct listener *)io;
+  if (!config.workers)
+  {
+    rx_drain(io->fd, config.rx_budget, &l->ovfl, process_message, NULL);
+    return;
+  }
+  rx_drain(io->fd, config.rx_budget, &l->ovfl, route_message, io->arg);
+  worker_flush((int)(intptr_t)io->arg);
+}
+
+struct shmring * shm;  /* with -M only */
+struct ev_io shm_io;
+struct ev_timer shm_timer;
+
+/*
+ * Applies records local clients put into shared memory ring, goes asleep
+ * once it is empty. Records past the budget are left for the next loop
+ * iteration for sockets not to starve.
+ */
+void drain_shm(void)
+{
+  struct tbl_op ops[MESSAGE_V2_MAXRECS];
+  int cnt, taken = 0;
+
+  while (taken < SHMRING_BUDGET &&
+      (cnt = shmring_get(shm, ops, MESSAGE_V2_MAXRECS)) > 0)
+  {
+    STATS_INC(stats.shm_batches);
+    STATS_ADD(stats.shm_ops, cnt);
+    apply_ops(ops, cnt, NULL);
+    taken += cnt;
+  }
+  if (taken >= SHMRING_BUDGET || shmring_sleep(shm) < 0)
+    evloop_timer_start(loop, &shm_timer, 0);
+}
+
+void on_shm_wake(struct evloop * loop, struct ev_io * io, int events)
+{
+  shmring_woken(shm);
+  STATS_INC(stats.shm_wakeups);
+  drain_shm();
+}
+
+void on_shm_timer(struct evloop * loop, struct ev_timer * t)
+{
+  drain_shm();
+}
+
+/* seconds left before deadline, 0 if entry does not expire */
+uint32_t ttl_left(time_t expire, time_t now)
+{
+  if (!expire)
+    return 0;
+  return expire > now ? expire - now : 1; /* due, purged shortly */
+}
+
+struct list_job
+{
+  int table;
+  uint32_t seq;
+  uint64_t pos;     /* of the next entry, see memtbl_scan() */
+  time_t now;
+  int cnt;
+  struct tbl_op recs[MESSAGE_V2_MAXRECS];
+};
+
+void list_entry(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg)
+{
+  struct list_job * j = (struct list_job *)arg;
+  struct tbl_op * r = &j->recs[j->cnt++];
+  time_t expire = 0;
+
+  lpm_find(live_lpm, table, addr, mask, &expire, NULL);
+  r->table = table;
+  r->cmd = STATUS_OK;
+  r->mask = mask;
+  r->addr = addr;
+  r->arg = ttl_left(expire, j->now);
+}
+
+/* queues next chunk of LIST reply, entries changed meanwhile may be missed */
+int list_chunk(struct session * s, void * arg)
+{
+  struct list_job * j = (struct list_job *)arg;
+  uint32_t reply[MESSAGE_MAXLEN / sizeof(uint32_t)];
+
+  j->cnt = 0;
+  j->now = evloop_time(loop);
+  memtbl_scan(live_index, j->table, &j->pos, list_entry, j,
+      MESSAGE_V2_MAXRECS);
+  int more = (j->cnt == MESSAGE_V2_MAXRECS);
+  if (session_reply(s, reply, proto_records(reply, j->seq, more, j->recs,
+          j->cnt)) < 0)
+  {
+    logmsg(LOG_ERR, "Failed to queue reply: %s", strerror(errno));
+    return 0;
+  }
+  return more;
+}
+
+/*
+ * Answers message of LOOKUP records or single LIST record from index of
+ * tables, returns 0 if message is not query. LIST reply is produced in
+ * chunks as peer takes them.
+ */
+int answer_query(struct session * s, uint32_t seq, struct tbl_op * ops,
+    int cnt)
+{
+  uint32_t reply[MESSAGE_MAXLEN / sizeof(uint32_t)];
+  time_t now = evloop_time(loop), expire;
+  int i;
+
+  if (cnt == 1 && ops[0].cmd == CMD_LIST && ops[0].table < tables_max)
+  {
+    struct list_job * j = (struct list_job *)calloc(1, sizeof(*j));
+    if (!j)
+    {
+      logmsg(LOG_ERR, "Failed to start listing: %s", strerror(errno));
+      ops[0].cmd = STATUS_FAILED;
+    } else
+    {
+      stats_op(ops[0].table, CMD_LIST, STATUS_OK);
+      j->table = ops[0].table;
+      j->seq = seq;
+      session_pull(s, list_chunk, j);
+      return 1;
+    }
+  } else if (cnt == 1 && ops[0].cmd == CMD_LIST)
+    ops[0].cmd = STATUS_INVALID;
+  else
+  {
+    for (i = 0; i < cnt && ops[i].cmd == CMD_LOOKUP; ++i)
+      ;
+    if (!cnt || i != cnt)
+      return 0;
+    for (i = 0; i < cnt; ++i)
+    {
+      struct tbl_op * op = &ops[i];
+      if (op->table >= tables_max)
+        op->cmd = STATUS_INVALID;
+      else if (lpm_lookup(live_lpm, op->table, op->addr, &op->mask,
+            &expire) < 0)
+        op->cmd = STATUS_NOENT;
+      else
+      {
+        op->cmd = STATUS_OK;
+        op->addr &= op->mask ? htonl(0xffffffffU << (32 - op->mask)) : 0;
+        op->arg = ttl_left(expire, now);
+      }
+      stats_op(op->table < tables_max ? op->table : -1, CMD_LOOKUP, op->cmd);
+      if (op->cmd != STATUS_OK)
+        op->mask = op->arg = 0;
+    }
+  }
+
+  if (session_reply(s, reply, proto_records(reply, seq, 0, ops, cnt)) < 0)
+    logmsg(LOG_ERR, "Failed to queue reply: %s", strerror(errno));
+  return 1;
+}
+
+/* desired contents of table accumulated from REPLACE series of session */
+struct replace_job
+{
+  int table;
+  uint8_t status;   /* STATUS_* of series so far */
+  size_t cnt;
+  size_t size;      /* of recs allocated */
+  struct tbl_op recs[];
+};
+
+int cmp_entry(const void * a, const void * b)
+{
+  const struct tbl_op * x = (const struct tbl_op *)a;
+  const struct tbl_op * y = (const struct tbl_op *)b;
+  uint32_t xa = ntohl(x->addr), ya = ntohl(y->addr);
+  if (xa != ya)
+    return xa < ya ? -1 : 1;
+  return (int)x->mask - (int)y->mask;
+}
+
+struct stale_arg
+{
+  const struct replace_job * j;
+  struct tbl_op * dels;
+  size_t cnt;
+};
+
+void stale_entry(int table, in_addr_t addr, uint8_t mask, time_t expire,
+    uint32_t rec, void * arg)
+{
+  struct stale_arg * sa = (struct stale_arg *)arg;
+  struct tbl_op key = { table, CMD_DEL, mask, addr, 0 };
+
+  if (!bsearch(&key, sa->j->recs, sa->j->cnt, sizeof(struct tbl_op),
+        cmp_entry))
+    sa->dels[sa->cnt++] = key;
+}
+
+/* passes operations to commit_now() in batches, returns amount failed */
+size_t commit_all(struct tbl_op * ops, size_t cnt)
+{
+  size_t i, failed = 0;
+
+  for (i = 0; i < cnt; i += MESSAGE_V2_MAXRECS)
+    failed += commit_now(ops + i, cnt - i < MESSAGE_V2_MAXRECS ?
+        cnt - i : MESSAGE_V2_MAXRECS, NULL);
+  return failed;
+}
+
+/*
+ * Makes table match desired contents, missing entries are added before the
+ * stale ones are deleted so that table never lacks entries which stay.
+ * Returns STATUS_* storing amounts of entries added and deleted.
+ */
+uint8_t replace_table(struct replace_job * j, uint32_t * added,
+    uint32_t * deleted)
+{
+  struct part * p = PART(j->table);
+  size_t i, n = 0, adds = 0, failed;
+  time_t expire;
+
+  /* bulk operations still queued have to be in index before it is diffed */
+  if (config.lane_max)
+    lane_flush(&p->lane);
+  if (config.coalesce_ms)
+    coalesce_flush(&p->coal);
+  qsort(j->recs, j->cnt, sizeof(struct tbl_op), cmp_entry);
+  for (i = 0; i < j->cnt; ++i) /* the first of duplicates stays */
+    if (!n || cmp_entry(&j->recs[i], &j->recs[n - 1]))
+      j->recs[n++] = j->recs[i];
+  j->cnt = n;
+
+  struct stale_arg sa = { j, NULL, 0 };
+  if (!(sa.dels = (struct tbl_op *)malloc((lpm_count(live_lpm, j->table) +
+            1) * sizeof(struct tbl_op))))
+  {
+    logmsg(LOG_ERR, "Failed to replace table %i: %s", j->table,
+        strerror(errno));
+    return STATUS_FAILED;
+  }
+  lpm_walk(live_lpm, j->table, stale_entry, &sa);
+
+  /* entries to add are moved to the front in place */
+  for (i = 0; i < j->cnt; ++i)
+    if (lpm_find(live_lpm, j->table, j->recs[i].addr, j->recs[i].mask,
+          &expire, NULL) < 0)
+    {
+      j->recs[adds] = j->recs[i];
+      j->recs[adds++].cmd = CMD_ADD;
+    }
+  failed = commit_all(j->recs, adds);
+  failed += commit_all(sa.dels, sa.cnt);
+  free(sa.dels);
+
+  *added = adds;
+  *deleted = sa.cnt;
+  STATS_INC(stats.replace_tables);
+  STATS_ADD(stats.replace_added, adds);
+  STATS_ADD(stats.replace_deleted, sa.cnt);
+  STATS_ADD(stats.replace_unchanged, j->cnt - adds);
+  logmsg(LOG_INFO, "Replaced contents of table %i: %zu added, %zu deleted, "
+      "%zu unchanged, %zu failed", j->table, adds, sa.cnt, j->cnt - adds,
+      failed);
+  return failed ? STATUS_FAILED : STATUS_OK;
+}
+
+/*
+ * Accumulates message of REPLACE series applying it once the last message
+ * arrives, returns 0 if message is neither REPLACE nor part of series.
+ */
+int replace_message(struct session * s, uint8_t flags, uint32_t seq,
+    struct tbl_op * ops, int cnt)
+{
+  struct replace_job * j = (struct replace_job *)s->data;
+  uint8_t status[MESSAGE_V2_MAXRECS];
+  int i;
+
+  if (!j && (!cnt || ops[0].cmd != CMD_REPLACE))
+    return 0;
+  if (!j)
+  {
+    if (!(j = (struct replace_job *)calloc(1, sizeof(*j))))
+    {
+      logmsg(LOG_ERR, "Failed to start replacing: %s", strerror(errno));
+      return 0; /* records are rejected as usual */
+    }
+    j->table = ops[0].table;
+    j->status = STATUS_OK;
+    s->data = j;
+  }
+
+  if (j->status == STATUS_OK && j->cnt + cnt > j->size)
+  {
+    size_t size = j->size ? 2 * j->size : MESSAGE_V2_MAXRECS;
+    struct replace_job * n = (struct replace_job *)realloc(j, sizeof(*j) +
+        size * sizeof(struct tbl_op));
+    if (!n)
+    {
+      logmsg(LOG_ERR, "Failed to accumulate contents of table %i: %s",
+          j->table, strerror(errno));
+      j->status = STATUS_FAILED;
+    } else
+    {
+      s->data = j = n;
+      j->size = size;
+    }
+  }
+  for (i = 0; i < cnt; ++i)
+  { /* the whole series is dropped once any record of it is invalid */
+    struct tbl_op * op = &ops[i];
+    if (!op->mask)
+      op->mask = 32;
+    status[i] = STATUS_OK;
+    if (op->cmd != CMD_REPLACE || op->table != j->table ||
+        op->table >= tables_max || op->mask > 32)
+    {
+      status[i] = STATUS_INVALID;
+      if (j->status == STATUS_OK)
+        j->status = STATUS_INVALID;
+    } else if (j->status == STATUS_OK)
+    {
+      op->addr &= htonl(0xffffffffU << (32 - op->mask));
+      j->recs[j->cnt++] = *op;
+    }
+  }
+
+  if (flags & MSGF_MORE)
+  {
+    if (flags & MSGF_ACK)
+    {
+      uint32_t reply[(sizeof(struct message_hdr) + MESSAGE_V2_MAXRECS + 3) /
+        4];
+      if (session_reply(s, reply, proto_reply(reply, seq, status, cnt)) < 0)
+        logmsg(LOG_ERR, "Failed to queue reply: %s", strerror(errno));
+    }
+    return 1;
+  }
+
+  uint32_t added = 0, deleted = 0, reply[MESSAGE_MAXLEN / sizeof(uint32_t)];
+  if (j->status == STATUS_OK)
+    j->status = replace_table(j, &added, &deleted);
+  stats_op(j->table < tables_max ? j->table : -1, CMD_REPLACE, j->status);
+  struct tbl_op res = { j->table, j->status, 0, htonl(added), deleted };
+  if (session_reply(s, reply, proto_records(reply, seq, 0, &res, 1)) < 0)
+    logmsg(LOG_ERR, "Failed to queue reply: %s", strerror(errno));
+  free(j);
+  s->data = NULL;
+  return 1;
+}
+
+/* frame of stream session, replied to if acknowledgement is requested */
+void on_frame(struct session * s, void * frame, size_t len)
+{
+  struct message_hdr * hdr = (struct message_hdr *)frame;
+  int ack = (hdr->version == MESSAGE_V2 && (hdr->flags & MSGF_ACK));
+  uint32_t seq = ntohl(hdr->seq);
+
+  struct tbl_op v1op, * ops;
+  trace_message(TRACE_STREAM, frame, len, (struct sockaddr *)&s->peer);
+  int cnt = proto_decode(frame, len, &v1op, &ops);
+  if (cnt < 0)
+  {
+    logmsg(LOG_NOTICE, "Malformed message of %i bytes: %s",
+        (int)len, strerror(errno));
+    return;
+  }
+  if (hdr->version == MESSAGE_V2 && answer_query(s, seq, ops, cnt))
+    return;
+  if (hdr->version == MESSAGE_V2 && replace_message(s, hdr->flags, seq, ops,
+        cnt))
+    return;
+  int replica = (hdr->version == MESSAGE_V2 && (hdr->flags & MSGF_REPL));
+  if (replica)
+    repl_received(seq, cnt);
+
+  /* replicated operations are applied at once, never queued or held back */
+  uint8_t status[MESSAGE_V2_MAXRECS];
+  if (!config.rate_limit || admit_message((struct sockaddr *)&s->peer, cnt))
+  {
+    applying_replica = replica;
+    apply_ops(ops, cnt, (ack || replica) ? status : NULL);
+    applying_replica = 0;
+  }
+  else if (ack) /* sender is told it went over its limit */
+    memset(status, STATUS_FAILED, cnt);
+
+  if (ack)
+  {
+    uint32_t reply[(sizeof(struct message_hdr) + MESSAGE_V2_MAXRECS + 3) / 4];
+    if (session_reply(s, reply, proto_reply(reply, seq, status, cnt)) < 0)
+      logmsg(LOG_ERR, "Failed to queue reply: %s", strerror(errno));
+  }
+}
+
+void on_accept(struct evloop * loop, struct ev_io * io, int events)
+{
+  for ( ; ; )
+  { /* drain whole backlog of pending connections */
+    struct sockaddr_storage peer;
+    socklen_t peerlen = sizeof(peer);
+    int sock = accept(io->fd, (struct sockaddr *)&peer, &peerlen);
+    if (sock < 0)
+    {
+      if (errno == ECONNABORTED || errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        logmsg(LOG_NOTICE, "Failed to accept connection: %s", strerror(errno));
+      return;
+    }
+
+    struct session * s = session_new(loop, sock, on_frame);
+    if (!s)
+    {
+      logmsg(LOG_ERR, "Failed to set up session: %s", strerror(errno));
+      close(sock);
+    } else if (peerlen <= sizeof(peer))
+      memcpy(&s->peer, &peer, peerlen);
+  }
+}
+
+/* writes statistics snapshot to every connecting client */
+void on_stats(struct evloop * loop, struct ev_io * io, int events)
+{
+  static char buf[65536];
+
+  STATS_SET(stats.expiry_pending, expiry_pending());
+  STATS_SET(stats.lane_pending, lane_pending());
+  if (config.workers)
+    STATS_SET(stats.worker_pending, worker_pending());
+  size_t len = stats_format(buf, sizeof(buf));
+  for ( ; ; )
+  {
+    int sock = accept(io->fd, NULL, NULL);
+    if (sock < 0)
+    {
+      if (errno == ECONNABORTED || errno == EINTR)
+        continue;
+      return;
+    }
+    /* snapshot is small enough to fit into socket buffer */
+    if (send(sock, buf, len, MSG_DONTWAIT) < 0)
+      logmsg(LOG_DEBUG, "Failed to send statistics: %s", strerror(errno));
+    close(sock);
+  }
+}
+
+volatile sig_atomic_t stopping; /* checked by replay between messages */
+
 void sighand(int signum)
 {
-  syslog(LOG_NOTICE, "Caught %i signal.", signum);
+  stopping = 1;
+  if (loop) /* stops at the top of its next iteration */
+    evloop_break(loop);
+  logmsg(LOG_NOTICE, "Caught %i signal.", signum);
 }
 
-int main (int argc, char * argv[])
+void configure_expiry(char * spec)
 {
-  char * ident = basename(argv[0]);
+  if (!config.tbl_exp_periods)
+    config.tbl_exp_periods = (time_t *)calloc(tables_max, sizeof(time_t));
+
+  char * expiryspec = spec;
+  char * s_tblidx = strsep(&expiryspec, ":");
+  char * s_exp = (expiryspec) ?
+    /*    table index specified */ expiryspec :
+    /* no table index specified */ s_tblidx;
+
+  time_t i_exp = (time_t)strtol(s_exp, NULL, 10);
+  int i_tblidx = -1;
+  if (s_tblidx != s_exp)
+    i_tblidx = (int)strtol(s_tblidx, NULL, 10);
 
-  uint32_t tables_max;
-  size_t tables_max_len = sizeof(tables_max);
-  if (sysctlbyname("net.inet.ip.fw.tables_max",
-        &tables_max, &tables_max_len, NULL, 0) == -1)
+  if (i_tblidx != -1)
   {
-#ifdef IPFW_TABLES_MAX
-    warn("Failed to get maximum amount of IPFW tables via sysctl");
-    tables_max = IPFW_TABLES_MAX;
-#else
-    errx(EXIT_FAILURE, "Failed to get maximum amount of IPFW tables");
-#endif
+    if (i_tblidx < 0 || i_tblidx >= tables_max)
+    {
+      warnx("Value of table index must lie within [0;%i).", tables_max);
+      return;
+    }
+
+    config.tbl_exp_periods[i_tblidx] = i_exp;
+    logmsg(LOG_DEBUG, "Configured expiry interval for table (%i) is %i seconds",
+        i_tblidx, (int)i_exp);
+  } else
+  {
+    int i;
+    for (i = 0; i < tables_max; ++i)
+      config.tbl_exp_periods[i] = i_exp;
+    logmsg(LOG_INFO, "Configured expiry interval for all tables is %i seconds",
+        (int)i_exp);
   }
+}
+
+/* wraps backend into aggregating one for tables given with -a */
+void configure_aggregation(void)
+{
+  int8_t * lens = (int8_t *)malloc(tables_max);
+  int i;
+
+  if (!lens)
+    err(EXIT_FAILURE, "Failed to allocate aggregated tables");
+  memset(lens, -1, tables_max);
+  for (i = 0; i < config.agg_specs_cnt; ++i)
+  {
+    char * end;
+    long table = strtol(config.agg_specs[i], &end, 10);
+    long len = *end == ':' ? strtol(end + 1, NULL, 10) : AGG_DEFAULT_LEN;
+
+    if (table < 0 || table >= tables_max)
+      errx(EXIT_FAILURE, "Aggregated table %li exceeds maximum allowed value "
+          "(%u).", table, tables_max - 1);
+    if (len < 0 || len > 32)
+      errx(EXIT_FAILURE, "Aggregation length must lie within [0;32].");
+    lens[table] = (int8_t)len;
+    logmsg(LOG_INFO, "Entries of table %li are aggregated into /%li and "
+        "longer prefixes", table, len);
+  }
+  if (!(backend = agg_wrap(backend, tables_max, lens)))
+    err(EXIT_FAILURE, "Failed to allocate aggregation state");
+}
+
+/* initializes expiry state of partitions */
+void setup_parts(void)
+{
+  int i;
+  if (!(parts = (struct part *)calloc(nparts, sizeof(struct part))))
+    err(EXIT_FAILURE, "Failed to allocate expiry state");
+  for (i = 0; i < nparts; ++i)
+  {
+    struct part * p = &parts[i];
+    p->loop = config.workers ? worker_loop(i) : loop;
+    expiry_init(&p->expiry, evloop_time(p->loop));
+    p->cleanup_timer.cb = cleanup_tables;
+    p->due = (uint32_t *)calloc(tables_max, sizeof(uint32_t));
+    p->checked = (time_t *)calloc(tables_max, sizeof(time_t));
+    if (!p->due || !p->checked)
+      err(EXIT_FAILURE, "Failed to allocate expiry state");
+    if (config.coalesce_ms && coalesce_init(&p->coal, p->loop, tables_max,
+          config.coalesce_ms) < 0)
+      err(EXIT_FAILURE, "Failed to set up coalescing window");
+    if (config.lane_max && lane_init(&p->lane, p->loop, tables_max,
+          config.lane_max, urgent_tables, apply_bulk, p) < 0)
+      err(EXIT_FAILURE, "Failed to set up priority lanes");
+  }
+}
+
+/* order independent digest of table contents to compare replays by */
+void digest_entry(int table, in_addr_t addr, uint8_t mask, void * arg)
+{
+  uint64_t h = ((uint64_t)ntohl(addr) << 8 | mask) * 0x9e3779b97f4a7c15ULL;
+  *(uint64_t *)arg += h ^ h >> 29;
+}
+
+/*
+ * Feeds messages of trace to tables as if they were received at recorded
+ * time. Main loop is never run, instead its clock is advanced to time of
+ * every message firing timers due before it, thus entries expire exactly as
+ * they did when trace was recorded however fast it is replayed. With speed
+ * messages are paced that many times faster than they were recorded.
+ * Throughput, expiry and final state of tables are reported to stdout.
+ */
+int replay_trace(const char * path, double speed)
+{
+  static uint32_t buf[MESSAGE_MAXLEN / sizeof(uint32_t)];
+  struct trace_rec r;
+  FILE * f;
+  int rc, i, j;
+
+  if (!(f = trace_load(path)))
+    err(EXIT_FAILURE, "Failed to open trace '%s'", path);
+  if ((rc = trace_next(f, &r, buf)) <= 0)
+    errx(EXIT_FAILURE, "Trace '%s' holds no messages.", path);
+  fseek(f, sizeof(struct trace_hdr), SEEK_SET);
+
+  if (log_start() < 0)
+    err(EXIT_FAILURE, "Failed to start logging thread");
+  if (!(loop = evloop_new()))
+    err(EXIT_FAILURE, "Failed to create event loop");
+  evloop_advance(loop, r.usec); /* expiry starts at time of trace */
+  setup_parts();
+
+  uint64_t first = r.usec, last = r.usec, msgs = 0, ops = 0, lag = 0;
+  uint64_t start = stats_usec();
+  while (!stopping && (rc = trace_next(f, &r, buf)) > 0)
+  { /* receivers may have recorded messages slightly out of order */
+    if (r.usec > last)
+      last = r.usec;
+    if (speed > 0)
+    {
+      uint64_t due = start + (uint64_t)((last - first) / speed);
+      uint64_t now = stats_usec();
+      if (due > now)
+        usleep(due - now);
+    }
+    evloop_advance(loop, last);
+    if (stats.expiry_lag > lag)
+      lag = stats.expiry_lag;
+
+    struct message_hdr * hdr = (struct message_hdr *)buf;
+    int ack = (r.type == TRACE_STREAM && hdr->version == MESSAGE_V2 &&
+        (hdr->flags & MSGF_ACK));
+    uint8_t status[MESSAGE_V2_MAXRECS];
+    struct tbl_op v1op, * mops;
+    int cnt = proto_decode(buf, r.len, &v1op, &mops);
+    if (cnt >= 0)
+    {
+      apply_ops(mops, cnt, ack ? status : NULL);
+      ops += cnt;
+    }
+    ++msgs;
+  }
+  if (rc < 0)
+    warnx("Trace '%s' is truncated.", path);
+  fclose(f);
+  for (i = 0; i < nparts && config.lane_max; ++i)
+    lane_flush(&parts[i].lane);
+  for (i = 0; i < nparts && config.coalesce_ms; ++i)
+    coalesce_flush(&parts[i].coal);
+  double secs = (stats_usec() - start) / 1e6;
+
+  printf("Replayed %llu messages (%llu ops) spanning %.3f s in %.3f s, "
+      "%.0f ops/s\n", (unsigned long long)msgs, (unsigned long long)ops,
+      (last - first) / 1e6, secs, secs > 0 ? ops / secs : 0);
+  printf("Expired %llu entries, max lag %llu s, %zu pending\n",
+      (unsigned long long)stats.expired, (unsigned long long)lag,
+      expiry_pending());
+  for (i = 0; i < (int)tables_max; ++i)
+  {
+    uint64_t digest = 0;
+    if ((j = backend->size(i)) <= 0)
+      continue;
+    backend->list(i, digest_entry, &digest);
+    printf("Table %i: %i entries, digest %016llx\n", i, j,
+        (unsigned long long)digest);
+  }
+
+  log_stop();
+  closelog();
+  return EXIT_SUCCESS;
+}
+
+int main (int argc, char * argv[])
+{
+  char * ident = basename(argv[0]);
 
   openlog(ident, LOG_PID, LOG_DAEMON);
 
@@ -160,71 +1617,138 @@ int main (int argc, char * argv[])
   signal(SIGTERM, sighand);
   signal(SIGINT, sighand);
   signal(SIGHUP, sighand);
+  signal(SIGPIPE, SIG_IGN); /* peers of sessions may go away any time */
 
   /* processing command-line args */
   int opt;
-  while ((opt = getopt(argc, argv, "b:dv:tue:h")) != -1)
+  char * end;
+  while ((opt = getopt(argc, argv, "b:dv:tue:l:q:p:a:B:r:j:S:w:n:c:x:T:P:R:M:I:h")) != -1)
   {
     switch (opt)
     {
       case 'b':
-        config.bind_addrs = (char **)realloc(config.bind_addrs, ++config.bind_addrs_cnt);
+        config.bind_addrs = (char **)realloc(config.bind_addrs,
+            ++config.bind_addrs_cnt * sizeof(char *));
         config.bind_addrs[config.bind_addrs_cnt - 1] = strdup(optarg);
-        syslog(LOG_DEBUG, "Configured address: %s", optarg);
+        logmsg(LOG_DEBUG, "Configured address: %s", optarg);
         break;
       case 'd':
         config.daemonize = 1;
-        syslog(LOG_DEBUG, "Configured to run in background");
+        logmsg(LOG_DEBUG, "Configured to run in background");
         break;
       case 't':
         if (config.sock_type != -1 && config.sock_type != SOCK_STREAM)
           errx(EXIT_FAILURE, "'-t' and '-u' can't be specified simultaneously.");
 
         config.sock_type = SOCK_STREAM;
-        syslog(LOG_DEBUG, "Configured for streaming sockets");
+        logmsg(LOG_DEBUG, "Configured for streaming sockets");
         break;
       case 'u':
         if (config.sock_type != -1 && config.sock_type != SOCK_DGRAM)
           errx(EXIT_FAILURE, "'-t' and '-u' can't be specified simultaneously.");
 
         config.sock_type = SOCK_DGRAM;
-        syslog(LOG_DEBUG, "Configured for datagram sockets");
+        logmsg(LOG_DEBUG, "Configured for datagram sockets");
         break;
-      case 'e':
-        if (!config.tbl_exp_periods)
-          config.tbl_exp_periods = (time_t *)calloc(tables_max, sizeof(time_t));
-
-        char * expiryspec = strdup(optarg);
-        char * s_tblidx = strsep(&expiryspec, ":");
-        char * s_exp = (expiryspec) ?
-          /*    table index specified */ expiryspec :
-          /* no table index specified */ s_tblidx;
-
-        time_t i_exp = (time_t)strtol(s_exp, NULL, 10);
-        int i_tblidx = -1;
-        if (s_tblidx != s_exp)
-          i_tblidx = (int)strtol(s_tblidx, NULL, 10);
-
-        if (i_tblidx != -1)
-        {
-          if (i_tblidx < 0 || i_tblidx > tables_max)
-          {
-            warnx("Value of table index must lie within [0;%i).", tables_max);
-            continue;
-          }
-
-          config.tbl_exp_periods[i_tblidx] = i_exp;
-          syslog(LOG_DEBUG, "Configured expiry interval for table (%i) is %i seconds",
-              i_tblidx, i_exp);
-        } else
+      case 'e': /* applied once backend reports amount of tables */
+        config.exp_specs = (char **)realloc(config.exp_specs,
+            ++config.exp_specs_cnt * sizeof(char *));
+        config.exp_specs[config.exp_specs_cnt - 1] = strdup(optarg);
+        break;
+      case 'l':
+        if ((config.rate_limit = strtod(optarg, &end)) <= 0)
+          errx(EXIT_FAILURE, "Rate limit must be positive.");
+        config.rate_burst = config.rate_limit;
+        if (*end == ':' && (config.rate_burst = strtod(end + 1, NULL)) < 1)
+          errx(EXIT_FAILURE, "Burst must be at least 1 operation.");
+        break;
+      case 'q':
+        if ((config.lane_max = (int)strtol(optarg, NULL, 10)) <= 0)
+          errx(EXIT_FAILURE, "Queue length must be positive.");
+        break;
+      case 'p': /* checked once backend reports amount of tables */
+        config.prio_tables = (int *)realloc(config.prio_tables,
+            ++config.prio_tables_cnt * sizeof(int));
+        config.prio_tables[config.prio_tables_cnt - 1] =
+          (int)strtol(optarg, NULL, 10);
+        break;
+      case 'a': /* checked once backend reports amount of tables */
+        config.agg_specs = (char **)realloc(config.agg_specs,
+            ++config.agg_specs_cnt * sizeof(char *));
+        config.agg_specs[config.agg_specs_cnt - 1] = optarg;
+        break;
+      case 'R':
+        config.repl_peers = (char **)realloc(config.repl_peers,
+            ++config.repl_peers_cnt * sizeof(char *));
+        config.repl_peers[config.repl_peers_cnt - 1] = optarg;
+        break;
+      case 'M':
+        config.shm_path = optarg;
+        break;
+      case 'I': /* table is checked once backend reports amount of tables */
+      {
+        struct import_spec is = { (int)strtol(optarg, &end, 10), 0, NULL };
+        if (*end == '+')
+          is.ttl = (uint32_t)strtoul(end + 1, &end, 10);
+        if (*end != ':')
+          errx(EXIT_FAILURE, "Invalid import '%s'.", optarg);
+        if (!(is.path = realpath(end + 1, NULL))) /* daemon() does chdir */
+          err(EXIT_FAILURE, "Invalid import file '%s'", end + 1);
+        config.imports = (struct import_spec *)realloc(config.imports,
+            ++config.imports_cnt * sizeof(struct import_spec));
+        config.imports[config.imports_cnt - 1] = is;
+        break;
+      }
+      case 'B':
+        config.backend = optarg;
+        break;
+      case 'r':
+        if ((config.rx_budget = (int)strtol(optarg, NULL, 10)) <= 0)
+          errx(EXIT_FAILURE, "Receive budget must be positive.");
+        break;
+      case 'S':
+        config.stats_path = optarg;
+        break;
+      case 'j': /* absolute as daemon() changes directory */
+        if (!(config.journal_dir = realpath(optarg, NULL)))
+          err(EXIT_FAILURE, "Invalid journal directory '%s'", optarg);
+        break;
+      case 'w':
+        if ((config.workers = (int)strtol(optarg, NULL, 10)) <= 0)
+          errx(EXIT_FAILURE, "Amount of apply threads must be positive.");
+        break;
+      case 'n':
+        if ((config.receivers = (int)strtol(optarg, NULL, 10)) <= 0)
+          errx(EXIT_FAILURE, "Amount of receiver threads must be positive.");
+        break;
+      case 'c':
+        if ((config.coalesce_ms = (int)strtol(optarg, NULL, 10)) < 0)
+          errx(EXIT_FAILURE, "Coalescing window can't be negative.");
+        break;
+      case 'x':
+        if ((config.purge_ops = (int)strtol(optarg, &end, 10)) <= 0)
+          errx(EXIT_FAILURE, "Expiry budget must be positive.");
+        if (*end == ':' && (config.purge_ms = (int)strtol(end + 1, NULL, 10)) < 0)
+          errx(EXIT_FAILURE, "Expiry time budget can't be negative.");
+        break;
+      case 'T': /* opened before daemon() changes directory */
+        config.trace_path = optarg;
+        break;
+      case 'P':
+        config.replay_path = optarg;
+        if ((end = strrchr(optarg, ':')))
         {
-          int i;
-          for (i = 0; i < tables_max; ++i)
-            config.tbl_exp_periods[i] = i_exp;
-          syslog(LOG_INFO, "Configured expiry interval for all tables is %i seconds",
-              i_exp);
+          *end++ = '\0';
+          if ((config.replay_speed = strtod(end, NULL)) < 0)
+            errx(EXIT_FAILURE, "Replay speed can't be negative.");
         }
         break;
+      case 'v':
+        log_level = (int)strtol(optarg, NULL, 10);
+        if (log_level < LOG_EMERG || log_level > LOG_DEBUG)
+          errx(EXIT_FAILURE, "Log level must lie within [%i;%i].",
+              LOG_EMERG, LOG_DEBUG);
+        break;
       case 'h':
         usage(ident);
         return EXIT_SUCCESS;
@@ -237,9 +1761,85 @@ int main (int argc, char * argv[])
   if (config.sock_type < 0)
     config.sock_type = DEFAULT_SOCK_TYPE;
 
+  if (config.receivers && !config.workers)
+    config.workers = 1;
+  if (config.workers)
+  {
+    if (!config.receivers)
+      config.receivers = config.workers;
+    if (config.sock_type != SOCK_DGRAM)
+      errx(EXIT_FAILURE, "Threads serve datagram sockets only.");
+    if (config.journal_dir)
+      errx(EXIT_FAILURE, "'-j' can't be used with threads.");
+    if (config.repl_peers_cnt)
+      errx(EXIT_FAILURE, "'-R' can't be used with threads.");
+    if (config.shm_path)
+      errx(EXIT_FAILURE, "'-M' can't be used with threads.");
+  }
+
+  if (config.agg_specs_cnt && config.journal_dir)
+    errx(EXIT_FAILURE, "'-j' can't be used with '-a'.");
+
+  if (config.replay_path && (config.workers || config.journal_dir ||
+        config.trace_path || config.repl_peers_cnt || config.shm_path ||
+        config.imports_cnt))
+    errx(EXIT_FAILURE, "'-P' can't be used with threads, '-j', '-T', '-R', "
+        "'-M' or '-I'.");
+
+  if (!(backend = backend_find(config.backend)))
+    errx(EXIT_FAILURE, "Unknown table backend '%s'.", config.backend);
+
+  if (backend->init(&tables_max) < 0)
+    err(EXIT_FAILURE, "Failed to initialize '%s' table backend", backend->name);
+  logmsg(LOG_INFO, "Using '%s' table backend with %u tables",
+      backend->name, tables_max);
+
+  int i;
+  if (stats_init(tables_max) < 0)
+    err(EXIT_FAILURE, "Failed to allocate statistics");
+  if (config.agg_specs_cnt)
+    configure_aggregation();
+  if (!(live_index = memtbl_new(tables_max)) ||
+      !(live_lpm = lpm_new(tables_max)))
+    err(EXIT_FAILURE, "Failed to allocate index of tables");
+  for (i = 0; i < (int)tables_max; ++i) /* the only time tables are listed */
+    if (backend->list(i, index_listed, NULL) < 0)
+      logmsg(LOG_WARNING, "Failed to list table %i: %s", i, strerror(errno));
+
+  for (i = 0; i < config.exp_specs_cnt; ++i)
+    configure_expiry(config.exp_specs[i]);
+
+  if (config.prio_tables_cnt && !config.lane_max)
+    config.lane_max = LANE_DEFAULT_MAX;
+  if (!(urgent_tables = (uint8_t *)calloc(tables_max, 1)))
+    err(EXIT_FAILURE, "Failed to allocate priority tables");
+  for (i = 0; i < config.prio_tables_cnt; ++i)
+  {
+    if (config.prio_tables[i] < 0 || config.prio_tables[i] >= tables_max)
+      errx(EXIT_FAILURE, "Priority table %i exceeds maximum allowed value "
+          "(%u).", config.prio_tables[i], tables_max - 1);
+    urgent_tables[config.prio_tables[i]] = 1;
+  }
+  for (i = 0; i < config.imports_cnt; ++i)
+    if (config.imports[i].table < 0 ||
+        config.imports[i].table >= tables_max)
+      errx(EXIT_FAILURE, "Imported table %i exceeds maximum allowed value "
+          "(%u).", config.imports[i].table, tables_max - 1);
+  if (config.rate_limit)
+    admit_init(config.rate_limit, config.rate_burst);
+  if (config.repl_peers_cnt &&
+      repl_init(tables_max, live_index, live_lpm) < 0)
+    err(EXIT_FAILURE, "Failed to allocate replication log");
+  for (i = 0; i < config.repl_peers_cnt; ++i)
+    if (repl_peer(config.repl_peers[i]) < 0)
+      errx(EXIT_FAILURE, "Invalid peer '%s'. See syslog for more info.",
+          config.repl_peers[i]);
+
+  if (config.replay_path)
+    return replay_trace(config.replay_path, config.replay_speed);
+
   /* processing specified bind addresses and creating sockets */
-  int socks[FD_SETSIZE], socks_cnt = 0;
-  memset(socks, -1, sizeof(socks));
+  int * socks = NULL, socks_cnt = 0;
   while (config.bind_addrs_cnt--)
   {
     char * addr = config.bind_addrs[config.bind_addrs_cnt];
@@ -259,9 +1859,10 @@ int main (int argc, char * argv[])
       if (fd < 0)
         continue;
 
-      socks[socks_cnt++] = fd;
+      socks = (int *)realloc(socks, ++socks_cnt * sizeof(int));
+      socks[socks_cnt - 1] = fd;
 
-      syslog(LOG_INFO, "Listening to %s", addr);
+      logmsg(LOG_INFO, "Listening to %s", addr);
 
     } else /* inet socket */
     {
@@ -296,9 +1897,10 @@ int main (int argc, char * argv[])
           if (fd < 0)
             continue;
 
-          socks[socks_cnt++] = fd;
+          socks = (int *)realloc(socks, ++socks_cnt * sizeof(int));
+          socks[socks_cnt - 1] = fd;
 
-          syslog(LOG_INFO, "Listening to %s port %i", addr,
+          logmsg(LOG_INFO, "Listening to %s port %i", addr,
               ntohs(((struct sockaddr_in *)rp->ai_addr)->sin_port));
         }
       }
@@ -320,222 +1922,138 @@ int main (int argc, char * argv[])
       if (fd < 0)
         continue;
 
-      socks[socks_cnt++] = fd;
+      socks = (int *)realloc(socks, ++socks_cnt * sizeof(int));
+      socks[socks_cnt - 1] = fd;
 
-      syslog(LOG_INFO, "Listening to any local address on port %i", DEFAULT_PORT);
+      logmsg(LOG_INFO, "Listening to any local address on port %i", DEFAULT_PORT);
     } while (0);
 
     if (!socks_cnt)
       errx(EXIT_FAILURE, "No address to listen. See syslog for more info.");
   }
 
+  int stats_fd = -1;
+  if (config.stats_path)
+  {
+    struct sockaddr_un sun;
+    bzero(&sun, sizeof(struct sockaddr_un));
+    unlink(config.stats_path);
+    strncpy(sun.sun_path, config.stats_path, sizeof(sun.sun_path) - 1);
+    sun.sun_family = AF_UNIX;
+    if ((stats_fd = getsock(AF_UNIX, SOCK_STREAM, 0,
+            (struct sockaddr *)&sun, SUN_LEN(&sun), config.stats_path)) < 0)
+      errx(EXIT_FAILURE, "Failed to set up statistics socket. See syslog for more info.");
+  }
+
+  if (config.shm_path &&
+      !(shm = shmring_create(config.shm_path, SHMRING_SIZE)))
+    err(EXIT_FAILURE, "Failed to create shared memory ring '%s'",
+        config.shm_path);
+
+  if (config.trace_path && trace_open(config.trace_path) < 0)
+    err(EXIT_FAILURE, "Failed to open trace file '%s'", config.trace_path);
+
   if (config.daemonize && daemon(0, 0) < 0)
     err(EXIT_FAILURE, "Failed to fork into background");
 
-  /* initializing structures for autoexpire */
-  STAILQ_HEAD(qhead, __autoexpq_entry) autoexpq_head =
-    STAILQ_HEAD_INITIALIZER(autoexpq_head);
-  struct __autoexpq_entry
-  {
-    uint8_t table;
-    uint8_t mask;
-    time_t timestamp;
-    uint32_t addr;
-    STAILQ_ENTRY(__autoexpq_entry) qconnector;
-  };
-  typedef struct __autoexpq_entry autoexpq_entry;
-  if (config.tbl_exp_periods) /* if any were configured */
-    STAILQ_INIT(&autoexpq_head);
+  /* neither threads nor kqueue are inherited by fork */
+  if (log_start() < 0)
+    err(EXIT_FAILURE, "Failed to start logging thread");
 
-  /* serving */
-  fd_set monitor, /* currently monitored sockset */
-         rds,     /* readset for select */
-         srvs;    /* listened to (server) sockets */
-  int i, maxfd = -1;
-  FD_ZERO(&srvs);
-  for (i = 0; i < socks_cnt; ++i)
+  if (!(loop = evloop_new()))
+    err(EXIT_FAILURE, "Failed to create event loop");
+
+  if (config.workers)
   {
-    FD_SET(socks[i], &srvs);
-    if (socks[i] > maxfd) /* computing first arg for select */
-      maxfd = socks[i];
+    nparts = config.workers;
+    if (worker_init(config.workers, config.receivers, apply_queued) < 0)
+      err(EXIT_FAILURE, "Failed to set up threads");
   }
 
-  /* 
-   * initializing monitored set of sockets which initially
-   * contains only bound server sockets
-   */
-  memcpy(&monitor, &srvs, sizeof(fd_set));
-
-  /* for select wakeups for tables cleaning */
-  struct timeval tv;
-  struct timeval * cleanup_interval = NULL;
-  time_t cleanup_delay = 0;
-
-  for ( ; ; )
+  /* initializing structures for autoexpire */
+  setup_parts();
+  if (config.repl_peers_cnt)
+    repl_start(loop);
+  if (config.journal_dir)
   {
-    memcpy(&rds, &monitor, sizeof(fd_set));
-
-    syslog(LOG_DEBUG, "MAXFD = %i", maxfd);
-
-    int readysocks = 0;
-    if ((readysocks = select(maxfd + 1, &rds, NULL, NULL, cleanup_interval)) < 0)
-    {
-      syslog(LOG_ERR, "select: %s", strerror(errno));
-      break;
-    }
+    if (journal_open(config.journal_dir, restore_entry, NULL) < 0)
+      errx(EXIT_FAILURE, "Failed to restore expiry state. See syslog for more info.");
+    logmsg(LOG_INFO, "Restored expiry of %zu entries", expiry_pending());
+    schedule_cleanup(&parts[0]);
+    journal_timer.cb = sync_journal;
+    evloop_timer_start(loop, &journal_timer, JOURNAL_SYNC_MS);
+  }
 
-    time_t ct = time(NULL);
-
-    if (!readysocks || cleanup_delay > MAX_CLEANUP_DELAY)
-    { /* time limit expired */
-      syslog(LOG_DEBUG, "Performing tables cleanup");
-      autoexpq_entry * entry = STAILQ_FIRST(&autoexpq_head);
-      while (entry && 
-          entry->timestamp + config.tbl_exp_periods[entry->table] <= ct)
-      { /* while there are entries and entry already expired */
-        STAILQ_REMOVE_HEAD(&autoexpq_head, qconnector);
-        ipfw_tbl_del(entry->table, entry->addr, entry->mask);
-        free(entry);
-        entry = STAILQ_FIRST(&autoexpq_head);
-      }
-      syslog(LOG_DEBUG, "Tables cleanup finished (queue is %s)",
-          STAILQ_EMPTY(&autoexpq_head) ? "empty" : "not empty");
-    }
+  for (i = 0; i < config.imports_cnt; ++i)
+    if (import_file(config.imports[i].path, config.imports[i].table,
+          config.imports[i].ttl, commit_now, NULL) < 0)
+      errx(EXIT_FAILURE, "Failed to import '%s'. See syslog for more info.",
+          config.imports[i].path);
 
-    for (i = 0; i < socks_cnt && readysocks; ++i)
+  /* serving */
+  if (config.workers && worker_start() < 0)
+    err(EXIT_FAILURE, "Failed to start apply threads");
+  int r;
+  for (r = 0; r < (config.workers ? config.receivers : 1); ++r)
+  { /* every receiver thread has its own loop and sockets */
+    struct evloop * rxloop = loop;
+    if (config.workers && !(rxloop = evloop_new()))
+      err(EXIT_FAILURE, "Failed to create event loop");
+    for (i = 0; i < socks_cnt; ++i)
     {
-      int sock = socks[i];
-      int sockidx = i;
-      if (sock < 0)
+      int fd = r ? dupsock(socks[i]) : socks[i];
+      if (fd < 0)
         continue;
-      syslog(LOG_DEBUG, "Processing socket %i", sock);
-
-      if (FD_ISSET(sock, &rds))
-      {
-        --readysocks;
-        if (config.sock_type == SOCK_STREAM)
-        { /* operation on connected socket */
-          if (FD_ISSET(sock, &srvs))
-          { /* readiness for reading of server socket means new connection */
-            syslog(LOG_DEBUG, "Event on server socket");
-            if ((sock = accept(sock, NULL, 0)) < 0)
-            {
-              syslog(LOG_NOTICE, "Failed to accept connection: %s", strerror(errno));
-              continue;
-            }
-
-            /* add new socket */
-            for (sockidx = 0; sockidx < FD_SETSIZE; ++sockidx)
-              if (socks[sockidx] < 0)
-              {
-                socks[sockidx] = sock;
-                break;
-              }
-            if (sockidx == FD_SETSIZE)
-            {
-              syslog(LOG_ERR, "Too many simultaneous connections");
-              continue;
-            }
-            if (sockidx >= socks_cnt)
-              socks_cnt = sockidx + 1;
-            if (sock > maxfd)
-              maxfd = sock;
-
-            FD_SET(sock, &monitor);
-            if (setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT, &messagelen, sizeof(size_t)))
-              syslog(LOG_WARNING, "Failed to set socket low watermark: %s",
-                  strerror(errno));
-          }
-        }
-
-        struct message msg;
-        struct sockaddr saddr;
-        socklen_t saddrlen;
-        int read = recvfrom(sock, &msg, messagelen, MSG_DONTWAIT,
-                            &saddr, &saddrlen);
-        if (read < 0 && errno == EAGAIN)
-          continue; /* still no data after connection - do not wait on recv */
-        if (read == messagelen)
-        {
-          if (msg.table >= tables_max)
-          {
-            syslog(LOG_ERR, "Table id %i exceeds maximum allowed value (%i)",
-                   msg.table, tables_max);
-            continue;
-          }
-          if (msg.mask <= 0)
-            msg.mask = 32;
-          switch (msg.cmd)
-          {
-            case CMD_ADD:
-              ipfw_tbl_add(msg.table, msg.addr, msg.mask);
-              if (config.tbl_exp_periods &&
-                  config.tbl_exp_periods[msg.table] > 0)
-              { /* add entry to queue only if exp int was specified */
-                autoexpq_entry * entry =
-                  (autoexpq_entry *)calloc(1, sizeof(autoexpq_entry));
-
-                entry->table = msg.table;
-                entry->addr = msg.addr;
-                entry->mask = msg.mask;
-                entry->timestamp = time(NULL);
-
-                STAILQ_INSERT_TAIL(&autoexpq_head, entry, qconnector);
-                struct in_addr ia = { entry->addr };
-                syslog(LOG_DEBUG, "Inserted expire entry %s/%i at %i",
-                    inet_ntoa(ia), entry->mask, entry->timestamp);
-              }
-              break;
-            case CMD_DEL:
-              ipfw_tbl_del(msg.table, msg.addr, msg.mask);
-              break;
-            case CMD_FLUSH:
-              ipfw_tbl_flush(msg.table);
-              break;
-            default:
-              syslog(LOG_NOTICE, "Unknown command: %i", msg.cmd);
-              break;
-          }
-        }
-
-        if (config.sock_type == SOCK_STREAM)
-        { /* cleanup after processing connection */
-          close(sock);
-          FD_CLR(sock, &monitor);
-          socks[sockidx] = -1;
-          if (i == socks_cnt - 1)
-            --socks_cnt;
-          if (sock == maxfd)
-            --maxfd;
-          syslog(LOG_DEBUG, "Cleaned up socket %i", sock);
-        }
-      } /* if (FD_ISSET(sock, &rds)) */
-    } /* for (i = 0; i < socks_cnt && readysocks; ++i) */
-
-    if (config.tbl_exp_periods)
-    { /* calculate next cleanup_interval value */
-      autoexpq_entry * ent = STAILQ_FIRST(&autoexpq_head);
-
-      if (ent)
-      {
-        time_t closest_exp = ent->timestamp + config.tbl_exp_periods[ent->table] - ct;
-        tv.tv_sec = closest_exp > MIN_CLEANUP_INTERVAL ?
-          closest_exp : MIN_CLEANUP_INTERVAL;
-        cleanup_interval = &tv;
-        cleanup_delay = (closest_exp < 0) ? - closest_exp : 0;
-        syslog(LOG_DEBUG, "Next table cleanup in %i seconds "
-                          "(current delay %i seconds)",
-            tv.tv_sec, cleanup_delay);
-      } else
-      {
-        cleanup_interval = NULL;
-        syslog(LOG_DEBUG, "Expiration queue is empty!");
-      }
-    } /* if (config.tbl_exp_periods) */
-
-  } /* for ( ; ; ) */
+      struct listener * l = (struct listener *)calloc(1, sizeof(struct listener));
+      l->io.fd = fd;
+      l->io.cb = (config.sock_type == SOCK_STREAM) ? on_accept : on_datagram;
+      l->io.arg = (void *)(intptr_t)r;
+      if (evloop_add(rxloop, &l->io, EV_READ) < 0)
+        err(EXIT_FAILURE, "Failed to watch socket");
+    }
+    if (config.workers && worker_rx_start(r, rxloop) < 0)
+      err(EXIT_FAILURE, "Failed to start receiver thread");
+  }
+  if (config.workers)
+    logmsg(LOG_INFO, "Serving with %i receiver and %i apply threads",
+        config.receivers, config.workers);
+  if (shm)
+  {
+    shm_io.fd = shm->wake;
+    shm_io.cb = on_shm_wake;
+    shm_timer.cb = on_shm_timer;
+    if (evloop_add(loop, &shm_io, EV_READ) < 0)
+      err(EXIT_FAILURE, "Failed to watch shared memory ring");
+    drain_shm(); /* whatever clients put before the daemon was up */
+  }
+  struct ev_io stats_io = { stats_fd, 0, on_stats, NULL };
+  if (stats_fd >= 0 && evloop_add(loop, &stats_io, EV_READ) < 0)
+    err(EXIT_FAILURE, "Failed to watch statistics socket");
+
+  if (!stopping && evloop_run(loop) < 0) /* signalled during startup */
+    logmsg(LOG_ERR, "Event loop failed: %s", strerror(errno));
+  if (config.workers)
+    worker_stop();
+  for (i = 0; i < nparts && config.lane_max; ++i)
+    lane_flush(&parts[i].lane);
+  for (i = 0; i < nparts && config.coalesce_ms; ++i)
+    coalesce_flush(&parts[i].coal);
+
+  if (config.sock_type != SOCK_STREAM)
+    rx_stats_log();
+  size_t used = 0, mem = 0;
+  for (i = 0; i < nparts; ++i)
+  {
+    used += parts[i].expiry.pool.used;
+    mem += expool_mem(&parts[i].expiry.pool);
+  }
+  logmsg(LOG_INFO, "Expiry records: %zu pending, %zu in pool (%zu KB)",
+      expiry_pending(), used, mem / 1024);
+  journal_close();
+  trace_close();
 
-  syslog(LOG_INFO, "Exiting.");
+  logmsg(LOG_INFO, "Exiting.");
+  log_stop();
 
   closelog();
   return EXIT_SUCCESS;
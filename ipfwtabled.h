@@ -31,9 +31,18 @@
 
 #define DEFAULT_PORT 12345
 
+#define MESSAGE_V1 1
+#define MESSAGE_V2 2
+
 #define CMD_ADD   1
 #define CMD_DEL   2
 #define CMD_FLUSH 3
+#define CMD_REFRESH 4 /* reset expiry of entry, table itself is untouched */
+#define CMD_LOOKUP  5 /* longest prefix covering address (stream only) */
+#define CMD_LIST    6 /* every entry of table (stream only) */
+#define CMD_REPLACE 7 /* desired contents of table (stream only) */
+
+/* protocol version 1: exactly one operation per message */
 struct message
 {
   uint8_t version;
@@ -43,4 +52,74 @@ struct message
   uint32_t addr;
 };
 
+/* protocol version 2: header followed by count of struct tbl_op records */
+struct message_hdr
+{
+  uint8_t version;
+  uint8_t flags;     /* MSGF_* */
+  uint16_t count;
+  uint32_t seq;      /* sender-assigned sequence number of frame */
+};
+
+#define MSGF_ACK   0x01 /* reply with status of records (stream only) */
+#define MSGF_REPLY 0x80 /* reply to message with the same seq */
+#define MSGF_DATA  0x40 /* reply carries records rather than status */
+#define MSGF_MORE  0x20 /* more replies to the same seq follow */
+#define MSGF_REPL  0x10 /* replicated by peer daemon, see below */
+
+/*
+ * Reply header is followed by count status bytes (STATUS_*) of records in
+ * request order padded to 4 bytes. If every record succeeded count is 0.
+ */
+#define STATUS_OK      0
+#define STATUS_INVALID 1 /* bad table, mask or command */
+#define STATUS_EXISTS  2
+#define STATUS_NOENT   3 /* also REFRESH of entry which does not expire */
+#define STATUS_FAILED  4
+
+/*
+ * Queries are answered with MSGF_DATA replies holding records of struct
+ * tbl_op layout where cmd is STATUS_* of record, mask and addr are those of
+ * entry found and arg is amount of seconds before it expires, 0 if it does
+ * not. LOOKUP records of message are answered by single reply in order,
+ * entries of table are sent in series of replies to LIST.
+ */
+
+/*
+ * REPLACE records carry the whole desired contents of single table in
+ * series of messages with MORE flag set on all but the last one, table is
+ * then changed to match them by adding missing entries with TTL of their
+ * records and deleting the rest, entries already there are untouched. The
+ * last message is answered by MSGF_DATA reply with single record where cmd
+ * is STATUS_* of the whole series, addr is amount of entries added (in
+ * network byte order as well) and arg is amount of entries deleted. Other
+ * messages of series are acknowledged as usual if ACK is set.
+ */
+
+/*
+ * Replicated messages are sent with ACK flag over stream by daemon to its
+ * peers in order operations were applied, their seq is wall clock time in
+ * milliseconds (modulo 2^32) the oldest operation of message was applied
+ * at, which lets peer tell how far behind it is.
+ */
+
+/*
+ * Single table operation as it is handed over to table backend. Records of
+ * version 2 messages have exactly this layout with table and arg in network
+ * byte order and are converted in place on receive. addr is kept in network
+ * byte order everywhere.
+ */
+struct tbl_op
+{
+  uint16_t table;
+  uint8_t cmd;
+  uint8_t mask;
+  uint32_t addr;
+  uint32_t arg;      /* TTL in seconds for ADD and REFRESH, 0 - default */
+};
+
+#define MESSAGE_V2_MAXRECS 1024
+#define MESSAGE_MAXLEN \
+  (sizeof(struct message_hdr) + MESSAGE_V2_MAXRECS * sizeof(struct tbl_op))
+
 #endif
@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "journal.h"
+#include "log.h"
+
+/*
+ * Expiry state is persisted as snapshot of all pending entries and journal
+ * of changes made since the snapshot was taken. Journal is memory-mapped
+ * so that appending record is a plain store, pages are written back by the
+ * kernel and flushed asynchronously every JOURNAL_SYNC_MS. Compaction
+ * switches to journal of next generation and forks child which writes
+ * snapshot of that generation from its copy of state, journals of older
+ * generations are removed once the snapshot is in place.
+ */
+
+#define JOURNAL_MAGIC  "IPFWTJ1"
+#define SNAPSHOT_MAGIC "IPFWTS1"
+#define JOURNAL_GROW   (16 * 1024 * 1024)
+#define JREC_SEED      0x9e3779b9
+
+struct jhdr
+{
+  char magic[8];
+  uint32_t gen;
+  uint32_t reserved;
+};
+
+static char * jdir = NULL;
+static int jfd = -1;
+static char * jmap = NULL;
+static size_t jmapsize = 0;
+static size_t jpos = 0;
+static uint32_t jgen = 0;       /* generation of current journal */
+static uint32_t joldest = 0;    /* generation of the oldest journal kept */
+static size_t jrecords = 0;     /* records logged since last snapshot */
+static pid_t jchild = -1;       /* compaction in progress */
+static uint32_t jchild_gen = 0;
+
+/* snapshot writer of compaction child */
+static int snapfd = -1;
+static int snaperr = 0;
+static size_t snaplen = 0;
+static char snapbuf[64 * 1024];
+
+static uint32_t jrec_check(const struct jrec * r)
+{
+  return JREC_SEED ^ ((uint32_t)r->type << 24 | (uint32_t)r->mask << 16 |
+      r->table) ^ r->addr ^ (r->expire * 2654435761u);
+}
+
+static void jpath(char * buf, size_t len, const char * name, uint32_t gen)
+{
+  if (name)
+    snprintf(buf, len, "%s/%s", jdir, name);
+  else
+    snprintf(buf, len, "%s/journal.%u", jdir, gen);
+}
+
+/*
+ * Calls cb for every valid record of file with given magic, returns amount
+ * of records or -1 (errno is ENOENT if file does not exist). Reading stops
+ * at the first record failing check, e.g. zeroed tail of journal.
+ */
+static ssize_t jreplay(const char * path, const char * magic,
+    uint32_t * gen, size_t * end, journal_replay_cb cb, void * arg)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct jhdr))
+  {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  char * map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  const struct jhdr * hdr = (const struct jhdr *)map;
+  if (memcmp(hdr->magic, magic, sizeof(hdr->magic)))
+  {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  *gen = hdr->gen;
+
+  size_t pos = sizeof(struct jhdr);
+  ssize_t cnt = 0;
+  for ( ; pos + sizeof(struct jrec) <= st.st_size;
+      pos += sizeof(struct jrec), ++cnt)
+  {
+    const struct jrec * r = (const struct jrec *)(map + pos);
+    if (!r->type || r->check != jrec_check(r))
+      break;
+    cb(r, arg);
+  }
+  if (end)
+    *end = pos;
+  munmap(map, st.st_size);
+  return cnt;
+}
+
+static int jmap_grow(size_t size)
+{
+  if (jmap)
+    munmap(jmap, jmapsize);
+  jmap = NULL;
+  if (ftruncate(jfd, size) < 0)
+    return -1;
+  void * map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, jfd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  jmap = (char *)map;
+  jmapsize = size;
+  return 0;
+}
+
+/* opens journal of given generation for appending from pos */
+static int jswitch(uint32_t gen, size_t pos)
+{
+  char path[PATH_MAX];
+
+  if (jfd >= 0)
+  {
+    msync(jmap, jmapsize, MS_ASYNC);
+    munmap(jmap, jmapsize);
+    close(jfd);
+    jmap = NULL;
+    jfd = -1;
+  }
+
+  /* new generation must not inherit stale tail of leftover file */
+  jpath(path, sizeof(path), NULL, gen);
+  if ((jfd = open(path, O_RDWR | O_CREAT | (pos ? 0 : O_TRUNC), 0600)) < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(jfd, &st) < 0 ||
+      jmap_grow(st.st_size > JOURNAL_GROW ? st.st_size : JOURNAL_GROW) < 0)
+  {
+    close(jfd);
+    jfd = -1;
+    return -1;
+  }
+  if (!pos)
+  {
+    struct jhdr * hdr = (struct jhdr *)jmap;
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic));
+    hdr->gen = gen;
+    pos = sizeof(*hdr);
+  }
+  jgen = gen;
+  jpos = pos;
+  return 0;
+}
+
+/*
+ * Restores state from snapshot and journals found in dir passing their
+ * records to cb and opens journal for appending. Returns 0 or -1 with
+ * errno set.
+ */
+int journal_open(const char * dir, journal_replay_cb cb, void * arg)
+{
+  char path[PATH_MAX];
+  uint32_t gen = 0, g;
+  size_t end = 0;
+  ssize_t cnt;
+
+  if (!(jdir = strdup(dir)))
+    return -1;
+
+  jpath(path, sizeof(path), "snapshot", 0);
+  if ((cnt = jreplay(path, SNAPSHOT_MAGIC, &gen, NULL, cb, arg)) < 0)
+  {
+    if (errno != ENOENT)
+      logmsg(LOG_ERR, "Failed to read snapshot '%s': %s", path, strerror(errno));
+    gen = 0;
+  } else
+    logmsg(LOG_INFO, "Restored %zi entries from snapshot", cnt);
+
+  /* leftovers of compaction interrupted after snapshot was written */
+  for (g = gen; g-- > 0; )
+  {
+    jpath(path, sizeof(path), NULL, g);
+    if (unlink(path) < 0)
+      break;
+  }
+
+  joldest = gen;
+  for (g = gen; ; ++g)
+  {
+    uint32_t hgen;
+    size_t hend;
+    jpath(path, sizeof(path), NULL, g);
+    if ((cnt = jreplay(path, JOURNAL_MAGIC, &hgen, &hend, cb, arg)) < 0)
+    {
+      if (errno != ENOENT)
+        logmsg(LOG_ERR, "Failed to read journal '%s': %s", path, strerror(errno));
+      break;
+    }
+    logmsg(LOG_INFO, "Replayed %zi records of journal %u", cnt, g);
+    jrecords += cnt;
+    gen = g;
+    end = hend;
+  }
+
+  if (jswitch(gen, end) < 0)
+  {
+    logmsg(LOG_ERR, "Failed to open journal: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void journal_close(void)
+{
+  if (jchild > 0)
+  {
+    logmsg(LOG_INFO, "Waiting for snapshot to be written");
+    while (journal_reap() == 0)
+      usleep(10000);
+  }
+  if (jfd < 0)
+    return;
+  msync(jmap, jmapsize, MS_SYNC);
+  munmap(jmap, jmapsize);
+  close(jfd);
+  jmap = NULL;
+  jfd = -1;
+}
+
+void journal_log(int type, int table, in_addr_t addr, uint8_t mask,
+    time_t expire)
+{
+  if (jfd < 0)
+    return;
+
+  if (jpos + sizeof(struct jrec) > jmapsize &&
+      jmap_grow(jmapsize + JOURNAL_GROW) < 0)
+  {
+    logmsg(LOG_ERR, "Failed to grow journal, persistence disabled: %s",
+        strerror(errno));
+    close(jfd);
+    jfd = -1;
+    return;
+  }
+
+  struct jrec * r = (struct jrec *)(jmap + jpos);
+  r->type = type;
+  r->mask = mask;
+  r->table = table;
+  r->addr = addr;
+  r->expire = (uint32_t)expire;
+  r->check = jrec_check(r);
+  jpos += sizeof(struct jrec);
+  ++jrecords;
+}
+
+/* schedules write back of journal pages */
+void journal_sync(void)
+{
+  if (jfd >= 0)
+    msync(jmap, jmapsize, MS_ASYNC);
+}
+
+size_t journal_records(void)
+{
+  return jrecords;
+}
+
+static void snap_flush(void)
+{
+  size_t off = 0;
+  while (!snaperr && off < snaplen)
+  {
+    ssize_t n = write(snapfd, snapbuf + off, snaplen - off);
+    if (n < 0 && errno != EINTR)
+      snaperr = errno;
+    else if (n > 0)
+      off += n;
+  }
+  snaplen = 0;
+}
+
+/* appends entry to snapshot being written, for dump callback only */
+void journal_snap_entry(int table, in_addr_t addr, uint8_t mask,
+    time_t expire)
+{
+  struct jrec * r = (struct jrec *)(snapbuf + snaplen);
+  r->type = JREC_SET;
+  r->mask = mask;
+  r->table = table;
+  r->addr = addr;
+  r->expire = (uint32_t)expire;
+  r->check = jrec_check(r);
+  if ((snaplen += sizeof(*r)) == sizeof(snapbuf))
+    snap_flush();
+}
+
+static int snap_write(uint32_t gen, journal_dump_fn dump, void * arg)
+{
+  char tmp[PATH_MAX], path[PATH_MAX];
+
+  jpath(tmp, sizeof(tmp), "snapshot.tmp", 0);
+  jpath(path, sizeof(path), "snapshot", 0);
+  if ((snapfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    return -1;
+
+  struct jhdr * hdr = (struct jhdr *)snapbuf;
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+  hdr->gen = gen;
+  snaplen = sizeof(*hdr);
+
+  dump(arg);
+  snap_flush();
+  if (snaperr || fsync(snapfd) < 0 || close(snapfd) < 0 ||
+      rename(tmp, path) < 0)
+    return -1;
+
+  int dfd = open(jdir, O_RDONLY);
+  if (dfd >= 0)
+  {
+    fsync(dfd);
+    close(dfd);
+  }
+  return 0;
+}
+
+/*
+ * Starts compaction unless one is in progress: further records go to
+ * journal of next generation and child process writes snapshot of the
+ * current state calling dump which emits it by journal_snap_entry().
+ */
+int journal_compact(journal_dump_fn dump, void * arg)
+{
+  if (jfd < 0 || jchild > 0)
+    return 0;
+
+  uint32_t gen = jgen + 1;
+  if (jswitch(gen, 0) < 0)
+  {
+    logmsg(LOG_ERR, "Failed to switch journal: %s", strerror(errno));
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    logmsg(LOG_ERR, "Failed to fork for compaction: %s", strerror(errno));
+    return -1;
+  }
+  if (!pid)
+  { /* child */
+    log_forked();
+    _exit(snap_write(gen, dump, arg) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  logmsg(LOG_DEBUG, "Compacting journal into snapshot %u (pid %i)",
+      gen, (int)pid);
+  jchild = pid;
+  jchild_gen = gen;
+  jrecords = 0;
+  return 0;
+}
+
+/*
+ * Collects compaction child removing journals covered by new snapshot.
+ * Returns 1 if compaction is finished (or none was running), 0 if it is
+ * still in progress.
+ */
+int journal_reap(void)
+{
+  int status;
+
+  if (jchild <= 0)
+    return 1;
+  pid_t pid = waitpid(jchild, &status, WNOHANG);
+  if (!pid || (pid < 0 && errno == EINTR))
+    return 0;
+  jchild = -1;
+
+  if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+  {
+    logmsg(LOG_ERR, "Failed to write snapshot %u", jchild_gen);
+    return 1;
+  }
+
+  char path[PATH_MAX];
+  for ( ; joldest < jchild_gen; ++joldest)
+  {
+    jpath(path, sizeof(path), NULL, joldest);
+    unlink(path);
+  }
+  logmsg(LOG_INFO, "Snapshot %u written", jchild_gen);
+  return 1;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JREC_SET   1  /* entry expires at given time */
+#define JREC_DEL   2  /* entry no longer expires */
+#define JREC_FLUSH 3  /* no entry of table expires */
+
+/* journal and snapshot record, in host byte order except for addr */
+struct jrec
+{
+  uint8_t type;
+  uint8_t mask;
+  uint16_t table;
+  in_addr_t addr;
+  uint32_t expire;
+  uint32_t check;
+};
+
+#define JOURNAL_COMPACT_MIN 65536 /* records before compaction is considered */
+#define JOURNAL_SYNC_MS     1000
+
+typedef void (*journal_replay_cb)(const struct jrec * r, void * arg);
+typedef void (*journal_dump_fn)(void * arg);
+
+int journal_open(const char * dir, journal_replay_cb cb, void * arg);
+void journal_close(void);
+void journal_log(int type, int table, in_addr_t addr, uint8_t mask,
+    time_t expire);
+void journal_sync(void);
+size_t journal_records(void);
+int journal_compact(journal_dump_fn dump, void * arg);
+void journal_snap_entry(int table, in_addr_t addr, uint8_t mask,
+    time_t expire);
+int journal_reap(void);
+
+#endif
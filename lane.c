@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "evloop.h"
+#include "memtbl.h"
+#include "stats.h"
+#include "lane.h"
+
+#define LANE_OP(l, seq) (&(l)->ops[(seq) % (l)->max])
+
+static void on_slice(struct evloop * loop, struct ev_timer * t)
+{
+  struct lane * l = (struct lane *)t->arg;
+  struct tbl_op batch[LANE_SLICE];
+  int n = 0;
+
+  while (l->cnt && n < LANE_SLICE)
+  {
+    struct tbl_op * op = LANE_OP(l, l->head);
+    ++l->head;
+    --l->cnt;
+    if (!op->cmd) /* cancelled, index entry is gone already */
+      continue;
+    if (op->cmd == CMD_ADD)
+      memtbl_del(l->index, op->table, op->addr, op->mask, NULL);
+    batch[n++] = *op;
+  }
+  if (l->cnt) /* the rest after requests received meanwhile */
+    evloop_timer_start(loop, &l->timer, 0);
+  if (n)
+    l->apply(batch, n, l->arg);
+}
+
+int lane_init(struct lane * l, struct evloop * loop, uint32_t tables,
+    size_t max, const uint8_t * urgent, lane_apply_cb apply, void * arg)
+{
+  memset(l, 0, sizeof(*l));
+  l->loop = loop;
+  l->timer.cb = on_slice;
+  l->timer.arg = l;
+  l->max = max;
+  l->urgent = urgent;
+  l->apply = apply;
+  l->arg = arg;
+  l->index = memtbl_new(tables);
+  l->ops = (struct tbl_op *)malloc(max * sizeof(struct tbl_op));
+  return (l->index && l->ops) ? 0 : -1;
+}
+
+static void lane_cancel(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg)
+{
+  LANE_OP((struct lane *)arg, value)->cmd = 0;
+  STATS_INC(stats.lane_cancelled);
+}
+
+/*
+ * Queues bulk operations compacting urgent ones in place, returns amount of
+ * the latter which are to be applied right away by caller.
+ */
+int lane_split(struct lane * l, struct tbl_op * ops, int cnt)
+{
+  int i, urgent = 0;
+  size_t queued = l->cnt;
+  uintptr_t seq;
+
+  for (i = 0; i < cnt; ++i)
+  {
+    struct tbl_op * op = &ops[i];
+
+    if (op->cmd == CMD_FLUSH)
+    {
+      memtbl_walk(l->index, op->table, lane_cancel, l);
+      memtbl_flush(l->index, op->table);
+    } else if (op->cmd == CMD_DEL)
+    { /* still issued as entry might have been in table before */
+      if (!memtbl_del(l->index, op->table, op->addr, op->mask, &seq))
+        lane_cancel(op->table, op->addr, op->mask, seq, l);
+    }
+    if (op->cmd == CMD_FLUSH || op->cmd == CMD_DEL || l->urgent[op->table])
+    {
+      ops[urgent++] = *op;
+      continue;
+    }
+
+    if (l->cnt == l->max)
+    {
+      STATS_INC(stats.lane_shed);
+      stats_op(op->table, op->cmd, STATUS_FAILED);
+      continue;
+    }
+    seq = l->head + l->cnt;
+    if (op->cmd == CMD_ADD)
+    { /* the same entry added again supersedes queued ADD */
+      if (!memtbl_del(l->index, op->table, op->addr, op->mask, &seq))
+        lane_cancel(op->table, op->addr, op->mask, seq, l);
+      seq = l->head + l->cnt;
+      if (memtbl_add(l->index, op->table, op->addr, op->mask, seq) < 0)
+      { /* can't be cancelled, thus not queued */
+        ops[urgent++] = *op;
+        continue;
+      }
+    }
+    *LANE_OP(l, seq) = *op;
+    ++l->cnt;
+    STATS_INC(stats.lane_queued);
+  }
+  if (!queued && l->cnt)
+    evloop_timer_start(l->loop, &l->timer, 0);
+  return urgent;
+}
+
+/* applies everything queued at once */
+void lane_flush(struct lane * l)
+{
+  evloop_timer_stop(l->loop, &l->timer);
+  while (l->cnt)
+    on_slice(l->loop, &l->timer);
+  evloop_timer_stop(l->loop, &l->timer);
+}
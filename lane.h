@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LANE_H
+#define LANE_H
+
+#define LANE_DEFAULT_MAX 65536 /* bulk operations queued before shedding */
+#define LANE_SLICE MESSAGE_V2_MAXRECS /* bulk operations applied at once */
+
+typedef void (*lane_apply_cb)(struct tbl_op * ops, int cnt, void * arg);
+
+/*
+ * Priority lanes. Urgent operations (DEL, FLUSH and any operation on
+ * priority table) are applied as soon as they are received while the rest
+ * is queued and applied in slices between wakeups of the loop, thus backlog
+ * of bulk ADDs never holds urgent ones back. Queued ADD is cancelled by
+ * urgent DEL or FLUSH of its entry received later so that table ends up the
+ * same as if operations were applied in order. Operations which do not fit
+ * into the queue are shed.
+ */
+struct lane
+{
+  struct evloop * loop;
+  struct ev_timer timer;
+  struct memtbl * index;  /* sequence number of queued ADD by entry */
+  struct tbl_op * ops;    /* ring of queued operations, cmd 0 if cancelled */
+  size_t max;
+  uint64_t head;          /* sequence number of the first queued operation */
+  size_t cnt;
+  const uint8_t * urgent; /* per table, 1 if all operations are urgent */
+  lane_apply_cb apply;
+  void * arg;
+};
+
+int lane_init(struct lane * l, struct evloop * loop, uint32_t tables,
+    size_t max, const uint8_t * urgent, lane_apply_cb apply, void * arg);
+int lane_split(struct lane * l, struct tbl_op * ops, int cnt);
+void lane_flush(struct lane * l);
+
+#endif
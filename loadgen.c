@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Load generator: drives the daemon over UDP, TCP, unix sockets or shared
+ * memory ring from several connections at once with configurable mix of
+ * operations and reports throughput and latency of acknowledged messages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ipfwtabled.h"
+#include "shmring.h"
+
+#define LG_CMDS 4 /* CMD_ADD..CMD_REFRESH */
+
+struct lg_config
+{
+  char * addr;
+  int sock_type;
+  int conns;
+  uint64_t ops;         /* in total */
+  double duration;      /* sec, 0 - until ops are sent */
+  double rate;          /* ops/s in total, 0 - as fast as possible */
+  int mix[LG_CMDS];     /* weights of ADD, DEL, FLUSH and REFRESH */
+  int mix_total;
+  int tables;
+  uint32_t keys;        /* distinct addresses */
+  uint32_t ttl;
+  int batch;            /* operations per message */
+  int window;           /* acknowledged messages in flight per connection */
+  int reconnect;        /* new stream connection for every message */
+  char * stats_path;
+  int shm;              /* addr is path of shared memory ring */
+} cfg = { "127.0.0.1:12345", SOCK_DGRAM, 1, 1000000, 0, 0, { 90, 10, 0, 0 },
+  100, 8, 65536, 0, 64, 1, 0, NULL, 0 };
+
+struct shmring * shm;
+
+struct sockaddr_storage peer;
+socklen_t peerlen;
+
+struct lg_thread
+{
+  pthread_t tid;
+  int id;
+  uint64_t rnd;
+  uint64_t ops;         /* sent */
+  uint64_t msgs;
+  uint64_t failed;      /* operations with non-zero status */
+  uint64_t errors;      /* failed sends and connections */
+  uint32_t * lat;       /* usec per acknowledged message */
+  size_t lat_cnt, lat_cap;
+};
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t lg_rand(struct lg_thread * t)
+{ /* xorshift64*, good enough to spread keys */
+  t->rnd ^= t->rnd >> 12;
+  t->rnd ^= t->rnd << 25;
+  t->rnd ^= t->rnd >> 27;
+  return (uint32_t)((t->rnd * 2685821657736338717ULL) >> 32);
+}
+
+static int lg_resolve(void)
+{
+  if (cfg.addr[0] == '/')
+  {
+    struct sockaddr_un * sun = (struct sockaddr_un *)&peer;
+    sun->sun_family = AF_UNIX;
+    strncpy(sun->sun_path, cfg.addr, sizeof(sun->sun_path) - 1);
+    peerlen = sizeof(*sun);
+    return 0;
+  }
+
+  char * host = strdup(cfg.addr), * port = strchr(host, ':');
+  if (port)
+    *port++ = '\0';
+  struct addrinfo hint, * res;
+  memset(&hint, 0, sizeof(hint));
+  hint.ai_family = AF_UNSPEC;
+  hint.ai_socktype = cfg.sock_type;
+  int rc = getaddrinfo(host, port ? port : "12345", &hint, &res);
+  if (rc)
+  {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+    return -1;
+  }
+  memcpy(&peer, res->ai_addr, res->ai_addrlen);
+  peerlen = res->ai_addrlen;
+  freeaddrinfo(res);
+  free(host);
+  return 0;
+}
+
+static int lg_connect(void)
+{
+  int fd = socket(peer.ss_family, cfg.sock_type, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&peer, peerlen) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int lg_write(int fd, const void * buf, size_t len)
+{
+  const char * p = (const char *)buf;
+  while (len)
+  {
+    ssize_t n = send(fd, p, len, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (cfg.sock_type == SOCK_DGRAM && errno == ENOBUFS)
+        continue; /* socket buffer is full, retry */
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int lg_read(int fd, void * buf, size_t len)
+{
+  char * p = (char *)buf;
+  while (len)
+  {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* fills cnt random version 2 records */
+static void lg_records(struct lg_thread * t, struct tbl_op * ops, int cnt)
+{
+  int i;
+
+  for (i = 0; i < cnt; ++i)
+  {
+    int w = lg_rand(t) % cfg.mix_total, cmd = 0;
+    while (w >= cfg.mix[cmd])
+      w -= cfg.mix[cmd++];
+    ops[i].table = htons(lg_rand(t) % cfg.tables);
+    ops[i].cmd = CMD_ADD + cmd;
+    ops[i].mask = 32;
+    ops[i].addr = htonl(0x0a000000 + lg_rand(t) % cfg.keys);
+    ops[i].arg = htonl(cfg.ttl);
+  }
+}
+
+/* builds version 2 message of cnt random operations */
+static size_t lg_message(struct lg_thread * t, void * buf, uint32_t seq,
+    int cnt)
+{
+  struct message_hdr * hdr = (struct message_hdr *)buf;
+
+  hdr->version = MESSAGE_V2;
+  hdr->flags = cfg.sock_type == SOCK_STREAM ? MSGF_ACK : 0;
+  hdr->count = htons(cnt);
+  hdr->seq = htonl(seq);
+  lg_records(t, (struct tbl_op *)(hdr + 1), cnt);
+  return sizeof(*hdr) + cnt * sizeof(struct tbl_op);
+}
+
+/* puts cnt random records into shared memory ring, waiting while it is full */
+static int lg_put(struct lg_thread * t, int cnt)
+{
+  struct tbl_op ops[MESSAGE_V2_MAXRECS];
+  int put = 0, n;
+
+  lg_records(t, ops, cnt);
+  while ((n = shmring_put(shm, ops + put, cnt - put)) >= 0 &&
+      (put += n) < cnt)
+    sched_yield();
+  return n < 0 ? -1 : 0;
+}
+
+/* reads reply to acknowledged message, returns its seq or -1 */
+static int64_t lg_reply(struct lg_thread * t, int fd)
+{
+  struct message_hdr hdr;
+  uint8_t status[MESSAGE_V2_MAXRECS + 3];
+  int i;
+
+  if (lg_read(fd, &hdr, sizeof(hdr)) < 0)
+    return -1;
+  uint16_t cnt = ntohs(hdr.count);
+  if (cnt > MESSAGE_V2_MAXRECS || lg_read(fd, status, (cnt + 3) & ~3) < 0)
+    return -1;
+  for (i = 0; i < cnt; ++i)
+    if (status[i] != STATUS_OK)
+      ++t->failed;
+  return ntohl(hdr.seq);
+}
+
+static void lg_latency(struct lg_thread * t, double sent)
+{
+  if (t->lat_cnt == t->lat_cap)
+  {
+    t->lat_cap = t->lat_cap ? t->lat_cap * 2 : 65536;
+    t->lat = (uint32_t *)realloc(t->lat, t->lat_cap * sizeof(uint32_t));
+  }
+  t->lat[t->lat_cnt++] = (uint32_t)((now_sec() - sent) * 1e6);
+}
+
+static void * lg_main(void * arg)
+{
+  struct lg_thread * t = (struct lg_thread *)arg;
+  uint64_t quota = cfg.ops / cfg.conns + (t->id < cfg.ops % cfg.conns);
+  double * sent = (double *)calloc(cfg.window, sizeof(double));
+  uint32_t buf[MESSAGE_MAXLEN / sizeof(uint32_t)];
+  uint32_t seq = 0, acked = 0;
+  double start = now_sec();
+  double interval = cfg.rate ? cfg.batch * cfg.conns / cfg.rate : 0;
+  int fd = -1;
+
+  t->rnd = 0x9e3779b97f4a7c15ULL * (t->id + 1);
+  for ( ; ; )
+  {
+    double now = now_sec();
+    int done = t->ops >= quota || (cfg.duration && now - start >= cfg.duration);
+
+    if (cfg.sock_type == SOCK_STREAM && seq != acked &&
+        (done || seq - acked == cfg.window))
+    { /* window is full, wait for the oldest reply */
+      int64_t rs = lg_reply(t, fd);
+      if (rs < 0 || (uint32_t)rs != acked)
+      {
+        ++t->errors;
+        break;
+      }
+      lg_latency(t, sent[acked++ % cfg.window]);
+      if (cfg.reconnect)
+      {
+        close(fd);
+        fd = -1;
+      }
+      continue;
+    }
+    if (done)
+      break;
+
+    if (interval && start + t->msgs * interval > now)
+    { /* ahead of requested rate */
+      double d = start + t->msgs * interval - now;
+      struct timespec ts = { (time_t)d, (long)((d - (time_t)d) * 1e9) };
+      nanosleep(&ts, NULL);
+      continue;
+    }
+
+    int cnt = quota - t->ops < cfg.batch ? quota - t->ops : cfg.batch;
+    if (cfg.shm)
+    {
+      if (lg_put(t, cnt) < 0)
+      {
+        ++t->errors;
+        break;
+      }
+      ++t->msgs;
+      t->ops += cnt;
+      continue;
+    }
+    if (fd < 0 && (fd = lg_connect()) < 0)
+    {
+      ++t->errors;
+      break;
+    }
+    size_t len = lg_message(t, buf, seq, cnt);
+    sent[seq % cfg.window] = now_sec();
+    if (lg_write(fd, buf, len) < 0)
+    {
+      ++t->errors;
+      break;
+    }
+    ++seq;
+    ++t->msgs;
+    t->ops += cnt;
+  }
+  if (fd >= 0)
+    close(fd);
+  free(sent);
+  return NULL;
+}
+
+static int lg_cmp(const void * a, const void * b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* sums statistics of the daemon with names starting with prefix */
+static uint64_t lg_stat(const char * prefix)
+{
+  struct sockaddr_un sun;
+  char buf[65536], * line;
+  size_t len = 0;
+  ssize_t n;
+  uint64_t sum = 0;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, cfg.stats_path, sizeof(sun.sun_path) - 1);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+  {
+    perror("statistics socket");
+    exit(EXIT_FAILURE);
+  }
+  while (len < sizeof(buf) - 1 &&
+      (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+    len += n;
+  close(fd);
+  buf[len] = '\0';
+
+  for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"))
+    if (!strncmp(line, prefix, strlen(prefix)))
+      sum += strtoull(strchr(line, ' ') + 1, NULL, 10);
+  return sum;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+"Usage: loadgen [-b <host>[:<port>]|<path>] [-t|-u|-M] [-c <conns>] [-n <ops>]\n"
+"  [-d <sec>] [-r <ops/sec>] [-m <add>:<del>[:<flush>[:<refresh>]]]\n"
+"  [-T <tables>] [-k <keys>] [-l <ttl>] [-B <batch>] [-w <window>] [-C]\n"
+"  [-S <path>]\n"
+"   -b <addr>        - daemon address or unix socket path (127.0.0.1:12345)\n"
+"   -t               - use stream socket, messages are acknowledged\n"
+"   -u               - use datagram socket (default)\n"
+"   -M               - put operations into shared memory ring at -b path\n"
+"   -c <conns>       - connections, each served by its own thread (1)\n"
+"   -n <ops>         - operations to send in total (1000000)\n"
+"   -d <sec>         - stop after that many seconds\n"
+"   -r <ops/sec>     - limit rate of operations\n"
+"   -m <weights>     - mix of operations by command (90:10:0:0)\n"
+"   -T <tables>      - tables operations are spread over (8)\n"
+"   -k <keys>        - distinct addresses (65536)\n"
+"   -l <ttl>         - TTL of entries, 0 for default of table (0)\n"
+"   -B <batch>       - operations per message (64)\n"
+"   -w <window>      - acknowledged messages in flight per connection (1)\n"
+"   -C               - new stream connection for every message\n"
+"   -S <path>        - statistics socket of daemon to count applied ops\n");
+}
+
+int main(int argc, char * argv[])
+{
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "b:tuMc:n:d:r:m:T:k:l:B:w:CS:h")) != -1)
+    switch (opt)
+    {
+      case 'b': cfg.addr = optarg; break;
+      case 't': cfg.sock_type = SOCK_STREAM; break;
+      case 'u': cfg.sock_type = SOCK_DGRAM; break;
+      case 'M': cfg.shm = 1; break;
+      case 'c': cfg.conns = atoi(optarg); break;
+      case 'n': cfg.ops = strtoull(optarg, NULL, 10); break;
+      case 'd': cfg.duration = atof(optarg); break;
+      case 'r': cfg.rate = atof(optarg); break;
+      case 'm':
+      {
+        char * s = optarg;
+        cfg.mix_total = 0;
+        for (i = 0; i < LG_CMDS; ++i)
+        {
+          cfg.mix[i] = s ? atoi(s) : 0;
+          cfg.mix_total += cfg.mix[i];
+          if (s && (s = strchr(s, ':')))
+            ++s;
+        }
+        break;
+      }
+      case 'T': cfg.tables = atoi(optarg); break;
+      case 'k': cfg.keys = strtoul(optarg, NULL, 10); break;
+      case 'l': cfg.ttl = strtoul(optarg, NULL, 10); break;
+      case 'B': cfg.batch = atoi(optarg); break;
+      case 'w': cfg.window = atoi(optarg); break;
+      case 'C': cfg.reconnect = 1; break;
+      case 'S': cfg.stats_path = optarg; break;
+      default:
+        usage();
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  if (cfg.conns <= 0 || cfg.tables <= 0 || !cfg.keys || cfg.mix_total <= 0 ||
+      cfg.batch <= 0 || cfg.batch > MESSAGE_V2_MAXRECS || cfg.window <= 0)
+  {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (cfg.reconnect)
+    cfg.window = 1;
+  if (cfg.shm && !(shm = shmring_attach(cfg.addr)))
+  {
+    perror("shared memory ring");
+    return EXIT_FAILURE;
+  }
+  if (!cfg.shm && lg_resolve() < 0)
+    return EXIT_FAILURE;
+
+  uint64_t applied0 = cfg.stats_path ? lg_stat("ops_") : 0;
+  uint64_t drops0 = cfg.stats_path ? lg_stat("rx_drops") : 0;
+  struct lg_thread * th = (struct lg_thread *)calloc(cfg.conns,
+      sizeof(struct lg_thread));
+  double start = now_sec();
+  for (i = 0; i < cfg.conns; ++i)
+  {
+    th[i].id = i;
+    if (pthread_create(&th[i].tid, NULL, lg_main, &th[i]))
+    {
+      perror("pthread_create");
+      return EXIT_FAILURE;
+    }
+  }
+
+  uint64_t ops = 0, msgs = 0, failed = 0, errors = 0;
+  size_t lat_cnt = 0;
+  for (i = 0; i < cfg.conns; ++i)
+  {
+    pthread_join(th[i].tid, NULL);
+    ops += th[i].ops;
+    msgs += th[i].msgs;
+    failed += th[i].failed;
+    errors += th[i].errors;
+    lat_cnt += th[i].lat_cnt;
+  }
+  double elapsed = now_sec() - start;
+
+  printf("sent:     %llu ops in %llu messages over %.3f s, %.0f ops/s\n",
+      (unsigned long long)ops, (unsigned long long)msgs, elapsed,
+      ops / elapsed);
+  if (failed || errors)
+    printf("failed:   %llu ops, %llu connection errors\n",
+        (unsigned long long)failed, (unsigned long long)errors);
+
+  if (lat_cnt)
+  {
+    uint32_t * lat = (uint32_t *)malloc(lat_cnt * sizeof(uint32_t));
+    size_t off = 0;
+    for (i = 0; i < cfg.conns; ++i)
+    {
+      memcpy(lat + off, th[i].lat, th[i].lat_cnt * sizeof(uint32_t));
+      off += th[i].lat_cnt;
+    }
+    qsort(lat, lat_cnt, sizeof(uint32_t), lg_cmp);
+    printf("latency:  p50 %u us, p99 %u us, p999 %u us, max %u us "
+        "(%zu messages)\n", lat[lat_cnt / 2], lat[lat_cnt * 99 / 100],
+        lat[lat_cnt * 999 / 1000], lat[lat_cnt - 1], lat_cnt);
+  }
+
+  if (cfg.stats_path)
+  { /* datagrams are not acknowledged, wait for daemon to settle */
+    uint64_t applied = lg_stat("ops_"), prev;
+    double last = now_sec();
+    do
+    {
+      struct timespec ts = { 0, 100000000 };
+      nanosleep(&ts, NULL);
+      prev = applied;
+      if ((applied = lg_stat("ops_")) != prev)
+        last = now_sec();
+    } while (applied != prev && now_sec() - last < 5);
+    applied -= applied0;
+    printf("applied:  %llu ops in %.3f s, %.0f ops/s, %llu datagrams "
+        "dropped\n", (unsigned long long)applied, last - start,
+        applied / (last - start),
+        (unsigned long long)(lg_stat("rx_drops") - drops0));
+  }
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "log.h"
+
+#define LOG_IDLE_NS 10000000 /* flusher sleep when ring is empty */
+
+/*
+ * Bounded multi-producer single-consumer queue: producer claims slot by
+ * advancing head and publishes it through sequence number of slot, flusher
+ * hands slot back by setting its sequence one lap ahead.
+ */
+struct log_slot
+{
+  uint64_t seq;
+  int prio;
+  char msg[LOG_MSGLEN];
+};
+
+int log_level = LOG_INFO;
+
+static struct log_slot log_ring[LOG_RING];
+static uint64_t log_head;
+static uint64_t log_tail __attribute__((aligned(64)));
+static uint64_t log_drops;
+static int log_async;
+static int log_stopping;
+static pthread_t log_thread;
+
+void log_write(int prio, const char * fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+  {
+    vsyslog(prio, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  uint64_t pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  struct log_slot * s;
+  for ( ; ; )
+  {
+    s = &log_ring[pos & (LOG_RING - 1)];
+    int64_t diff = (int64_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+    if (!diff)
+    {
+      if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0)
+    { /* flusher is behind, message is lost rather than waited for */
+      __atomic_fetch_add(&log_drops, 1, __ATOMIC_RELAXED);
+      va_end(ap);
+      return;
+    } else
+      pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  }
+
+  int err = errno;
+  vsnprintf(s->msg, sizeof(s->msg), fmt, ap);
+  errno = err;
+  va_end(ap);
+  s->prio = prio;
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* passes published messages to syslog, returns their amount */
+static int log_flush(void)
+{
+  int cnt = 0;
+
+  for ( ; ; )
+  {
+    struct log_slot * s = &log_ring[log_tail & (LOG_RING - 1)];
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+      return cnt;
+    syslog(s->prio, "%s", s->msg);
+    __atomic_store_n(&s->seq, log_tail + LOG_RING, __ATOMIC_RELEASE);
+    ++log_tail;
+    ++cnt;
+  }
+}
+
+static void * log_main(void * arg)
+{
+  struct timespec idle = { 0, LOG_IDLE_NS };
+
+  while (!__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE))
+    if (!log_flush())
+      nanosleep(&idle, NULL);
+  log_flush();
+  return NULL;
+}
+
+/* starts flusher thread, to be called once daemon has forked */
+int log_start(void)
+{
+  sigset_t all, old;
+  int i;
+
+  for (i = 0; i < LOG_RING; ++i)
+    log_ring[i].seq = i;
+  log_head = log_tail = 0;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int rc = pthread_create(&log_thread, NULL, log_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc)
+  {
+    errno = rc;
+    return -1;
+  }
+  __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* writes out everything pending, logging is synchronous afterwards */
+void log_stop(void)
+{
+  if (!log_async)
+    return;
+  __atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(log_thread, NULL);
+}
+
+/* child of fork() has no flusher thread */
+void log_forked(void)
+{
+  log_async = 0;
+}
+
+uint64_t log_dropped(void)
+{
+  return __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <syslog.h>
+
+/* messages of less important levels are not compiled in at all */
+#ifndef LOG_COMPILED
+#ifdef DEBUG
+#define LOG_COMPILED LOG_DEBUG
+#else
+#define LOG_COMPILED LOG_INFO
+#endif
+#endif
+
+#define LOG_RING   1024 /* messages waiting for flusher, power of 2 */
+#define LOG_MSGLEN 240  /* longer ones are truncated */
+
+extern int log_level;
+
+#define log_enabled(prio) ((prio) <= LOG_COMPILED && (prio) <= log_level)
+
+/*
+ * Replacement of syslog(): arguments are not even evaluated unless level of
+ * message is enabled, once log_start() is called messages are formatted
+ * into lock-free ring and passed to syslog by background thread.
+ */
+#define logmsg(prio, ...) do { \
+    if (log_enabled(prio)) \
+      log_write((prio), __VA_ARGS__); \
+  } while (0)
+
+void log_write(int prio, const char * fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+int log_start(void);
+void log_stop(void);
+void log_forked(void);
+uint64_t log_dropped(void);
+
+#endif
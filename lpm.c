@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "lpm.h"
+
+#define LPM_MIN_SIZE 64
+
+#define LPM_MASK(len) ((len) ? 0xffffffffU << (32 - (len)) : 0)
+#define LPM_HASH(key, len) \
+  ((uint32_t)((((uint64_t)(key) << 6) | (len)) * 0x9e3779b97f4a7c15ULL >> 32))
+
+struct lpm_slot
+{
+  uint32_t key;     /* host byte order, bits past len are zero */
+  uint32_t expire;  /* 0 if entry does not expire */
+  uint32_t rec;     /* expiry record of entry if it expires */
+  uint8_t len;      /* mask length plus one, 0 if slot is free */
+};
+
+struct lpm_table
+{
+  struct lpm_slot * slots;
+  uint32_t size;    /* power of 2, at most half of slots are used */
+  uint32_t count;
+  uint64_t lengths; /* bit per mask length present in table */
+  uint32_t lencnt[33];
+};
+
+struct lpm
+{
+  uint32_t tables;
+  struct lpm_table * t;
+};
+
+struct lpm * lpm_new(uint32_t tables)
+{
+  struct lpm * l = (struct lpm *)calloc(1, sizeof(struct lpm));
+  if (!l)
+    return NULL;
+  l->tables = tables;
+  if (!(l->t = (struct lpm_table *)calloc(tables, sizeof(struct lpm_table))))
+  {
+    free(l);
+    return NULL;
+  }
+  return l;
+}
+
+static struct lpm_table * lpm_table(struct lpm * l, int table, uint8_t mask)
+{
+  if (table < 0 || (uint32_t)table >= l->tables || mask > 32)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  return &l->t[table];
+}
+
+/* slot holding prefix or free slot it would be put into */
+static struct lpm_slot * lpm_slot(struct lpm_table * t, uint32_t key,
+    uint8_t len)
+{
+  uint32_t i = LPM_HASH(key, len) & (t->size - 1);
+  struct lpm_slot * s;
+
+  while ((s = &t->slots[i])->len && (s->len != len + 1 || s->key != key))
+    i = (i + 1) & (t->size - 1);
+  return s;
+}
+
+static struct lpm_slot * lpm_get(struct lpm * l, int table, in_addr_t addr,
+    uint8_t mask)
+{
+  struct lpm_table * t = lpm_table(l, table, mask);
+  struct lpm_slot * s;
+
+  if (!t)
+    return NULL;
+  if (!t->count || !(s = lpm_slot(t, ntohl(addr) & LPM_MASK(mask), mask))->len)
+  {
+    errno = ESRCH;
+    return NULL;
+  }
+  return s;
+}
+
+static int lpm_grow(struct lpm_table * t)
+{
+  uint32_t i, size = t->size ? 2 * t->size : LPM_MIN_SIZE;
+  struct lpm_table n = *t;
+
+  if (!(n.slots = (struct lpm_slot *)calloc(size, sizeof(struct lpm_slot))))
+    return -1;
+  n.size = size;
+  for (i = 0; i < t->size; ++i)
+    if (t->slots[i].len)
+      *lpm_slot(&n, t->slots[i].key, t->slots[i].len - 1) = t->slots[i];
+  free(t->slots);
+  *t = n;
+  return 0;
+}
+
+int lpm_add(struct lpm * l, int table, in_addr_t addr, uint8_t mask)
+{
+  struct lpm_table * t = lpm_table(l, table, mask);
+  uint32_t key = ntohl(addr) & LPM_MASK(mask);
+  struct lpm_slot * s;
+
+  if (!t || (2 * (t->count + 1) > t->size && lpm_grow(t) < 0))
+    return -1;
+  if ((s = lpm_slot(t, key, mask))->len)
+  {
+    errno = EEXIST;
+    return -1;
+  }
+  s->key = key;
+  s->len = mask + 1;
+  s->expire = 0;
+  s->rec = 0;
+  ++t->count;
+  if (!t->lencnt[mask]++)
+    t->lengths |= 1ULL << mask;
+  return 0;
+}
+
+int lpm_del(struct lpm * l, int table, in_addr_t addr, uint8_t mask)
+{
+  struct lpm_slot * s = lpm_get(l, table, addr, mask);
+  if (!s)
+    return -1;
+
+  /* shift following slots back so that probing needs no tombstones */
+  struct lpm_table * t = &l->t[table];
+  uint32_t m = t->size - 1, i = s - t->slots, j = i;
+  for ( ; ; )
+  {
+    j = (j + 1) & m;
+    if (!t->slots[j].len)
+      break;
+    uint32_t h = LPM_HASH(t->slots[j].key, t->slots[j].len - 1) & m;
+    if (((j - h) & m) >= ((j - i) & m))
+    { /* home of entry is not between hole and entry */
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+  t->slots[i].len = 0;
+  --t->count;
+  if (!--t->lencnt[mask])
+    t->lengths &= ~(1ULL << mask);
+  return 0;
+}
+
+/* sets expiry deadline of entry and its record, 0 if it does not expire */
+int lpm_set(struct lpm * l, int table, in_addr_t addr, uint8_t mask,
+    time_t expire, uint32_t rec)
+{
+  struct lpm_slot * s = lpm_get(l, table, addr, mask);
+  if (!s)
+    return -1;
+  s->expire = expire;
+  s->rec = rec;
+  return 0;
+}
+
+/* rec may be NULL, it is meaningless for entries which do not expire */
+int lpm_find(struct lpm * l, int table, in_addr_t addr, uint8_t mask,
+    time_t * expire, uint32_t * rec)
+{
+  struct lpm_slot * s = lpm_get(l, table, addr, mask);
+  if (!s)
+    return -1;
+  *expire = s->expire;
+  if (rec)
+    *rec = s->rec;
+  return 0;
+}
+
+/* longest prefix of table covering addr, its mask is stored into *mask */
+int lpm_lookup(struct lpm * l, int table, in_addr_t addr, uint8_t * mask,
+    time_t * expire)
+{
+  struct lpm_table * t = lpm_table(l, table, 0);
+  if (!t)
+    return -1;
+
+  uint32_t key = ntohl(addr);
+  uint64_t lengths = t->lengths;
+  while (lengths)
+  {
+    int len = 63 - __builtin_clzll(lengths);
+    struct lpm_slot * s = lpm_slot(t, key & LPM_MASK(len), len);
+    if (s->len)
+    {
+      *mask = len;
+      *expire = s->expire;
+      return 0;
+    }
+    lengths &= ~(1ULL << len);
+  }
+  errno = ESRCH;
+  return -1;
+}
+
+void lpm_flush(struct lpm * l, int table)
+{
+  struct lpm_table * t = lpm_table(l, table, 0);
+  if (!t)
+    return;
+  free(t->slots);
+  memset(t, 0, sizeof(*t));
+}
+
+/* calls cb for every entry of table in no particular order */
+void lpm_walk(struct lpm * l, int table, lpm_cb cb, void * arg)
+{
+  struct lpm_table * t = lpm_table(l, table, 0);
+  uint32_t i;
+
+  if (!t || !t->count)
+    return;
+  for (i = 0; i < t->size; ++i)
+  {
+    struct lpm_slot * s = &t->slots[i];
+    if (s->len)
+      cb(table, htonl(s->key), s->len - 1, s->expire, s->rec, arg);
+  }
+}
+
+size_t lpm_count(struct lpm * l, int table)
+{
+  struct lpm_table * t = lpm_table(l, table, 0);
+  return t ? t->count : 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LPM_H
+#define LPM_H
+
+/*
+ * Longest prefix match index of table entries along with their expiry
+ * deadlines and records. Every table is open addressing hash of its
+ * prefixes, lookup probes it once per mask length present in table
+ * starting from the longest one, which is a couple of probes for usual
+ * tables of hosts and few networks however many entries there are. As
+ * with memtbl tables do not share anything thus each of them may be
+ * updated by its own thread.
+ */
+struct lpm;
+
+typedef void (*lpm_cb)(int table, in_addr_t addr, uint8_t mask,
+    time_t expire, uint32_t rec, void * arg);
+
+struct lpm * lpm_new(uint32_t tables);
+int lpm_add(struct lpm * l, int table, in_addr_t addr, uint8_t mask);
+int lpm_del(struct lpm * l, int table, in_addr_t addr, uint8_t mask);
+int lpm_set(struct lpm * l, int table, in_addr_t addr, uint8_t mask,
+    time_t expire, uint32_t rec);
+int lpm_find(struct lpm * l, int table, in_addr_t addr, uint8_t mask,
+    time_t * expire, uint32_t * rec);
+int lpm_lookup(struct lpm * l, int table, in_addr_t addr, uint8_t * mask,
+    time_t * expire);
+void lpm_flush(struct lpm * l, int table);
+void lpm_walk(struct lpm * l, int table, lpm_cb cb, void * arg);
+size_t lpm_count(struct lpm * l, int table);
+
+#endif
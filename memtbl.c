@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ipfwtabled.h"
+#include "backend.h"
+#include "memtbl.h"
+#include "log.h"
+
+struct mt_node
+{
+  struct mt_node * child[2];
+  uintptr_t value;
+  uint32_t key;   /* host byte order, bits past len are zero */
+  uint8_t len;
+  uint8_t used;   /* holds an entry, otherwise it is pure branching node */
+};
+
+struct memtbl
+{
+  uint32_t tables;
+  struct mt_node ** roots;
+  size_t * counts;
+};
+
+#define MT_MASK(len) ((len) ? 0xffffffffU << (32 - (len)) : 0)
+#define MT_BIT(key, i) (((key) >> (31 - (i))) & 1)
+
+static int mt_common(uint32_t a, uint32_t b, int limit)
+{
+  uint32_t x = a ^ b;
+  int cpl = x ? __builtin_clz(x) : 32;
+  return cpl < limit ? cpl : limit;
+}
+
+static int mt_check(struct memtbl * mt, int table, uint8_t mask)
+{
+  if (table < 0 || (uint32_t)table >= mt->tables || mask > 32)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+struct memtbl * memtbl_new(uint32_t tables)
+{
+  struct memtbl * mt = (struct memtbl *)calloc(1, sizeof(struct memtbl));
+  if (!mt)
+    return NULL;
+  mt->tables = tables;
+  mt->roots = (struct mt_node **)calloc(tables, sizeof(struct mt_node *));
+  mt->counts = (size_t *)calloc(tables, sizeof(size_t));
+  if (!mt->roots || !mt->counts)
+  {
+    memtbl_free(mt);
+    return NULL;
+  }
+  return mt;
+}
+
+static void mt_free_tree(struct mt_node * n)
+{
+  if (!n)
+    return;
+  mt_free_tree(n->child[0]);
+  mt_free_tree(n->child[1]);
+  free(n);
+}
+
+void memtbl_free(struct memtbl * mt)
+{
+  uint32_t i;
+  if (!mt)
+    return;
+  if (mt->roots)
+    for (i = 0; i < mt->tables; ++i)
+      mt_free_tree(mt->roots[i]);
+  free(mt->roots);
+  free(mt->counts);
+  free(mt);
+}
+
+static struct mt_node * mt_node_new(uint32_t key, uint8_t len, int used,
+    uintptr_t value)
+{
+  struct mt_node * n = (struct mt_node *)calloc(1, sizeof(struct mt_node));
+  if (!n)
+    return NULL;
+  n->key = key;
+  n->len = len;
+  n->used = used;
+  n->value = value;
+  return n;
+}
+
+int memtbl_add(struct memtbl * mt, int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value)
+{
+  if (mt_check(mt, table, mask))
+    return -1;
+
+  uint32_t key = ntohl(addr) & MT_MASK(mask);
+  struct mt_node ** link = &mt->roots[table];
+  struct mt_node * n, * leaf;
+
+  while ((n = *link))
+  {
+    int cpl = mt_common(key, n->key, mask < n->len ? mask : n->len);
+    if (cpl < n->len)
+    { /* node does not cover the key - split path here */
+      if (!(leaf = mt_node_new(key, mask, 1, value)))
+        return -1;
+      if (cpl == mask)
+      { /* new entry is a prefix of node */
+        leaf->child[MT_BIT(n->key, mask)] = n;
+        *link = leaf;
+      } else
+      {
+        struct mt_node * br = mt_node_new(key & MT_MASK(cpl), cpl, 0, 0);
+        if (!br)
+        {
+          free(leaf);
+          return -1;
+        }
+        br->child[MT_BIT(key, cpl)] = leaf;
+        br->child[MT_BIT(n->key, cpl)] = n;
+        *link = br;
+      }
+      ++mt->counts[table];
+      return 0;
+    }
+    if (n->len == mask)
+    {
+      if (n->used)
+      {
+        errno = EEXIST;
+        return -1;
+      }
+      n->used = 1;
+      n->value = value;
+      ++mt->counts[table];
+      return 0;
+    }
+    link = &n->child[MT_BIT(key, n->len)];
+  }
+
+  if (!(*link = mt_node_new(key, mask, 1, value)))
+    return -1;
+  ++mt->counts[table];
+  return 0;
+}
+
+int memtbl_del(struct memtbl * mt, int table, in_addr_t addr, uint8_t mask,
+    uintptr_t * value)
+{
+  if (mt_check(mt, table, mask))
+    return -1;
+
+  uint32_t key = ntohl(addr) & MT_MASK(mask);
+  struct mt_node ** link = &mt->roots[table], ** plink = NULL;
+  struct mt_node * n;
+
+  while ((n = *link) && n->len <= mask &&
+      mt_common(key, n->key, n->len) == n->len)
+  {
+    if (n->len == mask)
+      break;
+    plink = link;
+    link = &n->child[MT_BIT(key, n->len)];
+  }
+  if (!n || n->len != mask || n->key != key || !n->used)
+  {
+    errno = ESRCH;
+    return -1;
+  }
+
+  if (value)
+    *value = n->value;
+  --mt->counts[table];
+
+  if (n->child[0] && n->child[1])
+  { /* still needed for branching */
+    n->used = 0;
+    n->value = 0;
+    return 0;
+  }
+
+  *link = n->child[0] ? n->child[0] : n->child[1];
+  free(n);
+
+  /* collapse parent branching node which is left with single child */
+  struct mt_node * p = plink ? *plink : NULL;
+  if (p && !p->used && !(p->child[0] && p->child[1]))
+  {
+    *plink = p->child[0] ? p->child[0] : p->child[1];
+    free(p);
+  }
+  return 0;
+}
+
+int memtbl_find(struct memtbl * mt, int table, in_addr_t addr, uint8_t mask,
+    uintptr_t * value)
+{
+  if (mt_check(mt, table, mask))
+    return -1;
+
+  uint32_t key = ntohl(addr) & MT_MASK(mask);
+  struct mt_node * n = mt->roots[table];
+
+  while (n && n->len <= mask && mt_common(key, n->key, n->len) == n->len)
+  {
+    if (n->len == mask)
+    {
+      if (!n->used)
+        break;
+      if (value)
+        *value = n->value;
+      return 0;
+    }
+    n = n->child[MT_BIT(key, n->len)];
+  }
+  errno = ESRCH;
+  return -1;
+}
+
+int memtbl_flush(struct memtbl * mt, int table)
+{
+  if (mt_check(mt, table, 0))
+    return -1;
+  mt_free_tree(mt->roots[table]);
+  mt->roots[table] = NULL;
+  mt->counts[table] = 0;
+  return 0;
+}
+
+static void mt_walk(struct mt_node * n, int table, memtbl_walk_cb cb, void * arg)
+{
+  if (!n)
+    return;
+  if (n->used)
+    cb(table, htonl(n->key), n->len, n->value, arg);
+  mt_walk(n->child[0], table, cb, arg);
+  mt_walk(n->child[1], table, cb, arg);
+}
+
+int memtbl_walk(struct memtbl * mt, int table, memtbl_walk_cb cb, void * arg)
+{
+  if (mt_check(mt, table, 0))
+    return -1;
+  mt_walk(mt->roots[table], table, cb, arg);
+  return 0;
+}
+
+static size_t mt_scan(struct mt_node * n, int table, uint64_t * pos,
+    memtbl_walk_cb cb, void * arg, size_t max)
+{
+  size_t cnt = 0;
+
+  /* skip subtree which lies entirely before position */
+  if (!n || MEMTBL_POS(n->key | ~MT_MASK(n->len), 32) < *pos)
+    return 0;
+  if (n->used && MEMTBL_POS(n->key, n->len) >= *pos)
+  {
+    cb(table, htonl(n->key), n->len, n->value, arg);
+    *pos = MEMTBL_POS(n->key, n->len) + 1;
+    if (++cnt == max)
+      return cnt;
+  }
+  cnt += mt_scan(n->child[0], table, pos, cb, arg, max - cnt);
+  if (cnt < max)
+    cnt += mt_scan(n->child[1], table, pos, cb, arg, max - cnt);
+  return cnt;
+}
+
+/*
+ * Resumable walk: visits up to max entries of table in order of MEMTBL_POS()
+ * starting at position *pos (0 for the first entry) and advances it past
+ * the last visited one. Entries covered by prefix follow it this way.
+ * Entries added or deleted meanwhile do not disturb walk which is resumed,
+ * returns amount of entries visited (less than max at the end).
+ */
+size_t memtbl_scan(struct memtbl * mt, int table, uint64_t * pos,
+    memtbl_walk_cb cb, void * arg, size_t max)
+{
+  if (mt_check(mt, table, 0) || !max)
+    return 0;
+  return mt_scan(mt->roots[table], table, pos, cb, arg, max);
+}
+
+size_t memtbl_count(struct memtbl * mt, int table)
+{
+  if (mt_check(mt, table, 0))
+    return 0;
+  return mt->counts[table];
+}
+
+/* in-memory backend, does not need neither root nor IPFW */
+
+static struct memtbl * mem_tables = NULL;
+
+static int mem_init(uint32_t * tables_max)
+{
+  *tables_max = MEMTBL_TABLES_MAX;
+  if (!(mem_tables = memtbl_new(*tables_max)))
+    return -1;
+  return 0;
+}
+
+static int mem_add(int table, in_addr_t addr, uint8_t mask)
+{
+  if (memtbl_add(mem_tables, table, addr, mask, 0) < 0)
+  {
+    if (errno == EEXIST) /* same as IPFW backend which re-adds entry */
+      return 0;
+    logmsg(LOG_ERR, "Add to table failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int mem_del(int table, in_addr_t addr, uint8_t mask)
+{
+  if (memtbl_del(mem_tables, table, addr, mask, NULL) < 0)
+  {
+    logmsg(LOG_ERR, "Delete from table failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int mem_flush(int table)
+{
+  if (memtbl_flush(mem_tables, table) < 0)
+  {
+    logmsg(LOG_ERR, "Flush table failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int mem_batch(const struct tbl_op * ops, int cnt, int * errs)
+{
+  return backend_batch(&mem_backend, ops, cnt, errs);
+}
+
+struct mem_list_arg
+{
+  backend_list_cb cb;
+  void * arg;
+};
+
+static void mem_list_entry(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg)
+{
+  struct mem_list_arg * la = (struct mem_list_arg *)arg;
+  la->cb(table, addr, mask, la->arg);
+}
+
+static int mem_list(int table, backend_list_cb cb, void * arg)
+{
+  struct mem_list_arg la = { cb, arg };
+  return memtbl_walk(mem_tables, table, mem_list_entry, &la);
+}
+
+static int mem_size(int table)
+{
+  return (int)memtbl_count(mem_tables, table);
+}
+
+const struct backend mem_backend =
+{
+  "mem",
+  mem_init,
+  mem_add,
+  mem_del,
+  mem_flush,
+  mem_batch,
+  mem_list,
+  mem_size
+};
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MEMTBL_H
+#define MEMTBL_H
+
+#define MEMTBL_TABLES_MAX 128 /* same as default net.inet.ip.fw.tables_max */
+
+/*
+ * Set of in-memory tables, each kept as path-compressed binary prefix tree.
+ * Addresses are passed in network byte order as everywhere else, every
+ * entry carries opaque value similar to value of IPFW table entry.
+ */
+struct memtbl;
+
+/* position of entry in walk order, key is in host byte order */
+#define MEMTBL_POS(key, len) ((uint64_t)(key) << 8 | (len))
+
+typedef void (*memtbl_walk_cb)(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg);
+
+struct memtbl * memtbl_new(uint32_t tables);
+void memtbl_free(struct memtbl * mt);
+
+int memtbl_add(struct memtbl * mt, int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value);
+int memtbl_del(struct memtbl * mt, int table, in_addr_t addr, uint8_t mask,
+    uintptr_t * value);
+int memtbl_find(struct memtbl * mt, int table, in_addr_t addr, uint8_t mask,
+    uintptr_t * value);
+int memtbl_flush(struct memtbl * mt, int table);
+int memtbl_walk(struct memtbl * mt, int table, memtbl_walk_cb cb, void * arg);
+size_t memtbl_scan(struct memtbl * mt, int table, uint64_t * pos,
+    memtbl_walk_cb cb, void * arg, size_t max);
+size_t memtbl_count(struct memtbl * mt, int table);
+
+extern const struct backend mem_backend;
+
+#endif
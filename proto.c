@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ipfwtabled.h"
+#include "proto.h"
+
+/*
+ * Returns length of the request frame which starts at buf, 0 if there is
+ * not enough data yet to tell it, -1 with errno set if frame is malformed.
+ */
+ssize_t proto_framelen(const void * buf, size_t len)
+{
+  const struct message_hdr * hdr = (const struct message_hdr *)buf;
+
+  if (len < 1)
+    return 0;
+  switch (hdr->version)
+  {
+    case MESSAGE_V1:
+      return sizeof(struct message);
+    case MESSAGE_V2:
+      if (len < sizeof(struct message_hdr))
+        return 0;
+      if (ntohs(hdr->count) > MESSAGE_V2_MAXRECS)
+      {
+        errno = EMSGSIZE;
+        return -1;
+      }
+      return sizeof(struct message_hdr) +
+        ntohs(hdr->count) * sizeof(struct tbl_op);
+    default:
+      errno = EPROTONOSUPPORT;
+      return -1;
+  }
+}
+
+/*
+ * Same as proto_framelen() for status reply (see proto_reply()), the only
+ * frames peer daemon sends back to replicating one.
+ */
+ssize_t proto_replylen(const void * buf, size_t len)
+{
+  const struct message_hdr * hdr = (const struct message_hdr *)buf;
+
+  if (len < sizeof(struct message_hdr))
+    return 0;
+  if (hdr->version != MESSAGE_V2 ||
+      (hdr->flags & (MSGF_REPLY | MSGF_DATA)) != MSGF_REPLY)
+  {
+    errno = EBADMSG;
+    return -1;
+  }
+  if (ntohs(hdr->count) > MESSAGE_V2_MAXRECS)
+  {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return (sizeof(struct message_hdr) + ntohs(hdr->count) + 3) & ~3;
+}
+
+/*
+ * Decodes complete frame of len bytes. Version 1 message is converted into
+ * v1op while version 2 records are converted in place within buf. On
+ * success *ops points to the first record and their amount is returned.
+ */
+int proto_decode(void * buf, size_t len, struct tbl_op * v1op,
+    struct tbl_op ** ops)
+{
+  ssize_t framelen = proto_framelen(buf, len);
+  if (framelen < 0)
+    return -1;
+  if (!framelen || framelen != len)
+  {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  if (((struct message_hdr *)buf)->version == MESSAGE_V1)
+  {
+    struct message * msg = (struct message *)buf;
+    v1op->table = msg->table;
+    v1op->cmd = msg->cmd;
+    v1op->mask = msg->mask;
+    v1op->addr = msg->addr;
+    v1op->arg = 0;
+    *ops = v1op;
+    return 1;
+  }
+
+  struct message_hdr * hdr = (struct message_hdr *)buf;
+  struct tbl_op * op = (struct tbl_op *)(hdr + 1);
+  int i, cnt = ntohs(hdr->count);
+  if (hdr->flags & MSGF_REPLY)
+  { /* replies are never taken as requests */
+    errno = EBADMSG;
+    return -1;
+  }
+  for (i = 0; i < cnt; ++i)
+  {
+    op[i].table = ntohs(op[i].table);
+    op[i].arg = ntohl(op[i].arg);
+  }
+  *ops = op;
+  return cnt;
+}
+
+uint8_t proto_status(int err)
+{
+  switch (err)
+  {
+    case 0:
+      return STATUS_OK;
+    case EINVAL:
+      return STATUS_INVALID;
+    case EEXIST:
+      return STATUS_EXISTS;
+    case ESRCH:
+    case ENOENT:
+      return STATUS_NOENT;
+    default:
+      return STATUS_FAILED;
+  }
+}
+
+/*
+ * Builds reply to version 2 message into buf which must have room for
+ * MESSAGE_MAXLEN bytes, returns length of the reply.
+ */
+size_t proto_reply(void * buf, uint32_t seq, const uint8_t * status, int cnt)
+{
+  struct message_hdr * hdr = (struct message_hdr *)buf;
+  int i;
+
+  for (i = 0; i < cnt && status[i] == STATUS_OK; ++i)
+    ;
+  if (i == cnt) /* compact reply when everything succeeded */
+    cnt = 0;
+
+  hdr->version = MESSAGE_V2;
+  hdr->flags = MSGF_REPLY;
+  hdr->count = htons(cnt);
+  hdr->seq = htonl(seq);
+  memcpy(hdr + 1, status, cnt);
+
+  size_t len = sizeof(*hdr) + cnt;
+  while (len % 4)
+    ((uint8_t *)buf)[len++] = 0;
+  return len;
+}
+
+/*
+ * Builds version 2 message of records in host byte order into buf which
+ * must have room for MESSAGE_MAXLEN bytes, returns length of the message.
+ */
+size_t proto_message(void * buf, uint8_t flags, uint32_t seq,
+    const struct tbl_op * recs, int cnt)
+{
+  struct message_hdr * hdr = (struct message_hdr *)buf;
+  struct tbl_op * rec = (struct tbl_op *)(hdr + 1);
+  int i;
+
+  hdr->version = MESSAGE_V2;
+  hdr->flags = flags;
+  hdr->count = htons(cnt);
+  hdr->seq = htonl(seq);
+  for (i = 0; i < cnt; ++i)
+  {
+    rec[i] = recs[i];
+    rec[i].table = htons(recs[i].table);
+    rec[i].arg = htonl(recs[i].arg);
+  }
+  return sizeof(*hdr) + cnt * sizeof(*rec);
+}
+
+/*
+ * Builds reply carrying records of query into buf which must have room for
+ * MESSAGE_MAXLEN bytes, returns length of the reply. If more is set further
+ * replies to the same seq follow.
+ */
+size_t proto_records(void * buf, uint32_t seq, int more,
+    const struct tbl_op * recs, int cnt)
+{
+  return proto_message(buf, MSGF_REPLY | MSGF_DATA | (more ? MSGF_MORE : 0),
+      seq, recs, cnt);
+}
@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ipfwtabled.h"
+#include "proto.h"
+#include "evloop.h"
+#include "memtbl.h"
+#include "lpm.h"
+#include "stats.h"
+#include "log.h"
+#include "repl.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define REPL_WBUF  (2 * MESSAGE_MAXLEN)
+#define REPL_RBUF  (2 * (sizeof(struct message_hdr) + MESSAGE_V2_MAXRECS))
+#define REPL_SNAP  UINT64_MAX /* message of snapshot, log position unknown */
+
+struct repl_peer
+{
+  struct ev_io io;
+  struct ev_timer retry;
+  char * name;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int connecting;
+  int up;
+  int synced;       /* peer has everything logged before acked */
+  uint64_t acked;
+  uint64_t sent;    /* log position of the next operation to send */
+  uint64_t marks[REPL_WINDOW]; /* positions acknowledged by messages in flight */
+  uint32_t seqs[REPL_WINDOW];
+  unsigned mfirst, mcnt;
+  int snap;         /* sending snapshot, log follows from sent */
+  int snap_flushed; /* FLUSH of snap_table is sent */
+  uint32_t snap_table;
+  uint64_t snap_pos; /* see memtbl_scan() */
+  uint64_t resyncs;
+  uint64_t reconnects;
+  size_t wlen;
+  size_t rlen;
+  char wbuf[REPL_WBUF];
+  uint32_t rbuf[REPL_RBUF / sizeof(uint32_t)];
+};
+
+static struct evloop * repl_loop;
+static struct memtbl * repl_index;
+static struct lpm * repl_lpm;
+static uint32_t repl_tables;
+static uint8_t * touched;   /* per table, 1 if any operation was logged */
+
+static struct tbl_op * log_ops; /* ring of REPL_LOG_OPS operations */
+static uint64_t * log_stamps;   /* wall clock msec they were applied at */
+static uint64_t log_head;       /* operations logged so far */
+
+static struct repl_peer ** peers;
+static int npeers;
+static struct ev_timer kick;
+
+static void repl_io(struct evloop * loop, struct ev_io * io, int events);
+static void repl_retry(struct evloop * loop, struct ev_timer * t);
+
+static uint64_t wall_msec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t log_tail(void)
+{
+  return log_head > REPL_LOG_OPS ? log_head - REPL_LOG_OPS : 0;
+}
+
+/* sends messages to peers once whatever is being applied now is logged */
+static void repl_kick(struct evloop * loop, struct ev_timer * t)
+{
+  int i;
+
+  for (i = 0; i < npeers; ++i)
+    if (peers[i]->up)
+      repl_io(loop, &peers[i]->io, EV_WRITE);
+}
+
+int repl_init(uint32_t tables, struct memtbl * index, struct lpm * lpm)
+{
+  repl_tables = tables;
+  repl_index = index;
+  repl_lpm = lpm;
+  kick.cb = repl_kick;
+  touched = (uint8_t *)calloc(tables, 1);
+  log_ops = (struct tbl_op *)malloc(REPL_LOG_OPS * sizeof(struct tbl_op));
+  log_stamps = (uint64_t *)malloc(REPL_LOG_OPS * sizeof(uint64_t));
+  return (touched && log_ops && log_stamps) ? 0 : -1;
+}
+
+/* adds peer given as <host>[:<port>], returns -1 if it can't be resolved */
+int repl_peer(const char * spec)
+{
+  char host[256], defport[8], * port;
+  struct addrinfo hint, * result;
+  struct repl_peer * p, ** grown;
+  int rc;
+
+  snprintf(host, sizeof(host), "%s", spec);
+  if ((port = strrchr(host, ':')))
+    *port++ = '\0';
+  else
+    snprintf(port = defport, sizeof(defport), "%i", DEFAULT_PORT);
+  memset(&hint, 0, sizeof(hint));
+  hint.ai_family = AF_UNSPEC;
+  hint.ai_socktype = SOCK_STREAM;
+  if ((rc = getaddrinfo(host, port, &hint, &result)))
+  {
+    logmsg(LOG_ERR, "Failed to resolve peer '%s': %s", spec,
+        gai_strerror(rc));
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!(p = (struct repl_peer *)calloc(1, sizeof(*p))) ||
+      !(grown = (struct repl_peer **)realloc(peers,
+          (npeers + 1) * sizeof(*peers))))
+  {
+    free(p);
+    freeaddrinfo(result);
+    return -1;
+  }
+  peers = grown;
+  peers[npeers++] = p;
+  memcpy(&p->addr, result->ai_addr, result->ai_addrlen);
+  p->addrlen = result->ai_addrlen;
+  freeaddrinfo(result);
+  p->name = strdup(spec);
+  p->io.fd = -1;
+  p->io.cb = repl_io;
+  p->retry.cb = repl_retry;
+  return 0;
+}
+
+/* appends operation applied to tables to the log */
+void repl_op(const struct tbl_op * op)
+{
+  size_t slot = log_head % REPL_LOG_OPS;
+
+  if (!npeers)
+    return;
+  log_ops[slot] = *op;
+  log_stamps[slot] = wall_msec();
+  touched[op->table] = 1;
+  ++log_head;
+  if (!kick.armed)
+    evloop_timer_start(repl_loop, &kick, 0);
+}
+
+/* accounts replicated message received from peer */
+void repl_received(uint32_t seq, int cnt)
+{
+  uint32_t lag = (uint32_t)wall_msec() - seq;
+
+  STATS_INC(stats.repl_in_msgs);
+  STATS_ADD(stats.repl_in_ops, cnt);
+  STATS_SET(stats.repl_lag_ms, lag < 0x80000000U ? lag : 0); /* clock skew */
+}
+
+static void repl_drop(struct repl_peer * p, const char * why)
+{
+  if (p->up)
+    logmsg(LOG_NOTICE, "Lost peer %s: %s", p->name, why);
+  else
+    logmsg(LOG_DEBUG, "Failed to connect to peer %s: %s", p->name, why);
+  evloop_del(repl_loop, &p->io);
+  close(p->io.fd);
+  p->io.fd = -1;
+  p->up = p->connecting = 0;
+  evloop_timer_start(repl_loop, &p->retry, REPL_RETRY_MS);
+}
+
+static void repl_connect(struct repl_peer * p)
+{
+  int fd = socket(p->addr.ss_family, SOCK_STREAM, 0);
+
+  if (fd < 0)
+  {
+    logmsg(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+    evloop_timer_start(repl_loop, &p->retry, REPL_RETRY_MS);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  p->io.fd = fd;
+  p->connecting = 1;
+  if (connect(fd, (struct sockaddr *)&p->addr, p->addrlen) < 0 &&
+      errno != EINPROGRESS)
+  {
+    p->connecting = 0; /* nothing is watched yet */
+    close(fd);
+    p->io.fd = -1;
+    logmsg(LOG_DEBUG, "Failed to connect to peer %s: %s", p->name,
+        strerror(errno));
+    evloop_timer_start(repl_loop, &p->retry, REPL_RETRY_MS);
+    return;
+  }
+  if (evloop_add(repl_loop, &p->io, EV_WRITE) < 0)
+    repl_drop(p, strerror(errno));
+}
+
+static void repl_retry(struct evloop * loop, struct ev_timer * t)
+{
+  repl_connect((struct repl_peer *)((char *)t -
+        offsetof(struct repl_peer, retry)));
+}
+
+void repl_start(struct evloop * loop)
+{
+  int i;
+
+  repl_loop = loop;
+  for (i = 0; i < npeers; ++i)
+    repl_connect(peers[i]);
+}
+
+/* starts snapshot, the log is sent from its current end afterwards */
+static void repl_resync(struct repl_peer * p)
+{
+  p->snap = 1;
+  p->snap_flushed = 0;
+  p->snap_table = 0;
+  p->snap_pos = 0;
+  p->sent = log_head;
+  ++p->resyncs;
+  logmsg(LOG_INFO, "Sending snapshot of tables to peer %s", p->name);
+}
+
+struct snap_arg
+{
+  struct tbl_op * ops;
+  int cnt;
+  time_t now;
+};
+
+static void snap_entry(int table, in_addr_t addr, uint8_t mask,
+    uintptr_t value, void * arg)
+{
+  struct snap_arg * sa = (struct snap_arg *)arg;
+  struct tbl_op * op = &sa->ops[sa->cnt++];
+  time_t expire = 0;
+
+  lpm_find(repl_lpm, table, addr, mask, &expire, NULL);
+  op->table = table;
+  op->cmd = CMD_ADD;
+  op->mask = mask;
+  op->addr = addr;
+  op->arg = !expire ? 0 : expire > sa->now ? expire - sa->now : 1;
+}
+
+/* fills next message of snapshot, clears snap once it is the last one */
+static int snap_chunk(struct repl_peer * p, struct tbl_op * ops)
+{
+  struct snap_arg sa = { ops, 0, evloop_time(repl_loop) };
+
+  while (sa.cnt < MESSAGE_V2_MAXRECS && p->snap_table < repl_tables)
+  {
+    uint32_t t = p->snap_table;
+    if (!p->snap_flushed)
+    { /* tables which were never touched are left alone */
+      if (!touched[t] && !memtbl_count(repl_index, t))
+      {
+        ++p->snap_table;
+        continue;
+      }
+      struct tbl_op flush = { t, CMD_FLUSH, 0, 0, 0 };
+      ops[sa.cnt++] = flush;
+      p->snap_flushed = 1;
+      continue;
+    }
+    size_t want = MESSAGE_V2_MAXRECS - sa.cnt;
+    if (memtbl_scan(repl_index, t, &p->snap_pos, snap_entry, &sa, want) <
+        want)
+    {
+      ++p->snap_table;
+      p->snap_flushed = 0;
+      p->snap_pos = 0;
+    }
+  }
+  if (p->snap_table == repl_tables)
+    p->snap = 0;
+  return sa.cnt;
+}
+
+/* queues messages while window and buffer allow */
+static void repl_fill(struct repl_peer * p)
+{
+  struct tbl_op ops[MESSAGE_V2_MAXRECS];
+  uint64_t mark;
+  uint32_t seq;
+  int cnt;
+
+  while (p->mcnt < REPL_WINDOW && REPL_WBUF - p->wlen >= MESSAGE_MAXLEN)
+  {
+    if (!p->snap && p->sent < log_tail())
+      repl_resync(p); /* peer is too slow, the log went past it */
+    if (p->snap)
+    {
+      seq = (uint32_t)wall_msec();
+      cnt = snap_chunk(p, ops);
+      mark = p->snap ? REPL_SNAP : p->sent;
+    } else
+    {
+      uint64_t i;
+      if (p->sent == log_head)
+        break;
+      seq = (uint32_t)log_stamps[p->sent % REPL_LOG_OPS];
+      for (cnt = 0, i = p->sent; i < log_head && cnt < MESSAGE_V2_MAXRECS; ++i)
+        ops[cnt++] = log_ops[i % REPL_LOG_OPS];
+      p->sent = mark = i;
+    }
+    p->wlen += proto_message(p->wbuf + p->wlen, MSGF_ACK | MSGF_REPL, seq,
+        ops, cnt);
+    p->marks[(p->mfirst + p->mcnt) % REPL_WINDOW] = mark;
+    p->seqs[(p->mfirst + p->mcnt++) % REPL_WINDOW] = seq;
+  }
+}
+
+/* takes acknowledgements, returns -1 if peer does not follow protocol */
+static int repl_acks(struct repl_peer * p)
+{
+  char * buf = (char *)p->rbuf;
+  size_t off = 0;
+
+  for ( ; ; )
+  {
+    struct message_hdr * hdr = (struct message_hdr *)(buf + off);
+    ssize_t framelen = proto_replylen(buf + off, p->rlen - off);
+    if (framelen < 0)
+      return -1;
+    if (!framelen || framelen > p->rlen - off)
+      break;
+    if (!p->mcnt || ntohl(hdr->seq) != p->seqs[p->mfirst])
+    {
+      errno = EBADMSG;
+      return -1;
+    }
+    if (p->marks[p->mfirst] != REPL_SNAP)
+    {
+      p->acked = p->marks[p->mfirst];
+      p->synced = 1;
+    }
+    p->mfirst = (p->mfirst + 1) % REPL_WINDOW;
+    --p->mcnt;
+    off += framelen;
+  }
+  memmove(buf, buf + off, p->rlen - off);
+  p->rlen -= off;
+  return 0;
+}
+
+static void repl_io(struct evloop * loop, struct ev_io * io, int events)
+{
+  struct repl_peer * p = (struct repl_peer *)io;
+  ssize_t n;
+
+  if (p->connecting)
+  {
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (getsockopt(io->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+      err = errno;
+    if (err)
+    {
+      repl_drop(p, strerror(err));
+      return;
+    }
+    p->connecting = 0;
+    p->up = 1;
+    p->wlen = p->rlen = 0;
+    p->mfirst = p->mcnt = 0;
+    ++p->reconnects;
+    logmsg(LOG_INFO, "Connected to peer %s", p->name);
+    if (!p->synced || p->acked < log_tail())
+      repl_resync(p);
+    else
+      p->sent = p->acked; /* whatever was not acknowledged goes again */
+  }
+
+  if (events & EV_READ)
+  {
+    n = recv(io->fd, (char *)p->rbuf + p->rlen, REPL_RBUF - p->rlen,
+        MSG_DONTWAIT);
+    if (!n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != EINTR))
+    {
+      repl_drop(p, n ? strerror(errno) : "connection closed");
+      return;
+    }
+    if (n > 0)
+    {
+      p->rlen += n;
+      if (repl_acks(p) < 0)
+      {
+        repl_drop(p, "malformed acknowledgement");
+        return;
+      }
+    }
+  }
+
+  repl_fill(p);
+  while (p->wlen)
+  {
+    n = send(io->fd, p->wbuf, p->wlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      repl_drop(p, strerror(errno));
+      return;
+    }
+    memmove(p->wbuf, p->wbuf + n, p->wlen - n);
+    p->wlen -= n;
+    repl_fill(p);
+  }
+  evloop_mod(loop, io, EV_READ | (p->wlen ? EV_WRITE : 0));
+}
+
+/* formats state of peers as 'name value' lines, see stats_format() */
+size_t repl_format(char * buf, size_t len)
+{
+  uint64_t now = wall_msec();
+  size_t off = 0;
+  int i;
+
+  if (!npeers)
+    return 0;
+  off += snprintf(buf + off, len - off, "repl_logged %llu\n",
+      (unsigned long long)log_head);
+  for (i = 0; i < npeers && off < len; ++i)
+  {
+    struct repl_peer * p = peers[i];
+    uint64_t behind = p->synced ? log_head - p->acked : log_head;
+    uint64_t lag = 0;
+    if (behind) /* age of the oldest operation peer still misses */
+      lag = now - log_stamps[(p->synced && p->acked >= log_tail() ?
+            p->acked : log_tail()) % REPL_LOG_OPS];
+    off += snprintf(buf + off, len - off, "repl_peer_%i %s\n"
+        "repl_peer_%i_up %i\nrepl_peer_%i_behind %llu\n"
+        "repl_peer_%i_lag_ms %llu\nrepl_peer_%i_resyncs %llu\n"
+        "repl_peer_%i_connects %llu\n", i, p->name, i, p->up, i,
+        (unsigned long long)behind, i, (unsigned long long)lag, i,
+        (unsigned long long)p->resyncs, i,
+        (unsigned long long)p->reconnects);
+  }
+  return off < len ? off : len;
+}
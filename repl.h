@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef REPL_H
+#define REPL_H
+
+struct evloop;
+struct memtbl;
+struct lpm;
+
+#define REPL_LOG_OPS  (1 << 18) /* applied operations kept for peers */
+#define REPL_WINDOW   16        /* messages sent ahead of acknowledgement */
+#define REPL_RETRY_MS 1000
+
+/*
+ * Replication of applied operations to peer daemons. Operations are logged
+ * in order they were applied and streamed to every peer over its own
+ * connection in messages of up to MESSAGE_V2_MAXRECS operations, each one
+ * acknowledged by peer. Once connection is lost peer is reconnected and
+ * sent everything it did not acknowledge. Peer which has never been in sync
+ * or is too far behind for the log to hold what it misses gets snapshot of
+ * tables first (FLUSH of every table followed by ADD of its entries).
+ */
+int repl_init(uint32_t tables, struct memtbl * index, struct lpm * lpm);
+int repl_peer(const char * spec);
+void repl_start(struct evloop * loop);
+void repl_op(const struct tbl_op * op);
+void repl_received(uint32_t seq, int cnt);
+size_t repl_format(char * buf, size_t len);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "ring.h"
+
+struct ring * ring_new(uint32_t size)
+{
+  struct ring * r;
+  uint32_t sz = 1;
+
+  while (sz < size)
+    sz <<= 1;
+  if (posix_memalign((void **)&r, 64, sizeof(struct ring)))
+    return NULL;
+  memset(r, 0, sizeof(*r));
+  r->size = sz;
+  if (!(r->ops = (struct tbl_op *)malloc(sz * sizeof(struct tbl_op))))
+  {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+void ring_free(struct ring * r)
+{
+  free(r->ops);
+  free(r);
+}
+
+/* producer side, returns amount of operations queued (less if ring is full) */
+int ring_push(struct ring * r, const struct tbl_op * ops, int cnt)
+{
+  uint32_t tail = r->tail;
+  uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  uint32_t room = r->size - (tail - head);
+  int i;
+
+  if (cnt > room)
+    cnt = room;
+  for (i = 0; i < cnt; ++i)
+    r->ops[(tail + i) & (r->size - 1)] = ops[i];
+  __atomic_store_n(&r->tail, tail + cnt, __ATOMIC_RELEASE);
+  return cnt;
+}
+
+/* consumer side, returns amount of operations dequeued */
+int ring_pop(struct ring * r, struct tbl_op * ops, int max)
+{
+  uint32_t head = r->head;
+  uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  int i, cnt = tail - head;
+
+  if (cnt > max)
+    cnt = max;
+  for (i = 0; i < cnt; ++i)
+    ops[i] = r->ops[(head + i) & (r->size - 1)];
+  __atomic_store_n(&r->head, head + cnt, __ATOMIC_RELEASE);
+  return cnt;
+}
+
+uint32_t ring_count(struct ring * r)
+{
+  return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* for recvmmsg() on Linux */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "rx.h"
+#include "log.h"
+
+#if defined(__linux__) || \
+  (defined(__FreeBSD_version) && __FreeBSD_version >= 1100000)
+#define HAVE_RECVMMSG
+#endif
+
+struct rxstats rxstats;
+
+/* receiver threads share counters */
+#define RX_STAT_ADD(f, v) __atomic_fetch_add(&rxstats.f, (v), __ATOMIC_RELAXED)
+
+/*
+ * Buffers are allocated once per thread and reused for every receive call.
+ * Messages are decoded in place so buffers must be suitably aligned.
+ */
+static __thread uint32_t rxbufs[RX_BATCH][MESSAGE_MAXLEN / sizeof(uint32_t)];
+static __thread struct iovec rxiov[RX_BATCH];
+static __thread struct sockaddr_storage rxaddrs[RX_BATCH];
+#ifdef SO_RXQ_OVFL
+static __thread char rxctl[RX_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+#endif
+
+#ifdef HAVE_RECVMMSG
+static __thread struct mmsghdr rxmsgs[RX_BATCH];
+#define RX_HDR(i) (&rxmsgs[i].msg_hdr)
+#define RX_LEN(i) (rxmsgs[i].msg_len)
+#else
+static __thread struct msghdr rxmsgs[RX_BATCH];
+static __thread size_t rxlens[RX_BATCH];
+#define RX_HDR(i) (&rxmsgs[i])
+#define RX_LEN(i) (rxlens[i])
+#endif
+
+/* prepares datagram socket, currently asks kernel to report drops */
+void rx_setup(int fd)
+{
+#ifdef SO_RXQ_OVFL
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)))
+    logmsg(LOG_WARNING, "Failed to enable drops reporting: %s", strerror(errno));
+#endif
+}
+
+static void rx_reset(int cnt)
+{
+  int i;
+  for (i = 0; i < cnt; ++i)
+  {
+    struct msghdr * hdr = RX_HDR(i);
+    rxiov[i].iov_base = rxbufs[i];
+    rxiov[i].iov_len = sizeof(rxbufs[i]);
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_iov = &rxiov[i];
+    hdr->msg_iovlen = 1;
+    rxaddrs[i].ss_family = AF_UNSPEC; /* unbound unix socket has no name */
+    hdr->msg_name = &rxaddrs[i];
+    hdr->msg_namelen = sizeof(rxaddrs[i]);
+#ifdef SO_RXQ_OVFL
+    hdr->msg_control = rxctl[i];
+    hdr->msg_controllen = sizeof(rxctl[i]);
+#endif
+  }
+}
+
+static int rx_recv(int fd, int cnt)
+{
+#ifdef HAVE_RECVMMSG
+  return recvmmsg(fd, rxmsgs, cnt, MSG_DONTWAIT, NULL);
+#else
+  int i;
+  for (i = 0; i < cnt; ++i)
+  {
+    ssize_t len = recvmsg(fd, &rxmsgs[i], MSG_DONTWAIT);
+    if (len < 0)
+      return i ? i : -1;
+    rxlens[i] = len;
+  }
+  return cnt;
+#endif
+}
+
+/* kernel reports cumulative amount of drops on socket with every datagram */
+static void rx_drops(struct msghdr * hdr, uint32_t * ovfl)
+{
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr * cmsg;
+  for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+      continue;
+    uint32_t cur;
+    memcpy(&cur, CMSG_DATA(cmsg), sizeof(cur));
+    if (cur != *ovfl)
+    {
+      RX_STAT_ADD(drops, cur - *ovfl);
+      logmsg(LOG_WARNING, "Kernel dropped %u datagrams", cur - *ovfl);
+      *ovfl = cur;
+    }
+  }
+#endif
+}
+
+/*
+ * Drains up to budget datagrams from ready socket passing each of them to
+ * cb. ovfl keeps last drops counter reported for the socket. Returns amount
+ * of received datagrams.
+ */
+int rx_drain(int fd, int budget, uint32_t * ovfl, rx_cb cb, void * arg)
+{
+  int got = 0;
+
+  while (got < budget)
+  {
+    int i, want = budget - got < RX_BATCH ? budget - got : RX_BATCH;
+    rx_reset(want);
+    int cnt = rx_recv(fd, want);
+    if (cnt < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        logmsg(LOG_ERR, "Failed to receive: %s", strerror(errno));
+      break;
+    }
+
+    for (i = 0; i < cnt; ++i)
+    {
+      struct msghdr * hdr = RX_HDR(i);
+      rx_drops(hdr, ovfl);
+      if (hdr->msg_flags & MSG_TRUNC)
+      {
+        logmsg(LOG_NOTICE, "Dropped oversized datagram");
+        continue;
+      }
+      cb(rxbufs[i], RX_LEN(i), (struct sockaddr *)&rxaddrs[i], arg);
+    }
+    got += cnt;
+    if (cnt < want) /* socket is empty */
+      break;
+  }
+
+  RX_STAT_ADD(wakeups, 1);
+  RX_STAT_ADD(msgs, got);
+  if (got >= budget)
+    RX_STAT_ADD(exhausted, 1);
+  uint64_t max = __atomic_load_n(&rxstats.max, __ATOMIC_RELAXED);
+  while (got > max && !__atomic_compare_exchange_n(&rxstats.max, &max, got,
+        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  int bucket = 0;
+  while ((got >> (bucket + 1)) && bucket < RX_HIST_BUCKETS - 1)
+    ++bucket;
+  if (got)
+    RX_STAT_ADD(hist[bucket], 1);
+
+  return got;
+}
+
+void rx_stats_log(void)
+{
+  char hist[RX_HIST_BUCKETS * 22] = "";
+  int i;
+  for (i = 0; i < RX_HIST_BUCKETS; ++i)
+    snprintf(hist + strlen(hist), sizeof(hist) - strlen(hist), "%s%llu",
+        i ? "/" : "", (unsigned long long)rxstats.hist[i]);
+  logmsg(LOG_INFO, "Received %llu datagrams in %llu wakeups (max %llu, "
+      "budget exhausted %llu times, per wakeup histogram %s), "
+      "%llu drops detected",
+      (unsigned long long)rxstats.msgs, (unsigned long long)rxstats.wakeups,
+      (unsigned long long)rxstats.max, (unsigned long long)rxstats.exhausted,
+      hist, (unsigned long long)rxstats.drops);
+}
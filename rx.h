@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RX_H
+#define RX_H
+
+#define RX_BATCH 32              /* datagrams per single receive call */
+#define RX_DEFAULT_BUDGET 256    /* datagrams per socket per wakeup */
+#define RX_HIST_BUCKETS 10       /* 1, 2-3, 4-7, ..., 256 and more */
+
+/* src is address of sender, of AF_UNSPEC family if it is unknown */
+typedef void (*rx_cb)(void * buf, size_t len, const struct sockaddr * src,
+    void * arg);
+
+struct rxstats
+{
+  uint64_t wakeups;    /* times ready socket was drained */
+  uint64_t msgs;       /* datagrams received */
+  uint64_t exhausted;  /* wakeups which ran out of budget */
+  uint64_t drops;      /* datagrams dropped by kernel, if it tells */
+  uint64_t max;        /* max datagrams per wakeup */
+  uint64_t hist[RX_HIST_BUCKETS]; /* datagrams per wakeup */
+};
+
+extern struct rxstats rxstats;
+
+void rx_setup(int fd);
+int rx_drain(int fd, int budget, uint32_t * ovfl, rx_cb cb, void * arg);
+void rx_stats_log(void);
+
+#endif
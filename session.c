@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "proto.h"
+#include "evloop.h"
+#include "session.h"
+#include "stats.h"
+#include "log.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void session_io(struct evloop * loop, struct ev_io * io, int events);
+
+struct session * session_new(struct evloop * loop, int fd, session_frame_cb cb)
+{
+  struct session * s = (struct session *)malloc(sizeof(struct session));
+  if (!s)
+    return NULL;
+  memset(s, 0, offsetof(struct session, rbuf));
+  s->io.fd = fd;
+  s->io.cb = session_io;
+  s->loop = loop;
+  s->on_frame = cb;
+  if (evloop_add(loop, &s->io, EV_READ) < 0)
+  {
+    free(s);
+    return NULL;
+  }
+  STATS_INC(stats.conn_total);
+  STATS_INC(stats.conn_active);
+  return s;
+}
+
+void session_close(struct session * s)
+{
+  evloop_del(s->loop, &s->io);
+  close(s->io.fd);
+  logmsg(LOG_DEBUG, "Cleaned up socket %i", s->io.fd);
+  free(s->wbuf);
+  free(s->pull_arg);
+  free(s->data);
+  free(s);
+  STATS_DEC(stats.conn_active);
+}
+
+int session_reply(struct session * s, const void * data, size_t len)
+{
+  if (s->wlen + len > s->wsize)
+  {
+    size_t wsize = s->wsize ? s->wsize : 1024;
+    while (wsize < s->wlen + len)
+      wsize *= 2;
+    char * wbuf = (char *)realloc(s->wbuf, wsize);
+    if (!wbuf)
+      return -1;
+    s->wbuf = wbuf;
+    s->wsize = wsize;
+  }
+  memcpy(s->wbuf + s->wlen, data, len);
+  s->wlen += len;
+  return 0;
+}
+
+/*
+ * Sets producer of the rest of reply, cb queues next part of it with
+ * session_reply() and returns 0 once everything is queued.
+ */
+void session_pull(struct session * s, session_pull_cb cb, void * arg)
+{
+  s->pull = cb;
+  s->pull_arg = arg;
+}
+
+/* returns -1 if connection is broken */
+static int session_flush(struct session * s)
+{
+  while (s->wlen)
+  {
+    ssize_t sent = send(s->io.fd, s->wbuf, s->wlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    memmove(s->wbuf, s->wbuf + sent, s->wlen - sent);
+    s->wlen -= sent;
+  }
+  return 0;
+}
+
+/* returns -1 if stream is malformed */
+static int session_frames(struct session * s)
+{
+  char * buf = (char *)s->rbuf;
+  size_t off = 0;
+
+  for ( ; ; )
+  {
+    ssize_t framelen = proto_framelen(buf + off, s->rlen - off);
+    if (framelen < 0)
+    {
+      logmsg(LOG_NOTICE, "Malformed stream on socket %i: %s",
+          s->io.fd, strerror(errno));
+      return -1;
+    }
+    if (s->pull || !framelen || framelen > s->rlen - off)
+      break;
+    s->on_frame(s, buf + off, framelen);
+    off += framelen;
+  }
+
+  if (off)
+  {
+    memmove(buf, buf + off, s->rlen - off);
+    s->rlen -= off;
+  }
+  return 0;
+}
+
+/* pulls reply from producer while there is room, then frames left behind */
+static int session_pending(struct session * s)
+{
+  while (s->pull && s->wlen < SESSION_WBUF_MAX)
+  {
+    if (s->pull(s, s->pull_arg))
+      continue;
+    s->pull = NULL;
+    free(s->pull_arg);
+    s->pull_arg = NULL;
+    if (session_frames(s) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static void session_io(struct evloop * loop, struct ev_io * io, int events)
+{
+  struct session * s = (struct session *)io;
+
+  if ((events & EV_READ) && !s->eof && !s->pull)
+  {
+    ssize_t read = recv(io->fd, (char *)s->rbuf + s->rlen,
+        SESSION_RBUF - s->rlen, MSG_DONTWAIT);
+    if (read > 0)
+    {
+      s->rlen += read;
+      if (session_frames(s) < 0)
+      {
+        session_close(s);
+        return;
+      }
+    } else if (!read || (errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != EINTR))
+      s->eof = 1;
+  }
+
+  if (session_pending(s) < 0 || session_flush(s) < 0 ||
+      (s->eof && !s->wlen && !s->pull))
+  {
+    session_close(s);
+    return;
+  }
+
+  /*
+   * Do not read more while peer does not take replies. Producer is pulled
+   * again once socket is writable even if everything queued went out.
+   */
+  int want = (s->eof || s->pull || s->wlen >= SESSION_WBUF_MAX) ?
+    0 : EV_READ;
+  if (s->wlen || s->pull)
+    want |= EV_WRITE;
+  evloop_mod(loop, io, want);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#define SESSION_RBUF (2 * MESSAGE_MAXLEN)
+#define SESSION_WBUF_MAX (64 * 1024) /* unsent replies which pause reading */
+
+struct session;
+
+typedef void (*session_frame_cb)(struct session * s, void * frame, size_t len);
+typedef int (*session_pull_cb)(struct session * s, void * arg);
+
+/*
+ * Long-lived stream connection. Incoming data is split into frames which
+ * are passed to callback one by one (every frame is 4-byte aligned as all
+ * message lengths are multiples of 4), replies queued meanwhile are sent
+ * with single write once all frames of the read are processed. Reply too
+ * large to be queued at once is pulled from producer set by session_pull()
+ * whenever peer takes what is queued, frames which follow are not processed
+ * until producer is done.
+ */
+struct session
+{
+  struct ev_io io;
+  struct evloop * loop;
+  session_frame_cb on_frame;
+  int eof;          /* peer will not send anything more */
+  size_t rlen;      /* bytes in rbuf */
+  char * wbuf;
+  size_t wlen;      /* bytes queued in wbuf */
+  size_t wsize;     /* allocated size of wbuf */
+  struct sockaddr_storage peer; /* set by owner, AF_UNSPEC if unknown */
+  session_pull_cb pull;
+  void * pull_arg;  /* freed once producer is done or session is closed */
+  void * data;      /* state of owner kept between frames, freed on close */
+  uint32_t rbuf[SESSION_RBUF / sizeof(uint32_t)];
+};
+
+struct session * session_new(struct evloop * loop, int fd, session_frame_cb cb);
+int session_reply(struct session * s, const void * data, size_t len);
+void session_pull(struct session * s, session_pull_cb cb, void * arg);
+void session_close(struct session * s);
+
+#endif
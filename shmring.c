@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "shmring.h"
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define STORE(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELEASE)
+
+static struct shmring * shmring_map(int fd, size_t len, const char * path,
+    int wake_flags)
+{
+  char wake[PATH_MAX];
+  struct shmring * r = (struct shmring *)calloc(1, sizeof(*r));
+
+  if (!r)
+    return NULL;
+  r->len = len;
+  r->hdr = (struct shmring_hdr *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  snprintf(wake, sizeof(wake), "%s%s", path, SHMRING_WAKE);
+  if (r->hdr == MAP_FAILED ||
+      (r->wake = open(wake, wake_flags | O_NONBLOCK)) < 0)
+  {
+    int err = errno;
+    if (r->hdr != MAP_FAILED)
+      munmap(r->hdr, len);
+    free(r);
+    errno = err;
+    return NULL;
+  }
+  return r;
+}
+
+/*
+ * Creates ring of size records (power of 2) at path replacing whatever was
+ * there, along with its wakeup FIFO.
+ */
+struct shmring * shmring_create(const char * path, uint32_t size)
+{
+  char wake[PATH_MAX];
+  size_t len = sizeof(struct shmring_hdr) + size * sizeof(struct shmring_slot);
+  struct shmring * r;
+  uint32_t i;
+  int fd;
+
+  snprintf(wake, sizeof(wake), "%s%s", path, SHMRING_WAKE);
+  unlink(path);
+  unlink(wake);
+  if (mkfifo(wake, 0666) < 0 ||
+      (fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666)) < 0)
+    return NULL;
+  if (ftruncate(fd, len) < 0)
+  {
+    close(fd);
+    return NULL;
+  }
+  /* kept open for writing too, FIFO does not report EOF when clients leave */
+  r = shmring_map(fd, len, path, O_RDWR);
+  close(fd);
+  if (!r)
+    return NULL;
+  for (i = 0; i < size; ++i)
+    r->hdr->slots[i].seq = i;
+  r->hdr->size = r->size = size;
+  STORE(r->hdr->magic, SHMRING_MAGIC);
+  return r;
+}
+
+/* maps ring created by the daemon, returns NULL with errno set on failure */
+struct shmring * shmring_attach(const char * path)
+{
+  struct shmring * r;
+  struct stat st;
+  int fd = open(path, O_RDWR);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct shmring_hdr))
+  {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  r = shmring_map(fd, st.st_size, path, O_WRONLY);
+  close(fd);
+  if (r)
+    r->size = r->hdr->size;
+  if (r && (!r->size || (r->size & (r->size - 1)) ||
+        LOAD(r->hdr->magic) != SHMRING_MAGIC ||
+        r->len < sizeof(struct shmring_hdr) +
+        (size_t)r->size * sizeof(struct shmring_slot)))
+  {
+    shmring_close(r);
+    errno = EINVAL;
+    return NULL;
+  }
+  return r;
+}
+
+void shmring_close(struct shmring * r)
+{
+  munmap(r->hdr, r->len);
+  close(r->wake);
+  free(r);
+}
+
+/*
+ * Puts records (table and arg in network byte order) into the ring, returns
+ * amount of them put which is less than cnt if the ring is full.
+ */
+int shmring_put(struct shmring * r, const struct tbl_op * ops, int cnt)
+{
+  struct shmring_hdr * h = r->hdr;
+  uint32_t mask = r->size - 1;
+  int put;
+
+  for (put = 0; put < cnt; ++put)
+  {
+    uint32_t pos = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+    struct shmring_slot * slot;
+    for ( ; ; )
+    {
+      slot = &h->slots[pos & mask];
+      int32_t diff = (int32_t)(LOAD(slot->seq) - pos);
+      if (!diff && __atomic_compare_exchange_n(&h->tail, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+      if (diff < 0) /* the daemon did not take it for the previous lap */
+        goto full;
+      if (diff > 0)
+        pos = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+    }
+    slot->op = ops[put];
+    STORE(slot->seq, pos + 1);
+  }
+
+full:
+  /* pairs with shmring_sleep(): either it sees records or we see flag */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (put && __atomic_load_n(&h->sleeping, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&h->sleeping, 0, __ATOMIC_ACQ_REL))
+  {
+    char c = 0;
+    if (write(r->wake, &c, 1) < 0 && errno != EAGAIN)
+      return -1;
+  }
+  return put;
+}
+
+/* takes up to max records in host byte order, returns amount taken */
+int shmring_get(struct shmring * r, struct tbl_op * ops, int max)
+{
+  struct shmring_hdr * h = r->hdr;
+  uint32_t pos = h->head, mask = r->size - 1;
+  int cnt;
+
+  for (cnt = 0; cnt < max; ++cnt, ++pos)
+  {
+    struct shmring_slot * slot = &h->slots[pos & mask];
+    if (LOAD(slot->seq) != pos + 1)
+      break;
+    ops[cnt] = slot->op;
+    ops[cnt].table = ntohs(ops[cnt].table);
+    ops[cnt].arg = ntohl(ops[cnt].arg);
+    STORE(slot->seq, pos + r->size);
+  }
+  STORE(h->head, pos);
+  return cnt;
+}
+
+/*
+ * Asks clients to wake the daemon up, returns -1 if records showed up
+ * meanwhile and ring is to be drained right away.
+ */
+int shmring_sleep(struct shmring * r)
+{
+  struct shmring_hdr * h = r->hdr;
+
+  __atomic_store_n(&h->sleeping, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (LOAD(h->slots[h->head & (r->size - 1)].seq) != h->head + 1)
+    return 0;
+  __atomic_store_n(&h->sleeping, 0, __ATOMIC_RELAXED);
+  return -1;
+}
+
+/* reads out pending wakeups */
+void shmring_woken(struct shmring * r)
+{
+  char buf[64];
+
+  while (read(r->wake, buf, sizeof(buf)) > 0)
+    ;
+}
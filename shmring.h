@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#define SHMRING_MAGIC 0x53485231 /* 'SHR1' */
+#define SHMRING_SIZE  65536      /* records, power of 2 */
+#define SHMRING_WAKE  ".wake"    /* suffix of path of wakeup FIFO */
+#define SHMRING_BUDGET 16384     /* records taken by the daemon at once */
+
+/*
+ * Submission ring shared by the daemon with local clients through file
+ * mapped into memory of both. Clients (any amount of them) put records of
+ * struct tbl_op layout, the same as version 2 records have, and the daemon
+ * takes them in order they were reserved. Every slot carries sequence
+ * number telling whether it is free or filled for the current lap (bounded
+ * queue by D. Vyukov), thus no side takes a lock and client which put
+ * record is visible is never blocked by others. Client writes to wakeup
+ * FIFO only if the daemon went asleep as the ring was empty.
+ */
+struct shmring_slot
+{
+  uint32_t seq;
+  struct tbl_op op;
+};
+
+struct shmring_hdr
+{
+  uint32_t magic;
+  uint32_t size;
+  uint32_t head __attribute__((aligned(64)));     /* taken by the daemon */
+  uint32_t tail __attribute__((aligned(64)));     /* reserved by clients */
+  uint32_t sleeping __attribute__((aligned(64))); /* the daemon waits */
+  struct shmring_slot slots[] __attribute__((aligned(64)));
+};
+
+struct shmring
+{
+  struct shmring_hdr * hdr;
+  size_t len;
+  uint32_t size;    /* own copy, header is writable by every client */
+  int wake;         /* FIFO, read end for the daemon, write one for client */
+};
+
+struct shmring * shmring_create(const char * path, uint32_t size);
+struct shmring * shmring_attach(const char * path);
+void shmring_close(struct shmring * r);
+int shmring_put(struct shmring * r, const struct tbl_op * ops, int cnt);
+int shmring_get(struct shmring * r, struct tbl_op * ops, int max);
+int shmring_sleep(struct shmring * r);
+void shmring_woken(struct shmring * r);
+
+#endif
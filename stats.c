@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ipfwtabled.h"
+#include "rx.h"
+#include "repl.h"
+#include "stats.h"
+#include "log.h"
+
+struct stats stats;
+
+static const char * stats_cmds[STATS_CMDS] =
+  { "unknown", "add", "del", "flush", "refresh", "lookup", "list",
+    "replace" };
+static const char * stats_statuses[STATS_STATUSES] =
+  { "ok", "invalid", "exists", "noent", "failed" };
+static const char * stats_lats[STATS_LATS] = { "kernel", "batch" };
+
+int stats_init(uint32_t tables)
+{
+  stats.tables = tables;
+  stats.table_ops = (uint64_t *)calloc(tables, sizeof(uint64_t));
+  stats.table_failed = (uint64_t *)calloc(tables, sizeof(uint64_t));
+  stats.started = time(NULL);
+  return (stats.table_ops && stats.table_failed) ? 0 : -1;
+}
+
+/* accounts operation of given table (-1 if unknown) and its STATUS_* */
+void stats_op(int table, int cmd, int status)
+{
+  if (cmd < 0 || cmd >= STATS_CMDS)
+    cmd = 0;
+  STATS_INC(stats.ops[cmd][status]);
+  if (table < 0 || table >= stats.tables)
+    return;
+  STATS_INC(stats.table_ops[table]);
+  if (status != STATUS_OK)
+    STATS_INC(stats.table_failed[table]);
+}
+
+uint64_t stats_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* accounts latency of operation started at given stats_usec() */
+void stats_lat(int which, uint64_t start)
+{
+  uint64_t d = stats_usec() - start;
+  int bucket = 0;
+  while (bucket < STATS_LAT_BUCKETS - 1 && (d >> (bucket + 1)))
+    ++bucket;
+  STATS_INC(stats.lat[which][bucket]);
+  STATS_ADD(stats.lat_sum[which], d);
+}
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/*
+ * Formats snapshot of statistics as 'name value' lines, histograms hold
+ * counts of buckets separated by spaces. Returns length of text (which is
+ * truncated if it does not fit).
+ */
+size_t stats_format(char * buf, size_t len)
+{
+  size_t off = 0;
+  int i, j;
+
+#define OUT(...) do { \
+    if (off < len) \
+      off += snprintf(buf + off, len - off, __VA_ARGS__); \
+  } while (0)
+
+  OUT("uptime %llu\n", (unsigned long long)(time(NULL) - stats.started));
+  for (i = 0; i < STATS_CMDS; ++i)
+    for (j = 0; j < STATS_STATUSES; ++j)
+      if (LOAD(stats.ops[i][j]))
+        OUT("ops_%s_%s %llu\n", stats_cmds[i], stats_statuses[j],
+            (unsigned long long)LOAD(stats.ops[i][j]));
+  for (i = 0; i < stats.tables; ++i)
+    if (LOAD(stats.table_ops[i]))
+      OUT("table_%i_ops %llu\ntable_%i_failed %llu\n",
+          i, (unsigned long long)LOAD(stats.table_ops[i]),
+          i, (unsigned long long)LOAD(stats.table_failed[i]));
+  for (i = 0; i < STATS_LATS; ++i)
+  {
+    uint64_t cnt = 0;
+    OUT("%s_us_hist", stats_lats[i]);
+    for (j = 0; j < STATS_LAT_BUCKETS; ++j)
+    {
+      cnt += LOAD(stats.lat[i][j]);
+      OUT(" %llu", (unsigned long long)LOAD(stats.lat[i][j]));
+    }
+    OUT("\n%s_calls %llu\n%s_us_total %llu\n", stats_lats[i],
+        (unsigned long long)cnt, stats_lats[i],
+        (unsigned long long)LOAD(stats.lat_sum[i]));
+  }
+  OUT("expiry_pending %llu\nexpiry_lag %llu\nexpired %llu\n",
+      (unsigned long long)LOAD(stats.expiry_pending),
+      (unsigned long long)LOAD(stats.expiry_lag),
+      (unsigned long long)LOAD(stats.expired));
+  OUT("expiry_cut %llu\nexpiry_flushes %llu\nexpiry_flush_saved %llu\n",
+      (unsigned long long)LOAD(stats.expiry_cut),
+      (unsigned long long)LOAD(stats.expiry_flushes),
+      (unsigned long long)LOAD(stats.expiry_flush_saved));
+  if (LOAD(stats.index_dup_adds))
+    OUT("index_dup_adds %llu\n",
+        (unsigned long long)LOAD(stats.index_dup_adds));
+  if (LOAD(stats.coalesce_queued))
+    OUT("coalesce_queued %llu\ncoalesce_merged %llu\ncoalesce_dropped %llu\n"
+        "coalesce_saved %llu\ncoalesce_issued %llu\ncoalesce_failed %llu\n",
+        (unsigned long long)LOAD(stats.coalesce_queued),
+        (unsigned long long)LOAD(stats.coalesce_merged),
+        (unsigned long long)LOAD(stats.coalesce_dropped),
+        (unsigned long long)(LOAD(stats.coalesce_merged) +
+          LOAD(stats.coalesce_dropped)),
+        (unsigned long long)LOAD(stats.coalesce_issued),
+        (unsigned long long)LOAD(stats.coalesce_failed));
+  if (LOAD(stats.admit_limited))
+    OUT("admit_limited %llu\nadmit_limited_ops %llu\n",
+        (unsigned long long)LOAD(stats.admit_limited),
+        (unsigned long long)LOAD(stats.admit_limited_ops));
+  if (LOAD(stats.lane_queued))
+    OUT("lane_pending %llu\nlane_queued %llu\nlane_cancelled %llu\n"
+        "lane_shed %llu\n",
+        (unsigned long long)LOAD(stats.lane_pending),
+        (unsigned long long)LOAD(stats.lane_queued),
+        (unsigned long long)LOAD(stats.lane_cancelled),
+        (unsigned long long)LOAD(stats.lane_shed));
+  if (LOAD(stats.agg_tables))
+    OUT("agg_tables %llu\nagg_entries %llu\nagg_kernel %llu\nagg_saved %lld\n"
+        "agg_failed %llu\n",
+        (unsigned long long)LOAD(stats.agg_tables),
+        (unsigned long long)LOAD(stats.agg_entries),
+        (unsigned long long)LOAD(stats.agg_kernel),
+        (long long)(LOAD(stats.agg_entries) - LOAD(stats.agg_kernel)),
+        (unsigned long long)LOAD(stats.agg_failed));
+  if (LOAD(stats.worker_stalls) || LOAD(stats.worker_pending))
+    OUT("worker_pending %llu\nworker_stalls %llu\nworker_shed %llu\n"
+        "worker_shed_ops %llu\n",
+        (unsigned long long)LOAD(stats.worker_pending),
+        (unsigned long long)LOAD(stats.worker_stalls),
+        (unsigned long long)LOAD(stats.worker_shed),
+        (unsigned long long)LOAD(stats.worker_shed_ops));
+  if (LOAD(stats.shm_ops))
+    OUT("shm_ops %llu\nshm_batches %llu\nshm_wakeups %llu\n",
+        (unsigned long long)LOAD(stats.shm_ops),
+        (unsigned long long)LOAD(stats.shm_batches),
+        (unsigned long long)LOAD(stats.shm_wakeups));
+  if (LOAD(stats.replace_tables))
+    OUT("replace_tables %llu\nreplace_added %llu\nreplace_deleted %llu\n"
+        "replace_unchanged %llu\n",
+        (unsigned long long)LOAD(stats.replace_tables),
+        (unsigned long long)LOAD(stats.replace_added),
+        (unsigned long long)LOAD(stats.replace_deleted),
+        (unsigned long long)LOAD(stats.replace_unchanged));
+  if (LOAD(stats.import_entries) || LOAD(stats.import_invalid))
+    OUT("import_entries %llu\nimport_dups %llu\nimport_invalid %llu\n"
+        "import_failed %llu\n",
+        (unsigned long long)LOAD(stats.import_entries),
+        (unsigned long long)LOAD(stats.import_dups),
+        (unsigned long long)LOAD(stats.import_invalid),
+        (unsigned long long)LOAD(stats.import_failed));
+  if (LOAD(stats.repl_in_msgs))
+    OUT("repl_in_msgs %llu\nrepl_in_ops %llu\nrepl_lag_ms %llu\n",
+        (unsigned long long)LOAD(stats.repl_in_msgs),
+        (unsigned long long)LOAD(stats.repl_in_ops),
+        (unsigned long long)LOAD(stats.repl_lag_ms));
+  if (off < len)
+    off += repl_format(buf + off, len - off);
+  OUT("rx_wakeups %llu\nrx_msgs %llu\nrx_exhausted %llu\nrx_drops %llu\n",
+      (unsigned long long)rxstats.wakeups, (unsigned long long)rxstats.msgs,
+      (unsigned long long)rxstats.exhausted,
+      (unsigned long long)rxstats.drops);
+  OUT("log_dropped %llu\n", (unsigned long long)log_dropped());
+  OUT("conn_active %llu\nconn_total %llu\n",
+      (unsigned long long)LOAD(stats.conn_active),
+      (unsigned long long)LOAD(stats.conn_total));
+#undef OUT
+
+  return off < len ? off : len - 1;
+}
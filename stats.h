@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef STATS_H
+#define STATS_H
+
+#define STATS_CMDS     8   /* unknown command and CMD_ADD..CMD_REPLACE */
+#define STATS_STATUSES 5   /* STATUS_OK..STATUS_FAILED */
+#define STATS_LAT_BUCKETS 24 /* <2us, 2-3us, 4-7us, ..., 8s and more */
+
+#define STATS_LAT_KERNEL 0 /* single call into IPFW */
+#define STATS_LAT_BATCH  1 /* whole message applied to backend */
+#define STATS_LATS       2
+
+/*
+ * Counters are updated with relaxed atomic increments so that they can be
+ * bumped from any thread and read at any time without locking, gauges are
+ * plain values stored by their single owner.
+ */
+struct stats
+{
+  uint64_t ops[STATS_CMDS][STATS_STATUSES];
+  uint64_t * table_ops;      /* per table, tables_max of them */
+  uint64_t * table_failed;
+  uint32_t tables;
+  uint64_t lat[STATS_LATS][STATS_LAT_BUCKETS];
+  uint64_t lat_sum[STATS_LATS]; /* microseconds */
+  uint64_t conn_total;
+  uint64_t conn_active;
+  uint64_t expiry_pending;   /* gauge */
+  uint64_t expiry_lag;       /* gauge, seconds last cleanup was late by */
+  uint64_t expired;
+  uint64_t expiry_cut;       /* cleanups stopped by budget */
+  uint64_t expiry_flushes;   /* tables flushed instead of deleting entries */
+  uint64_t expiry_flush_saved; /* deletions avoided that way */
+  uint64_t index_dup_adds;   /* ADDs of present entries, not passed on */
+  uint64_t coalesce_queued;  /* operations entering coalescing window */
+  uint64_t coalesce_merged;  /* superseded by later one on the same entry */
+  uint64_t coalesce_dropped; /* made redundant by FLUSH */
+  uint64_t coalesce_issued;  /* net operations passed to backend */
+  uint64_t coalesce_failed;
+  uint64_t admit_limited;    /* messages over rate limit of their sender */
+  uint64_t admit_limited_ops;
+  uint64_t lane_pending;     /* gauge, bulk operations queued */
+  uint64_t lane_queued;
+  uint64_t lane_cancelled;   /* queued ADDs made redundant by DEL or FLUSH */
+  uint64_t lane_shed;        /* not queued as queue was full */
+  uint64_t agg_tables;       /* aggregated tables */
+  uint64_t agg_entries;      /* gauge, members of aggregated tables */
+  uint64_t agg_kernel;       /* gauge, prefixes installed for them */
+  uint64_t agg_failed;       /* kernel updates failed for them */
+  uint64_t worker_pending;   /* gauge, operations queued for apply threads */
+  uint64_t worker_stalls;    /* receiver waited for apply thread */
+  uint64_t worker_shed;      /* messages dropped as it was still behind */
+  uint64_t worker_shed_ops;
+  uint64_t shm_ops;          /* taken from shared memory ring */
+  uint64_t shm_batches;
+  uint64_t shm_wakeups;      /* clients woke the daemon up */
+  uint64_t replace_tables;   /* REPLACE series applied */
+  uint64_t replace_added;
+  uint64_t replace_deleted;
+  uint64_t replace_unchanged; /* entries left as they were */
+  uint64_t import_entries;   /* added from files on startup */
+  uint64_t import_dups;
+  uint64_t import_invalid;   /* lines which are not prefixes */
+  uint64_t import_failed;
+  uint64_t repl_in_msgs;     /* replicated messages received from peer */
+  uint64_t repl_in_ops;
+  uint64_t repl_lag_ms;      /* gauge, how late the last one was received */
+  time_t started;
+};
+
+extern struct stats stats;
+
+#define STATS_ADD(field, n) \
+  __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STATS_INC(field) STATS_ADD(field, 1)
+#define STATS_DEC(field) \
+  __atomic_fetch_sub(&(field), 1, __ATOMIC_RELAXED)
+#define STATS_SET(field, v) \
+  __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+
+int stats_init(uint32_t tables);
+void stats_op(int table, int cmd, int status);
+uint64_t stats_usec(void);
+void stats_lat(int which, uint64_t start);
+size_t stats_format(char * buf, size_t len);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "log.h"
+#include "trace.h"
+
+static FILE * trace_file;
+static int trace_failed;
+
+int trace_open(const char * path)
+{
+  struct trace_hdr hdr = { TRACE_MAGIC, 0 };
+
+  if (!(trace_file = fopen(path, "w")))
+    return -1;
+  if (fwrite(&hdr, sizeof(hdr), 1, trace_file) != 1)
+  {
+    fclose(trace_file);
+    trace_file = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Records message before it is decoded in place. stdio serializes writers
+ * so receiver threads may call it simultaneously.
+ */
+void trace_message(int type, const void * msg, size_t len,
+    const struct sockaddr * src)
+{
+  static const uint32_t pad;
+  struct trace_rec r;
+  struct timespec ts;
+
+  if (!trace_file || trace_failed || len > MESSAGE_MAXLEN)
+    return;
+  memset(&r, 0, sizeof(r));
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r.usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  r.len = len;
+  r.type = type;
+  r.family = src ? src->sa_family : AF_UNSPEC;
+  if (r.family == AF_INET)
+  {
+    const struct sockaddr_in * sin = (const struct sockaddr_in *)src;
+    r.port = sin->sin_port;
+    memcpy(r.addr, &sin->sin_addr, sizeof(sin->sin_addr));
+  } else if (r.family == AF_INET6)
+  {
+    const struct sockaddr_in6 * sin6 = (const struct sockaddr_in6 *)src;
+    r.port = sin6->sin6_port;
+    memcpy(r.addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+  }
+
+  flockfile(trace_file);
+  if (fwrite(&r, sizeof(r), 1, trace_file) != 1 ||
+      fwrite(msg, 1, len, trace_file) != len ||
+      fwrite(&pad, 1, -len & 3, trace_file) != (-len & 3))
+  {
+    logmsg(LOG_ERR, "Failed to write trace, tracing stopped");
+    trace_failed = 1;
+  }
+  funlockfile(trace_file);
+}
+
+void trace_close(void)
+{
+  if (trace_file)
+    fclose(trace_file);
+  trace_file = NULL;
+}
+
+/* opens trace for reading, NULL if it is not a trace file */
+FILE * trace_load(const char * path)
+{
+  struct trace_hdr hdr;
+  FILE * f = fopen(path, "r");
+
+  if (f && (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC))
+  {
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+/* reads next record and its message, returns 0 at the end, -1 if truncated */
+int trace_next(FILE * f, struct trace_rec * r, void * msg)
+{
+  if (fread(r, sizeof(*r), 1, f) != 1)
+    return feof(f) ? 0 : -1;
+  if (r->len > MESSAGE_MAXLEN ||
+      fread(msg, 1, (r->len + 3) & ~3, f) != ((r->len + 3) & ~3))
+    return -1;
+  return 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#define TRACE_MAGIC 0x31435254 /* "TRC1" */
+
+#define TRACE_DGRAM  1
+#define TRACE_STREAM 2
+
+/*
+ * Trace file is header followed by records, each one followed by message
+ * as it was received padded to 4 bytes. Everything is in host byte order
+ * except for port and addr.
+ */
+struct trace_hdr
+{
+  uint32_t magic;
+  uint32_t reserved;
+};
+
+struct trace_rec
+{
+  uint64_t usec;     /* wall clock time message was received at */
+  uint16_t len;      /* of message */
+  uint8_t type;      /* TRACE_* */
+  uint8_t family;    /* of sender, AF_UNSPEC if unknown */
+  uint16_t port;
+  uint16_t reserved;
+  uint8_t addr[16];  /* IPv4 address takes first 4 bytes */
+};
+
+int trace_open(const char * path);
+void trace_message(int type, const void * msg, size_t len,
+    const struct sockaddr * src);
+void trace_close(void);
+
+FILE * trace_load(const char * path);
+int trace_next(FILE * f, struct trace_rec * r, void * msg);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include "ipfwtabled.h"
+#include "evloop.h"
+#include "ring.h"
+#include "worker.h"
+#include "stats.h"
+#include "log.h"
+
+/* thread running its own loop, woken up through pipe */
+struct thread
+{
+  pthread_t tid;
+  struct evloop * loop;
+  int wake[2];
+  struct ev_io io;
+  int stop;
+  int running;
+};
+
+struct worker
+{
+  struct thread t;
+  int id;
+  int notified;         /* wakeup is pending, receivers need not write */
+  struct ring ** rings; /* one per receiver */
+};
+
+struct receiver
+{
+  struct thread t;
+  struct tbl_op * bufs; /* WORKER_BATCH operations per worker */
+  int * cnts;
+  int * need;           /* operations of message per worker */
+  char * pushed;        /* workers to be woken up on flush */
+  char * shedding;      /* workers messages are shed for without waiting */
+};
+
+static struct worker * workers;
+static struct receiver * receivers;
+static int nworkers, nreceivers;
+static worker_apply_cb apply_cb;
+
+static void worker_notify(struct worker * w)
+{
+  char c = 0;
+  if (!__atomic_exchange_n(&w->notified, 1, __ATOMIC_SEQ_CST) &&
+      write(w->t.wake[1], &c, 1) < 0 && errno != EAGAIN)
+    logmsg(LOG_ERR, "Failed to wake up apply thread: %s", strerror(errno));
+}
+
+/*
+ * Applies operations queued by receivers. Amount taken from every ring per
+ * wakeup is bounded for expiry timers of the thread not to starve.
+ */
+static void worker_drain(struct worker * w)
+{
+  struct tbl_op ops[MESSAGE_V2_MAXRECS];
+  int i, left = 0;
+
+  __atomic_store_n(&w->notified, 0, __ATOMIC_SEQ_CST);
+  for (i = 0; i < nreceivers; ++i)
+  {
+    int cnt, taken = 0;
+    while (taken < WORKER_RING &&
+        (cnt = ring_pop(w->rings[i], ops, MESSAGE_V2_MAXRECS)) > 0)
+    {
+      apply_cb(w->id, ops, cnt);
+      taken += cnt;
+    }
+    if (ring_count(w->rings[i]))
+      left = 1;
+  }
+  if (left)
+    worker_notify(w);
+}
+
+/* reads out pending wakeups, returns 1 if thread is asked to stop */
+static int thread_woken(struct thread * t)
+{
+  char buf[64];
+
+  while (read(t->wake[0], buf, sizeof(buf)) > 0)
+    ;
+  return __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+}
+
+static void on_worker_wake(struct evloop * loop, struct ev_io * io, int events)
+{
+  struct worker * w = (struct worker *)io->arg;
+  int stop = thread_woken(&w->t);
+
+  worker_drain(w);
+  if (stop)
+    evloop_break(loop);
+}
+
+static void on_rx_wake(struct evloop * loop, struct ev_io * io, int events)
+{
+  if (thread_woken((struct thread *)io->arg))
+    evloop_break(loop);
+}
+
+static int thread_init(struct thread * t, struct evloop * loop, ev_io_cb cb,
+    void * arg)
+{
+  if (pipe(t->wake) < 0)
+    return -1;
+  fcntl(t->wake[0], F_SETFL, fcntl(t->wake[0], F_GETFL) | O_NONBLOCK);
+  fcntl(t->wake[1], F_SETFL, fcntl(t->wake[1], F_GETFL) | O_NONBLOCK);
+  t->loop = loop;
+  t->io.fd = t->wake[0];
+  t->io.cb = cb;
+  t->io.arg = arg;
+  return evloop_add(loop, &t->io, EV_READ);
+}
+
+static void * thread_main(void * arg)
+{
+  struct thread * t = (struct thread *)arg;
+
+  if (evloop_run(t->loop) < 0)
+    logmsg(LOG_ERR, "Event loop of thread failed: %s", strerror(errno));
+  return NULL;
+}
+
+/* signals are left to main thread */
+static int thread_start(struct thread * t)
+{
+  sigset_t all, old;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int rc = pthread_create(&t->tid, NULL, thread_main, t);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc)
+  {
+    errno = rc;
+    return -1;
+  }
+  t->running = 1;
+  return 0;
+}
+
+static void thread_stop(struct thread * t)
+{
+  char c = 0;
+
+  if (!t->running)
+    return;
+  __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+  if (write(t->wake[1], &c, 1) < 0 && errno != EAGAIN)
+    logmsg(LOG_ERR, "Failed to wake up thread: %s", strerror(errno));
+  pthread_join(t->tid, NULL);
+  t->running = 0;
+}
+
+/*
+ * Sets up apply threads with their loops and rings, the threads are not
+ * started until worker_start() so that caller may arm timers on their loops.
+ */
+int worker_init(int workers_cnt, int receivers_cnt, worker_apply_cb apply)
+{
+  int i, j;
+
+  nworkers = workers_cnt;
+  nreceivers = receivers_cnt;
+  apply_cb = apply;
+  workers = (struct worker *)calloc(nworkers, sizeof(struct worker));
+  receivers = (struct receiver *)calloc(nreceivers, sizeof(struct receiver));
+  if (!workers || !receivers)
+    return -1;
+
+  for (i = 0; i < nworkers; ++i)
+  {
+    struct worker * w = &workers[i];
+    struct evloop * loop = evloop_new();
+    w->id = i;
+    if (!loop || thread_init(&w->t, loop, on_worker_wake, w) < 0)
+      return -1;
+    if (!(w->rings = (struct ring **)calloc(nreceivers, sizeof(struct ring *))))
+      return -1;
+    for (j = 0; j < nreceivers; ++j)
+      if (!(w->rings[j] = ring_new(WORKER_RING)))
+        return -1;
+  }
+
+  for (i = 0; i < nreceivers; ++i)
+  {
+    struct receiver * r = &receivers[i];
+    r->bufs = (struct tbl_op *)malloc(nworkers * WORKER_BATCH *
+        sizeof(struct tbl_op));
+    r->cnts = (int *)calloc(nworkers, sizeof(int));
+    r->need = (int *)calloc(nworkers, sizeof(int));
+    r->pushed = (char *)calloc(nworkers, 1);
+    r->shedding = (char *)calloc(nworkers, 1);
+    if (!r->bufs || !r->cnts || !r->need || !r->pushed || !r->shedding)
+      return -1;
+  }
+  return 0;
+}
+
+struct evloop * worker_loop(int id)
+{
+  return workers[id].t.loop;
+}
+
+int worker_start(void)
+{
+  int i;
+  for (i = 0; i < nworkers; ++i)
+    if (thread_start(&workers[i].t) < 0)
+      return -1;
+  return 0;
+}
+
+/* runs loop with sockets of receiver in its own thread */
+int worker_rx_start(int receiver, struct evloop * loop)
+{
+  struct thread * t = &receivers[receiver].t;
+  if (thread_init(t, loop, on_rx_wake, t) < 0)
+    return -1;
+  return thread_start(t);
+}
+
+/* moves buffered operations of receiver to ring of apply thread */
+static void worker_push(struct receiver * r, int id)
+{
+  struct worker * w = &workers[id];
+  struct ring * ring = w->rings[r - receivers];
+  struct tbl_op * buf = r->bufs + id * WORKER_BATCH;
+  int done = 0;
+
+  while ((done += ring_push(ring, buf + done, r->cnts[id] - done)) <
+      r->cnts[id])
+  { /* not the case once worker_room() succeeded, just in case */
+    worker_notify(w);
+    sched_yield();
+  }
+  r->cnts[id] = 0;
+  r->pushed[id] = 1;
+}
+
+/*
+ * Waits up to WORKER_WAIT_MS for rings of apply threads to have room for
+ * the message along with what is buffered for them, returns 0 once they do.
+ * Once the wait for apply thread fails messages for it are shed at once
+ * until its ring drains below WORKER_RESUME.
+ */
+static int worker_room(struct receiver * r, const struct tbl_op * ops,
+    int cnt)
+{
+  uint64_t deadline = 0;
+  int i;
+
+  memset(r->need, 0, nworkers * sizeof(int));
+  for (i = 0; i < cnt; ++i)
+    ++r->need[ops[i].table % nworkers];
+  for (i = 0; i < nworkers; ++i)
+  {
+    struct ring * ring = workers[i].rings[r - receivers];
+    if (!r->shedding[i])
+      continue;
+    if (ring_count(ring) >= WORKER_RESUME)
+    {
+      if (r->need[i])
+        return -1;
+    } else
+      r->shedding[i] = 0;
+  }
+  for ( ; ; )
+  {
+    for (i = 0; i < nworkers; ++i)
+    {
+      struct ring * ring = workers[i].rings[r - receivers];
+      if (r->need[i] &&
+          ring->size - ring_count(ring) < r->cnts[i] + r->need[i])
+        break;
+    }
+    if (i == nworkers)
+      return 0;
+    if (!deadline)
+    {
+      STATS_INC(stats.worker_stalls);
+      deadline = stats_usec() + WORKER_WAIT_MS * 1000;
+    } else if (stats_usec() >= deadline)
+    {
+      r->shedding[i] = 1;
+      return -1;
+    }
+    worker_notify(&workers[i]);
+    sched_yield();
+  }
+}
+
+/*
+ * Routes operations of valid tables to apply threads owning them, returns
+ * -1 if message is shed as apply threads are too far behind.
+ */
+int worker_submit(int receiver, const struct tbl_op * ops, int cnt)
+{
+  struct receiver * r = &receivers[receiver];
+  int i;
+
+  if (worker_room(r, ops, cnt) < 0)
+  {
+    STATS_INC(stats.worker_shed);
+    STATS_ADD(stats.worker_shed_ops, cnt);
+    return -1;
+  }
+  for (i = 0; i < cnt; ++i)
+  {
+    int id = ops[i].table % nworkers;
+    r->bufs[id * WORKER_BATCH + r->cnts[id]++] = ops[i];
+    if (r->cnts[id] == WORKER_BATCH)
+      worker_push(r, id);
+  }
+  return 0;
+}
+
+/* hands over everything buffered, called once socket is drained */
+void worker_flush(int receiver)
+{
+  struct receiver * r = &receivers[receiver];
+  int i;
+
+  for (i = 0; i < nworkers; ++i)
+  {
+    if (r->cnts[i])
+      worker_push(r, i);
+    if (r->pushed[i])
+      worker_notify(&workers[i]);
+    r->pushed[i] = 0;
+  }
+}
+
+/* operations queued for apply threads */
+size_t worker_pending(void)
+{
+  size_t cnt = 0;
+  int i, j;
+
+  for (i = 0; i < nworkers; ++i)
+    for (j = 0; j < nreceivers; ++j)
+      cnt += ring_count(workers[i].rings[j]);
+  return cnt;
+}
+
+/* receivers are stopped first for apply threads to drain their rings */
+void worker_stop(void)
+{
+  int i;
+  for (i = 0; i < nreceivers; ++i)
+    thread_stop(&receivers[i].t);
+  for (i = 0; i < nworkers; ++i)
+    thread_stop(&workers[i].t);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2012,
+ * Vadym S. Khondar <v.khondar at invisilabs.com>, InvisiLabs.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the InvisiLabs nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#define WORKER_RING  16384 /* operations queued from receiver to apply thread */
+#define WORKER_BATCH 256   /* operations buffered by receiver per thread */
+#define WORKER_WAIT_MS 20  /* receiver waits for room before shedding */
+#define WORKER_RESUME (WORKER_RING / 4) /* queued ones shedding stops below */
+
+/*
+ * Threaded mode: receiver threads parse datagrams of their own sockets and
+ * hand operations over to apply threads, each of them owning partition of
+ * tables. Every receiver/apply thread pair has its own ring thus no locks
+ * are taken and operations on single table keep order they were received
+ * in by the same receiver. Receiver which finds no room for message waits
+ * for apply threads leaving datagrams in socket meanwhile, message which
+ * still does not fit is shed.
+ */
+typedef void (*worker_apply_cb)(int id, struct tbl_op * ops, int cnt);
+
+int worker_init(int workers, int receivers, worker_apply_cb apply);
+struct evloop * worker_loop(int id);
+int worker_start(void);
+int worker_rx_start(int receiver, struct evloop * loop);
+int worker_submit(int receiver, const struct tbl_op * ops, int cnt);
+size_t worker_pending(void);
+void worker_flush(int receiver);
+void worker_stop(void);
+
+#endif